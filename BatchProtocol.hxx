@@ -0,0 +1,383 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+
+// Fixed-layout admission protocol over Unix datagram sockets, for sidecars
+// where even RESP parsing costs too much. One datagram carries a header
+// and up to kMaxBatch requests; the reply carries the header back and one
+// wait per request, in order: 0 means allowed, and kFull that the server's
+// table had no room for a new key. Both ends run on the same host, so
+// fields are in native byte order.
+struct BatchProtocol
+{
+    static constexpr uint32_t kMagic = 0x54425031;  // "TBP1"
+    static constexpr uint32_t kMaxBatch = 1024;
+    static constexpr int64_t kFull = -1;
+
+    struct Header
+    {
+        uint32_t magic_;
+        uint32_t count_;
+        uint64_t sequence_;
+    };
+
+    struct Request
+    {
+        uint64_t key_;  // the caller's hash of its key
+        uint32_t cost_;
+        uint32_t reserved_;
+    };
+
+    static constexpr size_t kMaxRequestSize = sizeof(Header) + kMaxBatch * sizeof(Request);
+    static constexpr size_t kMaxReplySize = sizeof(Header) + kMaxBatch * sizeof(int64_t);
+
+    static sockaddr_un address_(const std::string &path)
+    {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            throw std::invalid_argument("Socket path must be 1 to 107 bytes");
+        }
+        std::memcpy(address.sun_path, path.data(), path.size());
+        return address;
+    }
+};
+
+// Serves BatchProtocol for one KeyedThrottle. Each round takes every
+// datagram waiting on the socket with one recvmmsg, decides all of their
+// requests with one timestamp, and answers them with one sendmmsg. The
+// server never blocks on a client: a reply that does not fit in the
+// client's queue is dropped, and the client times out as if it were lost.
+class BatchServer
+{
+public:
+    BatchServer(KeyedThrottle &throttle, const std::string &path) : throttle_(throttle), path_(path)
+    {
+        sockaddr_un address = BatchProtocol::address_(path);
+        fd_ = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        int size = 4 << 20;
+        ::setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        ::setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        // A stale socket file from a crashed server would make bind fail.
+        ::unlink(path.c_str());
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "bind");
+        }
+        thread_ = std::thread([this]() { serve_(); });
+    }
+
+    BatchServer(const BatchServer &) = delete;
+    BatchServer &operator=(const BatchServer &) = delete;
+
+    ~BatchServer() { stop(); }
+
+    void stop()
+    {
+        if (running_.exchange(false)) {
+            thread_.join();
+            ::close(fd_);
+            ::unlink(path_.c_str());
+        }
+    }
+
+    const std::string &path() const { return path_; }
+
+    uint64_t decisions() const { return decisions_.load(std::memory_order_relaxed); }
+
+    uint64_t messages() const { return messages_.load(std::memory_order_relaxed); }
+
+    // Malformed datagrams, which are dropped without a reply.
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Replies dropped because the client was not reading or had gone.
+    uint64_t unsent() const { return unsent_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr unsigned kVector = 64;
+    static constexpr int kPollMs = 20;
+
+    void serve_()
+    {
+        std::vector<char> in(kVector * BatchProtocol::kMaxRequestSize);
+        std::vector<char> out(kVector * BatchProtocol::kMaxReplySize);
+        sockaddr_un peers[kVector];
+        iovec in_vectors[kVector], out_vectors[kVector];
+        mmsghdr received[kVector], replies[kVector];
+        for (unsigned i = 0; i < kVector; ++i) {
+            in_vectors[i] = iovec{&in[i * BatchProtocol::kMaxRequestSize], BatchProtocol::kMaxRequestSize};
+        }
+
+        while (running_.load(std::memory_order_acquire)) {
+            pollfd ready{fd_, POLLIN, 0};
+            if (::poll(&ready, 1, kPollMs) <= 0) {
+                continue;
+            }
+            for (unsigned i = 0; i < kVector; ++i) {
+                received[i] = mmsghdr{};
+                received[i].msg_hdr.msg_name = &peers[i];
+                received[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+                received[i].msg_hdr.msg_iov = &in_vectors[i];
+                received[i].msg_hdr.msg_iovlen = 1;
+            }
+            int count = ::recvmmsg(fd_, received, kVector, MSG_DONTWAIT, nullptr);
+            if (count <= 0) {
+                continue;
+            }
+
+            int64_t now = CompactThrottle::now_();
+            unsigned answered = 0;
+            uint64_t decided = 0;
+            for (int i = 0; i < count; ++i) {
+                const char *message = static_cast<const char *>(in_vectors[i].iov_base);
+                BatchProtocol::Header header;
+                if (!valid_(message, received[i].msg_len, header) || received[i].msg_hdr.msg_namelen == 0) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                char *reply = &out[answered * BatchProtocol::kMaxReplySize];
+                std::memcpy(reply, &header, sizeof(header));
+                const char *requests = message + sizeof(header);
+                char *waits = reply + sizeof(header);
+                for (uint32_t j = 0; j < header.count_; ++j) {
+                    BatchProtocol::Request request;
+                    std::memcpy(&request, requests + j * sizeof(request), sizeof(request));
+                    int64_t wait;
+                    try {
+                        wait = throttle_.update_(request.key_, now, request.cost_);
+                    } catch (const std::length_error &) {
+                        wait = BatchProtocol::kFull;
+                    }
+                    std::memcpy(waits + j * sizeof(wait), &wait, sizeof(wait));
+                }
+                decided += header.count_;
+
+                out_vectors[answered] = iovec{reply, sizeof(header) + header.count_ * sizeof(int64_t)};
+                replies[answered] = mmsghdr{};
+                replies[answered].msg_hdr.msg_name = &peers[i];
+                replies[answered].msg_hdr.msg_namelen = received[i].msg_hdr.msg_namelen;
+                replies[answered].msg_hdr.msg_iov = &out_vectors[answered];
+                replies[answered].msg_hdr.msg_iovlen = 1;
+                ++answered;
+            }
+            messages_.fetch_add(static_cast<uint64_t>(count), std::memory_order_relaxed);
+            decisions_.fetch_add(decided, std::memory_order_relaxed);
+            for (unsigned sent = 0; sent < answered;) {
+                int done = ::sendmmsg(fd_, replies + sent, answered - sent, MSG_DONTWAIT);
+                if (done > 0) {
+                    sent += static_cast<unsigned>(done);
+                } else {
+                    unsent_.fetch_add(1, std::memory_order_relaxed);
+                    ++sent;
+                }
+            }
+        }
+    }
+
+    static bool valid_(const char *message, unsigned size, BatchProtocol::Header &header)
+    {
+        if (size < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, message, sizeof(header));
+        return header.magic_ == BatchProtocol::kMagic && header.count_ <= BatchProtocol::kMaxBatch &&
+               size == sizeof(header) + header.count_ * sizeof(BatchProtocol::Request);
+    }
+
+    KeyedThrottle &throttle_;
+    std::string path_;
+    int fd_ = -1;
+    std::atomic<bool> running_{true};
+    std::atomic<uint64_t> decisions_{0};
+    std::atomic<uint64_t> messages_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> unsent_{0};
+    std::thread thread_;
+};
+
+// Client side of BatchProtocol. decide() sends a caller's own batch in one
+// round trip. update_() is for callers with one request each: concurrent
+// callers are combined, so while one round trip is in flight the requests
+// arriving behind it queue up and leave together as the next datagram.
+// The caller that finds no round trip in flight sends the queued batch,
+// its own request among them; once that reply is in, one of the callers
+// queued behind it sends the next, so no caller waits on more than the
+// round trip after its own.
+//
+// A server that does not take the request and answer within timeout_ns
+// throws std::system_error (ETIMEDOUT) to every caller in the batch.
+class BatchClient
+{
+public:
+    BatchClient(const std::string &path, int64_t timeout_ns = 100000000LL)
+        : server_(BatchProtocol::address_(path)), timeout_ns_(timeout_ns)
+    {
+        if (timeout_ns <= 0) {
+            throw std::invalid_argument("Timeout must be positive");
+        }
+        fd_ = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        // Binding only the family autobinds an abstract address for replies.
+        // The socket stays unconnected so that a restarted server is found again.
+        sa_family_t family = AF_UNIX;
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&family), sizeof(family)) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "bind");
+        }
+        if (::access(server_.sun_path, W_OK) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "access");
+        }
+        open_ = std::make_shared<Batch>();
+    }
+
+    BatchClient(const BatchClient &) = delete;
+    BatchClient &operator=(const BatchClient &) = delete;
+
+    ~BatchClient() { ::close(fd_); }
+
+    // Decides count requests (at most kMaxBatch) and stores one wait per request.
+    void decide(const BatchProtocol::Request *requests, size_t count, int64_t *waits)
+    {
+        if (count > BatchProtocol::kMaxBatch) {
+            throw std::invalid_argument("Batch exceeds kMaxBatch");
+        }
+        std::lock_guard<std::mutex> lock(socket_);
+        call_(requests, count, waits);
+    }
+
+    int64_t update_(uint64_t key, uint32_t cost = 1)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return open_->requests_.size() < BatchProtocol::kMaxBatch; });
+        std::shared_ptr<Batch> mine = open_;
+        size_t index = mine->requests_.size();
+        mine->requests_.push_back(BatchProtocol::Request{key, cost, 0});
+
+        // With no round trip in flight, the only batch not yet done is the open one, so mine.
+        done_.wait(lock, [this, &mine]() { return mine->done_ || !sending_; });
+        if (!mine->done_) {
+            sending_ = true;
+            open_ = std::make_shared<Batch>();
+            not_full_.notify_all();
+            lock.unlock();
+            send_(*mine);
+            lock.lock();
+            mine->done_ = true;
+            sending_ = false;
+            // Wakes this batch's callers, and hands the sending to one queued behind it.
+            done_.notify_all();
+        }
+        if (mine->error_ != 0) {
+            throw std::system_error(mine->error_, std::generic_category(), "BatchClient");
+        }
+        return mine->waits_[index];
+    }
+
+    bool update(uint64_t key, uint32_t cost = 1) { return update_(key, cost) == 0; }
+
+    uint64_t round_trips() const { return round_trips_.load(std::memory_order_relaxed); }
+
+private:
+    struct Batch
+    {
+        std::vector<BatchProtocol::Request> requests_;
+        std::vector<int64_t> waits_;
+        int error_ = 0;
+        bool done_ = false;
+    };
+
+    void send_(Batch &batch)
+    {
+        batch.waits_.resize(batch.requests_.size());
+        try {
+            std::lock_guard<std::mutex> lock(socket_);
+            call_(batch.requests_.data(), batch.requests_.size(), batch.waits_.data());
+        } catch (const std::system_error &e) {
+            batch.error_ = e.code().value();
+        }
+    }
+
+    // One round trip; replies to earlier, timed-out calls are skipped by sequence number.
+    void call_(const BatchProtocol::Request *requests, size_t count, int64_t *waits)
+    {
+        int64_t deadline = CompactThrottle::now_() + timeout_ns_;
+        BatchProtocol::Header header{BatchProtocol::kMagic, static_cast<uint32_t>(count), ++sequence_};
+        iovec out[2] = {{&header, sizeof(header)},
+                        {const_cast<BatchProtocol::Request *>(requests), count * sizeof(BatchProtocol::Request)}};
+        msghdr message{};
+        message.msg_name = &server_;
+        message.msg_namelen = sizeof(server_);
+        message.msg_iov = out;
+        message.msg_iovlen = 2;
+        // An unconnected socket cannot poll for room in the server's queue, so a full one is retried each ms.
+        while (::sendmsg(fd_, &message, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                throw std::system_error(errno, std::generic_category(), "sendmsg");
+            }
+            if (CompactThrottle::now_() >= deadline) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "BatchClient");
+            }
+            ::poll(nullptr, 0, 1);
+        }
+        round_trips_.fetch_add(1, std::memory_order_relaxed);
+
+        BatchProtocol::Header reply;
+        iovec in[2] = {{&reply, sizeof(reply)}, {waits, count * sizeof(int64_t)}};
+        message.msg_name = nullptr;
+        message.msg_namelen = 0;
+        message.msg_iov = in;
+        for (;;) {
+            int64_t left = deadline - CompactThrottle::now_();
+            pollfd ready{fd_, POLLIN, 0};
+            if (left <= 0 || ::poll(&ready, 1, static_cast<int>((left + 999999) / 1000000)) <= 0) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), "BatchClient");
+            }
+            ssize_t size = ::recvmsg(fd_, &message, MSG_DONTWAIT);
+            if (size == static_cast<ssize_t>(sizeof(reply) + count * sizeof(int64_t)) &&
+                reply.magic_ == BatchProtocol::kMagic && reply.sequence_ == header.sequence_) {
+                return;
+            }
+        }
+    }
+
+    sockaddr_un server_;
+    int64_t timeout_ns_;
+    int fd_ = -1;
+    uint64_t sequence_ = 0;
+    std::mutex socket_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable done_;
+    std::shared_ptr<Batch> open_;
+    bool sending_ = false;
+    std::atomic<uint64_t> round_trips_{0};
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+// GCRA limiter whose whole state is one 8-byte theoretical arrival time
+// (TAT), so it can be embedded in hash-table slots or user structs and
+// updated with a single CAS. The rate lives outside the state and is
+// passed to every call, which lets many keys share one Rate.
+//
+// Unlike ThrottleControl's sliding log this is a leaky bucket: a full
+// burst of tps is admitted at once, after which admissions are spaced
+// one interval apart.
+class CompactThrottle
+{
+public:
+    struct Rate
+    {
+        int64_t interval_;  // ns charged per unit of cost
+        int64_t window_;    // interval_ * burst
+
+        static Rate per_second(uint32_t tps) { return per_duration(tps, 1000000000LL); }
+
+        static Rate per_duration(uint32_t tps, int64_t duration_ns)
+        {
+            if (tps == 0) {
+                throw std::invalid_argument("TPS must be positive");
+            }
+            if (duration_ns < tps) {
+                throw std::invalid_argument("Duration must be at least one nanosecond per request");
+            }
+            int64_t interval = duration_ns / tps;
+            return Rate{interval, interval * tps};
+        }
+
+        // At most tps in every one-second window, as ThrottleControl's
+        // sliding log allows: a burst of one, and an interval rounded up so
+        // that tps + 1 admissions never fit in a second.
+        static Rate strict_per_second(uint32_t tps)
+        {
+            if (tps == 0) {
+                throw std::invalid_argument("TPS must be positive");
+            }
+            int64_t interval = (1000000000LL + tps - 1) / tps;
+            return Rate{interval, interval};
+        }
+    };
+
+    static int64_t now_()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::high_resolution_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Pure GCRA step: returns the wait in ns (0 when admitted) and, when
+    // admitted, the TAT to publish in next.
+    static int64_t admit_(int64_t tat, const Rate &rate, int64_t now, uint32_t cost, int64_t &next)
+    {
+        next = (tat > now ? tat : now) + rate.interval_ * static_cast<int64_t>(cost);
+        int64_t wait = next - rate.window_ - now;
+        return wait > 0 ? wait : 0;
+    }
+
+    int64_t check_(const Rate &rate, int64_t now, uint32_t cost = 1) const
+    {
+        int64_t next;
+        return admit_(tat_.load(std::memory_order_acquire), rate, now, cost, next);
+    }
+
+    int64_t check_(const Rate &rate) const { return check_(rate, now_()); }
+
+    int64_t update_(const Rate &rate, int64_t now, uint32_t cost = 1)
+    {
+        int64_t tat = tat_.load(std::memory_order_acquire);
+        for (;;) {
+            int64_t next;
+            int64_t wait = admit_(tat, rate, now, cost, next);
+            if (wait > 0) {
+                return wait;
+            }
+            if (tat_.compare_exchange_weak(tat, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return 0;
+            }
+        }
+    }
+
+    int64_t update_(const Rate &rate) { return update_(rate, now_()); }
+
+    // A TAT at or before now behaves exactly like a fresh limiter.
+    bool idle(int64_t now) const { return tat_.load(std::memory_order_acquire) <= now; }
+
+    int64_t tat() const { return tat_.load(std::memory_order_acquire); }
+
+    // Replaces the state, e.g. with a TAT saved before a restart.
+    void restore(int64_t tat) { tat_.store(tat, std::memory_order_release); }
+
+private:
+    std::atomic<int64_t> tat_{0};
+};
+
+static_assert(sizeof(CompactThrottle) == sizeof(int64_t), "CompactThrottle must stay one word");
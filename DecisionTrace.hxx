@@ -0,0 +1,273 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ShardOwners.hxx"
+#include "SpscQueue.hxx"
+
+// Sampled record of admission decisions for offline analysis and replay.
+// Every recording thread owns a SpscQueue ring, so record() is a countdown
+// and, for one decision in sample_every(), a single-producer push; nothing
+// is shared between recording threads. drain() is the only consumer and may
+// run on any thread.
+//
+// A thread takes its ring through ShardOwners on its first sampled decision
+// and keeps it until the thread exits. Decisions from a thread whose ring
+// is held by another, or whose ring is full, are counted in dropped().
+class DecisionTrace
+{
+public:
+    enum Verdict : uint8_t
+    {
+        kAdmitted = 0,
+        kRejected = 1,
+    };
+
+    struct Record
+    {
+        int64_t time_;   // ns, the now the decision was made against
+        // The numeric key, or the hash of a string key; 0 for ThrottleControl. A string key cannot be
+        // told from a numeric one, so a replay sees it as a numeric key equal to the hash.
+        uint64_t key_;
+        int64_t wait_;   // 0 when admitted
+        uint32_t cost_;
+        uint8_t verdict_;
+        uint8_t reserved_[3];
+    };
+    static_assert(sizeof(Record) == 32, "Record is written to files as-is");
+
+    static constexpr size_t kRings = 64;
+
+    struct alignas(64) Ring
+    {
+        uint32_t countdown_ = 0;  // owner only
+        std::unique_ptr<SpscQueue<Record>> queue_;
+    };
+
+    // sample_every 0 records nothing, 1 records every decision.
+    explicit DecisionTrace(size_t ring_capacity = 4096, uint32_t sample_every = 0) : sample_every_(sample_every)
+    {
+        if (ring_capacity == 0) {
+            throw std::invalid_argument("Ring capacity must be positive");
+        }
+        for (auto &ring : rings_) {
+            ring.queue_.reset(new SpscQueue<Record>(ring_capacity));
+        }
+    }
+
+    DecisionTrace(const DecisionTrace &) = delete;
+    DecisionTrace &operator=(const DecisionTrace &) = delete;
+
+    // Takes effect on each thread's next decision.
+    void set_sample_every(uint32_t every) { sample_every_.store(every, std::memory_order_relaxed); }
+
+    uint32_t sample_every() const { return sample_every_.load(std::memory_order_relaxed); }
+
+    void record(int64_t now, uint64_t key, uint32_t cost, int64_t wait)
+    {
+        if (Ring *ring = sample_()) {
+            push_(*ring, now, key, cost, wait);
+        }
+    }
+
+    // The split form lets a limiter read the clock only for sampled decisions:
+    //   if (auto *ring = trace.sample_()) trace.push_(*ring, now, key, cost, wait);
+    Ring *sample_()
+    {
+        uint32_t every = sample_every_.load(std::memory_order_relaxed);
+        if (every == 0) {
+            return nullptr;
+        }
+        size_t index = owners_.claim();
+        if (index == kRings) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        Ring &ring = rings_[index];
+        ring.countdown_ = ring.countdown_ == 0 || ring.countdown_ > every ? every : ring.countdown_;
+        if (--ring.countdown_ > 0) {
+            return nullptr;
+        }
+        ring.countdown_ = every;
+        return &ring;
+    }
+
+    void push_(Ring &ring, int64_t now, uint64_t key, uint32_t cost, int64_t wait)
+    {
+        Record record{now, key, wait, cost, wait == 0 ? kAdmitted : kRejected, {0, 0, 0}};
+        if (!ring.queue_->push(record)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Moves every queued record to sink(const Record *records, size_t count),
+    // one ring at a time and in batches of at most kDrainBatch. Records of one
+    // thread arrive in order; records of different threads are not merged.
+    // Returns how many records were drained.
+    template <typename Sink>
+    size_t drain(Sink &&sink)
+    {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        Record batch[kDrainBatch];
+        size_t total = 0;
+        for (auto &ring : rings_) {
+            size_t count;
+            while ((count = ring.queue_->pop(batch, kDrainBatch)) != 0) {
+                sink(static_cast<const Record *>(batch), count);
+                total += count;
+            }
+        }
+        return total;
+    }
+
+    // Decisions that were sampled, or would have been, but could not be queued.
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kDrainBatch = 256;
+
+    std::atomic<uint32_t> sample_every_;
+    std::atomic<uint64_t> dropped_{0};
+    ShardOwners<kRings> owners_;
+    Ring rings_[kRings];
+    std::mutex drain_mutex_;
+};
+
+// A trace file is a 16-byte header ("THRTRACE", version, record size)
+// followed by DecisionTrace::Record structs in host byte order.
+class TraceFile
+{
+public:
+    static constexpr char kMagic[8] = {'T', 'H', 'R', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t kVersion = 1;
+
+    // Creates or truncates path.
+    explicit TraceFile(const std::string &path) : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))
+    {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        Header header = header_();
+        try {
+            write_(&header, sizeof(header));
+        } catch (...) {
+            ::close(fd_);
+            throw;
+        }
+    }
+
+    TraceFile(const TraceFile &) = delete;
+    TraceFile &operator=(const TraceFile &) = delete;
+
+    ~TraceFile() { ::close(fd_); }
+
+    // Drains trace into the file; returns how many records were written.
+    size_t append(DecisionTrace &trace)
+    {
+        size_t written = trace.drain(
+            [this](const DecisionTrace::Record *records, size_t count) { write_(records, count * sizeof(*records)); });
+        records_ += written;
+        return written;
+    }
+
+    uint64_t records() const { return records_; }
+
+    static std::vector<DecisionTrace::Record> load(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        std::vector<DecisionTrace::Record> records;
+        Header header;
+        Header expected = header_();
+        try {
+            if (read_(fd, &header, sizeof(header)) != sizeof(header) ||
+                std::memcmp(&header, &expected, sizeof(header)) != 0) {
+                throw std::invalid_argument("Not a decision trace: " + path);
+            }
+            DecisionTrace::Record batch[256];
+            size_t got;
+            while ((got = read_(fd, batch, sizeof(batch))) != 0) {
+                if (got % sizeof(DecisionTrace::Record) != 0) {
+                    throw std::invalid_argument("Truncated decision trace: " + path);
+                }
+                records.insert(records.end(), batch, batch + got / sizeof(DecisionTrace::Record));
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        return records;
+    }
+
+private:
+    struct Header
+    {
+        char magic_[8];
+        uint32_t version_;
+        uint32_t record_size_;
+    };
+
+    static Header header_()
+    {
+        Header header;
+        std::memcpy(header.magic_, kMagic, sizeof(kMagic));
+        header.version_ = kVersion;
+        header.record_size_ = sizeof(DecisionTrace::Record);
+        return header;
+    }
+
+    void write_(const void *data, size_t size)
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t sent = ::write(fd_, bytes, size);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "write trace");
+            }
+            bytes += sent;
+            size -= static_cast<size_t>(sent);
+        }
+    }
+
+    // Reads until size bytes or end of file.
+    static size_t read_(int fd, void *data, size_t size)
+    {
+        char *bytes = static_cast<char *>(data);
+        size_t total = 0;
+        while (total < size) {
+            ssize_t got = ::read(fd, bytes + total, size - total);
+            if (got < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "read trace");
+            }
+            if (got == 0) {
+                break;
+            }
+            total += static_cast<size_t>(got);
+        }
+        return total;
+    }
+
+    int fd_;
+    uint64_t records_ = 0;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+
+// Limits only the heaviest talkers in fixed memory. Every request feeds a
+// HeavyKeeper sketch: a few rows of buckets that each hold a 32-bit key
+// fingerprint and a decayed count in one word, updated with a single CAS.
+// A colliding key weakens the owner with probability 1.08^-count, so small
+// flows wash out while heavy ones keep their buckets. Counts halve every
+// window, making them a rolling per-window rate.
+//
+// Keys whose estimate reaches threshold_tps get precise GCRA limiting at
+// tps in a KeyedThrottle sized for top_k keys; everyone else is admitted
+// without per-key state. If that table is ever full, the key is admitted.
+class HeavyHitterThrottle
+{
+public:
+    HeavyHitterThrottle(uint32_t tps, uint32_t threshold_tps, size_t top_k)
+        : rate_(CompactThrottle::Rate::per_second(tps)),
+          threshold_(threshold_tps),
+          width_(round_up_(top_k * kBucketsPerKey)),
+          buckets_(new std::atomic<uint64_t>[kRows * width_]),
+          precise_(rate_, top_k * 2)
+    {
+        if (threshold_tps == 0) {
+            throw std::invalid_argument("Threshold must be positive");
+        }
+        for (size_t i = 0; i < kRows * width_; ++i) {
+            buckets_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    int64_t check_(uint64_t key, int64_t now, uint32_t cost = 1) { return precise_.check_(key, now, cost); }
+
+    int64_t check_(uint64_t key) { return check_(key, CompactThrottle::now_()); }
+
+    int64_t update_(uint64_t key, int64_t now, uint32_t cost = 1)
+    {
+        uint32_t estimate = record_(key, now, cost);
+        if (estimate < threshold_ && !precise_.contains(key)) {
+            return 0;
+        }
+        try {
+            return precise_.update_(key, now, cost);
+        } catch (const std::length_error &) {
+            return 0;
+        }
+    }
+
+    int64_t update_(uint64_t key) { return update_(key, CompactThrottle::now_()); }
+
+    bool check(uint64_t key) { return check_(key) == 0; }
+
+    // Estimated requests of key over roughly the last window.
+    uint32_t estimate(uint64_t key, int64_t now) const
+    {
+        uint64_t hash = hash_(key);
+        uint32_t fingerprint = static_cast<uint32_t>(hash >> 32);
+        uint32_t epoch = epoch_(now);
+        uint32_t estimate = 0;
+        for (size_t row = 0; row < kRows; ++row) {
+            uint64_t word = bucket_(hash, row).load(std::memory_order_relaxed);
+            uint32_t count = aged_(word, epoch);
+            if (owner_(word) == fingerprint && count > estimate) {
+                estimate = count;
+            }
+        }
+        return estimate;
+    }
+
+    // Calls visitor(key, tat) for every key currently under precise limiting.
+    template <typename Visitor>
+    void visit_heavy(Visitor &&visitor) const
+    {
+        precise_.visit(visitor);
+    }
+
+    size_t memory_usage() const
+    {
+        return sizeof(*this) + kRows * width_ * sizeof(std::atomic<uint64_t>) + precise_.memory_usage() -
+               sizeof(precise_);
+    }
+
+private:
+    static constexpr size_t kRows = 2;
+    static constexpr size_t kBucketsPerKey = 8;
+    static constexpr uint32_t kMaxCount = (1u << 24) - 1;
+    static constexpr size_t kDecaySteps = 256;
+
+    // Bucket word: fingerprint (32) | epoch (8) | count (24).
+    static uint32_t owner_(uint64_t word) { return static_cast<uint32_t>(word >> 32); }
+
+    static uint64_t pack_(uint32_t owner, uint32_t epoch, uint32_t count)
+    {
+        return (static_cast<uint64_t>(owner) << 32) | (static_cast<uint64_t>(epoch & 0xff) << 24) | count;
+    }
+
+    static uint32_t aged_(uint64_t word, uint32_t epoch)
+    {
+        uint32_t age = (epoch - static_cast<uint32_t>(word >> 24)) & 0xff;
+        uint32_t count = static_cast<uint32_t>(word) & kMaxCount;
+        return age >= 24 ? 0 : count >> age;
+    }
+
+    uint32_t epoch_(int64_t now) const { return static_cast<uint32_t>(now / rate_.window_) & 0xff; }
+
+    static size_t round_up_(size_t n)
+    {
+        if (n == 0) {
+            throw std::invalid_argument("top_k must be positive");
+        }
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    static uint64_t hash_(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    std::atomic<uint64_t> &bucket_(uint64_t hash, size_t row) const
+    {
+        uint64_t index = hash_(hash + row * 0x9e3779b97f4a7c15ULL) & (width_ - 1);
+        return buckets_[row * width_ + index];
+    }
+
+    // Chance, scaled to 2^32, that an owner with the given count decays.
+    static const std::array<uint32_t, kDecaySteps> &decay_table_()
+    {
+        static const std::array<uint32_t, kDecaySteps> table = []() {
+            std::array<uint32_t, kDecaySteps> probabilities{};
+            for (size_t count = 0; count < kDecaySteps; ++count) {
+                probabilities[count] = static_cast<uint32_t>(std::pow(1.08, -static_cast<double>(count)) * 4294967295.0);
+            }
+            return probabilities;
+        }();
+        return table;
+    }
+
+    static bool decays_(uint32_t count)
+    {
+        thread_local uint64_t state = hash_(reinterpret_cast<uintptr_t>(&state)) | 1;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return count < kDecaySteps && static_cast<uint32_t>(state) < decay_table_()[count];
+    }
+
+    uint32_t record_(uint64_t key, int64_t now, uint32_t cost)
+    {
+        uint64_t hash = hash_(key);
+        uint32_t fingerprint = static_cast<uint32_t>(hash >> 32);
+        uint32_t epoch = epoch_(now);
+        uint32_t estimate = 0;
+
+        for (size_t row = 0; row < kRows; ++row) {
+            std::atomic<uint64_t> &bucket = bucket_(hash, row);
+            uint64_t word = bucket.load(std::memory_order_relaxed);
+            for (;;) {
+                uint32_t count = aged_(word, epoch);
+                uint32_t owner = owner_(word);
+                uint32_t next_count;
+                if (count == 0 || owner == fingerprint) {
+                    next_count = count + cost > kMaxCount ? kMaxCount : count + cost;
+                    owner = fingerprint;
+                } else if (decays_(count)) {
+                    // An owner decayed to zero hands the bucket over to this key.
+                    next_count = count - 1;
+                    if (next_count == 0) {
+                        next_count = cost > kMaxCount ? kMaxCount : cost;
+                        owner = fingerprint;
+                    }
+                } else {
+                    break;
+                }
+                if (bucket.compare_exchange_weak(word, pack_(owner, epoch, next_count), std::memory_order_relaxed)) {
+                    if (owner == fingerprint && next_count > estimate) {
+                        estimate = next_count;
+                    }
+                    break;
+                }
+            }
+        }
+        return estimate;
+    }
+
+    CompactThrottle::Rate rate_;
+    uint32_t threshold_;
+    size_t width_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    KeyedThrottle precise_;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+
+// Nested quotas such as tenant -> user -> endpoint, decided in one call.
+// Each level is a KeyedThrottle keyed by the path prefix, so the same user
+// id under two tenants is two different users.
+//
+// acquire_() reads every level first and only writes when all of them
+// would admit, then commits from the leaf up and refunds the levels already
+// charged if a concurrent request won the race on a later one. Rejections
+// therefore never write to a parent, and a parent is only written by
+// requests it actually admits, which its own rate bounds.
+class HierarchicalThrottle
+{
+public:
+    HierarchicalThrottle(std::initializer_list<uint32_t> tps, size_t capacity)
+    {
+        for (uint32_t level_tps : tps) {
+            rates_.push_back(CompactThrottle::Rate::per_second(level_tps));
+        }
+        init_(capacity);
+    }
+
+    HierarchicalThrottle(std::vector<CompactThrottle::Rate> rates, size_t capacity) : rates_(std::move(rates))
+    {
+        init_(capacity);
+    }
+
+    size_t depth() const { return levels_.size(); }
+
+    // path[0] is the outermost level; a shorter path only charges its prefix levels.
+    int64_t acquire_(const uint64_t *path, size_t length, int64_t now, uint32_t cost = 1)
+    {
+        if (length == 0 || length > levels_.size()) {
+            throw std::invalid_argument("Path length must be between 1 and the number of levels");
+        }
+
+        uint64_t keys[kMaxDepth];
+        keys[0] = path[0];
+        for (size_t level = 1; level < length; ++level) {
+            keys[level] = combine_(keys[level - 1], path[level]);
+        }
+
+        int64_t wait = 0;
+        for (size_t level = length; level-- > 0;) {
+            int64_t level_wait = levels_[level]->check_(keys[level], now, cost);
+            wait = level_wait > wait ? level_wait : wait;
+        }
+        if (wait > 0) {
+            return wait;
+        }
+
+        for (size_t level = length; level-- > 0;) {
+            wait = levels_[level]->update_(keys[level], now, cost);
+            if (wait > 0) {
+                for (size_t charged = level + 1; charged < length; ++charged) {
+                    levels_[charged]->refund_(keys[charged], cost);
+                }
+                return wait;
+            }
+        }
+        return 0;
+    }
+
+    int64_t acquire_(std::initializer_list<uint64_t> path, int64_t now, uint32_t cost = 1)
+    {
+        return acquire_(path.begin(), path.size(), now, cost);
+    }
+
+    int64_t acquire_(std::initializer_list<uint64_t> path) { return acquire_(path, CompactThrottle::now_()); }
+
+    void acquire(std::initializer_list<uint64_t> path)
+    {
+        while (acquire_(path) > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    KeyedThrottle &level(size_t index) { return *levels_.at(index); }
+
+private:
+    static constexpr size_t kMaxDepth = 8;
+
+    static uint64_t combine_(uint64_t parent, uint64_t child)
+    {
+        return parent ^ (child + 0x9e3779b97f4a7c15ULL + (parent << 6) + (parent >> 2));
+    }
+
+    void init_(size_t capacity)
+    {
+        if (rates_.empty() || rates_.size() > kMaxDepth) {
+            throw std::invalid_argument("Level count must be between 1 and 8");
+        }
+        for (const auto &rate : rates_) {
+            levels_.emplace_back(new KeyedThrottle(rate, capacity));
+        }
+    }
+
+    std::vector<CompactThrottle::Rate> rates_;
+    std::vector<std::unique_ptr<KeyedThrottle>> levels_;
+};
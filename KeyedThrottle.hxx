@@ -0,0 +1,948 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "CompactThrottle.hxx"
+#include "DecisionTrace.hxx"
+#include "RateEstimator.hxx"
+#include "ThrottleProbes.hxx"
+
+// Per-key throttling on top of a fixed-capacity open-addressing table.
+// Each 16-byte slot embeds the key and its CompactThrottle TAT, so there
+// is no per-key allocation. Lookups of existing keys never lock; a key's
+// slot is claimed on its first update_() under a small striped lock so two
+// threads can never install the same key twice.
+//
+// Keys are limited by GCRA (see CompactThrottle), not by ThrottleControl's
+// sliding log: a fresh key gets a burst of tps at once and then refills one
+// unit per interval, so any one-second window can admit up to 2 * tps - 1
+// units for a key, while the long-run rate stays tps. Callers that need at
+// most tps in every window pass CompactThrottle::Rate::strict_per_second().
+//
+// A key whose TAT has fallen behind now is indistinguishable from a fresh
+// key, so its slot can be evicted without losing information. Every insert
+// sweeps a few slots past a shared cursor and evicts idle keys with a
+// single CAS; sweep() can also be driven from a background thread. Evicted
+// slots are tombstones that keep probe chains intact. An insert reuses the
+// first tombstone on its chain; once tombstones pass an eighth of the table,
+// sweeps also walk it a chunk at a time, move live keys back over tombstones
+// earlier on their chains, and turn every tombstone that ends its chain back
+// into an empty slot, so churning keys do not leave lookups scanning the
+// whole table. A pass that leaves many tombstones behind and moved nothing is
+// not repeated until another sixteenth of the table has been evicted.
+//
+// String keys (API tokens, URL paths) are looked up by std::string_view
+// without allocating. The slot holds the key's hash and the bytes are
+// interned into an arena only when the key is first inserted; a slot keeps
+// its interned buffer when it is recycled, so the arena is bounded by the
+// longest key each slot has held rather than by every key ever seen.
+class KeyedThrottle
+{
+public:
+    KeyedThrottle(uint32_t tps, size_t capacity) : KeyedThrottle(CompactThrottle::Rate::per_second(tps), capacity) {}
+
+    KeyedThrottle(CompactThrottle::Rate rate, size_t capacity)
+        : rate_(rate), mask_(round_up_(capacity) - 1), slots_(mask_ + 1), reclaim_at_((mask_ + 1) / kReclaimFraction)
+    {
+        if (capacity == 0) {
+            throw std::invalid_argument("Capacity must be positive");
+        }
+    }
+
+    KeyedThrottle(const KeyedThrottle &) = delete;
+    KeyedThrottle &operator=(const KeyedThrottle &) = delete;
+
+    ~KeyedThrottle() { delete[] records_.load(std::memory_order_acquire); }
+
+    int64_t check_(uint64_t key) { return check_(key, CompactThrottle::now_()); }
+
+    int64_t check_(uint64_t key, int64_t now, uint32_t cost = 1) { return check_(key, rate_, now, cost); }
+
+    // A key that has never been updated has its whole quota available. The
+    // rate overloads let callers apply a per-key rate to the same TAT state.
+    int64_t check_(uint64_t key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost = 1)
+    {
+        return check_key_(IdKey{*this, key, hash_(key)}, rate, now, cost);
+    }
+
+    int64_t update_(uint64_t key) { return update_(key, CompactThrottle::now_()); }
+
+    int64_t update_(uint64_t key, int64_t now, uint32_t cost = 1) { return update_(key, rate_, now, cost); }
+
+    int64_t update_(uint64_t key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost = 1)
+    {
+        return update_key_(IdKey{*this, key, hash_(key)}, rate, now, cost);
+    }
+
+    int64_t check_(std::string_view key) { return check_(key, CompactThrottle::now_()); }
+
+    int64_t check_(std::string_view key, int64_t now, uint32_t cost = 1) { return check_(key, rate_, now, cost); }
+
+    int64_t check_(std::string_view key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost = 1)
+    {
+        return check_key_(BytesKey{*this, key, hash_bytes_(key)}, rate, now, cost);
+    }
+
+    int64_t update_(std::string_view key) { return update_(key, CompactThrottle::now_()); }
+
+    int64_t update_(std::string_view key, int64_t now, uint32_t cost = 1) { return update_(key, rate_, now, cost); }
+
+    int64_t update_(std::string_view key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost = 1)
+    {
+        return update_key_(BytesKey{*this, key, hash_bytes_(key)}, rate, now, cost);
+    }
+
+    // Decides a whole batch against one timestamp. Keys are hashed and their
+    // home slots prefetched a block at a time before any of them is evaluated,
+    // so the cache misses of a block overlap instead of being paid one by one.
+    // costs may be null for unit costs. Returns the number of admitted records.
+    size_t decide_batch(const uint64_t *keys, const uint32_t *costs, size_t count, int64_t now, int64_t *out_results)
+    {
+        size_t admitted = 0;
+        uint64_t hashes[kBatchBlock];
+        for (size_t base = 0; base < count; base += kBatchBlock) {
+            size_t block = count - base < kBatchBlock ? count - base : kBatchBlock;
+            for (size_t i = 0; i < block; ++i) {
+                hashes[i] = hash_(keys[base + i]);
+                prefetch_(&slots_[hashes[i] & mask_]);
+            }
+            for (size_t i = 0; i < block; ++i) {
+                uint32_t cost = costs == nullptr ? 1 : costs[base + i];
+                int64_t wait = update_key_(IdKey{*this, keys[base + i], hashes[i]}, rate_, now, cost);
+                out_results[base + i] = wait;
+                admitted += wait == 0;
+            }
+        }
+        return admitted;
+    }
+
+    // Gives back cost units admitted earlier by update_(), e.g. when a later step of the same request fails.
+    void refund_(uint64_t key, uint32_t cost = 1) { refund_(key, rate_, cost); }
+
+    void refund_(uint64_t key, const CompactThrottle::Rate &rate, uint32_t cost = 1)
+    {
+        refund_key_(IdKey{*this, key, hash_(key)}, rate, cost);
+    }
+
+    void refund_(std::string_view key, uint32_t cost = 1)
+    {
+        refund_key_(BytesKey{*this, key, hash_bytes_(key)}, rate_, cost);
+    }
+
+    // The key's current TAT, or 0 when it has no state; e.g. to report how much quota is left.
+    int64_t tat(uint64_t key) { return tat_key_(IdKey{*this, key, hash_(key)}); }
+
+    int64_t tat(std::string_view key) { return tat_key_(BytesKey{*this, key, hash_bytes_(key)}); }
+
+    bool contains(uint64_t key) { return find_(IdKey{*this, key, hash_(key)}) != nullptr; }
+
+    bool contains(std::string_view key) { return find_(BytesKey{*this, key, hash_bytes_(key)}) != nullptr; }
+
+    bool check(uint64_t key) { return check_(key) == 0; }
+
+    void update(uint64_t key)
+    {
+        IdKey id{*this, key, hash_(key)};
+        int64_t now = CompactThrottle::now_();
+        int64_t wait = decide_key_(id, rate_, now, 1);
+        if (DecisionTrace *trace = trace_.load(std::memory_order_relaxed)) {
+            trace->record(now, key, 1, wait);
+        }
+        if (wait > 0) {
+            THROTTLE_PROBE(block_begin, this, id.hash_, wait);
+            while (decide_key_(id, rate_, CompactThrottle::now_(), 1) > 0) {
+                std::this_thread::yield();
+            }
+            THROTTLE_PROBE(block_end, this, id.hash_, wait);
+        }
+        THROTTLE_PROBE(admit, this, id.hash_, 0);
+        if (RateEstimator *rates = rates_.load(std::memory_order_relaxed)) {
+            rates->add(now, 1, 1);
+        }
+    }
+
+    // Evicts idle keys among the next max_slots slots; returns how many were evicted.
+    // A key idle at now is evicted, and a decider whose clock is behind now would
+    // find that key fresh again, so now must not run ahead of any thread's clock.
+    size_t sweep(size_t max_slots, int64_t now)
+    {
+        size_t start = sweep_cursor_.fetch_add(max_slots, std::memory_order_relaxed);
+        size_t evicted = 0;
+        for (size_t i = 0; i < max_slots && i <= mask_; ++i) {
+            Slot &slot = slots_[(start + i) & mask_];
+            int64_t tat = slot.tat_.load(std::memory_order_acquire);
+            if (live_(tat) && tat <= now &&
+                slot.tat_.compare_exchange_strong(tat, kDead, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                size_.fetch_sub(1, std::memory_order_relaxed);
+                dead_.fetch_add(1, std::memory_order_relaxed);
+                ++evicted;
+            }
+        }
+        if (reclaim_left_.load(std::memory_order_relaxed) != 0 ||
+            dead_.load(std::memory_order_relaxed) > reclaim_at_.load(std::memory_order_relaxed)) {
+            reclaim_(max_slots);
+        }
+        return evicted;
+    }
+
+    size_t sweep(size_t max_slots) { return sweep(max_slots, CompactThrottle::now_()); }
+
+    // Calls visitor(key, tat) for every live key; string keys are reported by
+    // their hash. Keys inserted or evicted during the walk may or may not be
+    // seen; reclaim moves no key while a walk is under way.
+    template <typename Visitor>
+    void visit(Visitor &&visitor) const
+    {
+        Visiting visiting(*this);
+        for (const auto &slot : slots_) {
+            int64_t tat = slot.tat_.load(std::memory_order_acquire);
+            if (live_(tat)) {
+                visitor(slot.key_.load(std::memory_order_relaxed), tat);
+            }
+        }
+    }
+
+    // Like visit(), but only numeric keys; a string key's bytes are not in its slot.
+    template <typename Visitor>
+    void visit_ids(Visitor &&visitor) const
+    {
+        Visiting visiting(*this);
+        for (const auto &slot : slots_) {
+            int64_t tat = slot.tat_.load(std::memory_order_acquire);
+            if (live_(tat) && !interned_(slot)) {
+                visitor(slot.key_.load(std::memory_order_relaxed), tat);
+            }
+        }
+    }
+
+    // Like visit(), but only string keys, with their bytes; the view is only
+    // valid during the call. A key whose slot is recycled while its bytes are
+    // copied is skipped.
+    template <typename Visitor>
+    void visit_strings(Visitor &&visitor) const
+    {
+        std::atomic<Record *> *records = records_.load(std::memory_order_acquire);
+        if (records == nullptr) {
+            return;
+        }
+        Visiting visiting(*this);
+        std::string bytes;
+        for (const auto &slot : slots_) {
+            int64_t tat = slot.tat_.load(std::memory_order_acquire);
+            Record *record = records[index_(slot)].load(std::memory_order_acquire);
+            if (!live_(tat) || record == nullptr) {
+                continue;
+            }
+            uint64_t header = record[0].load(std::memory_order_relaxed);
+            size_t length = static_cast<uint32_t>(header);
+            if ((header & kRecordActive) == 0 ||
+                (length + sizeof(uint64_t) - 1) / sizeof(uint64_t) > capacity_(record)) {
+                continue;
+            }
+            bytes.resize(length);
+            for (size_t offset = 0, i = 1; offset < length; offset += sizeof(uint64_t), ++i) {
+                uint64_t word = record[i].load(std::memory_order_relaxed);
+                std::memcpy(&bytes[offset], &word, length - offset < sizeof(word) ? length - offset : sizeof(word));
+            }
+            // A string key's slot holds its hash, so matching bytes cannot belong to a later owner.
+            if (hash_bytes_(bytes) == slot.key_.load(std::memory_order_acquire)) {
+                visitor(std::string_view(bytes), tat);
+            }
+        }
+    }
+
+    // Installs a saved TAT for key, keeping the later of it and any current
+    // one. Returns false when tat is idle at now and so needs no slot.
+    bool restore_(uint64_t key, int64_t tat, int64_t now)
+    {
+        return restore_key_(IdKey{*this, key, hash_(key)}, tat, now);
+    }
+
+    bool restore_(std::string_view key, int64_t tat, int64_t now)
+    {
+        return restore_key_(BytesKey{*this, key, hash_bytes_(key)}, tat, now);
+    }
+
+    const CompactThrottle::Rate &rate() const { return rate_; }
+
+    size_t size() const { return size_.load(std::memory_order_relaxed); }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Evicted slots not yet reused or turned back into chain ends.
+    size_t tombstones() const { return dead_.load(std::memory_order_relaxed); }
+
+    // Slots a lookup of key inspects before finding it or reaching an empty slot.
+    size_t probe_length_(uint64_t key) const
+    {
+        size_t index = hash_(key) & mask_;
+        for (size_t probe = 0; probe <= mask_; ++probe) {
+            const Slot &slot = slots_[(index + probe) & mask_];
+            int64_t tat = slot.tat_.load(std::memory_order_acquire);
+            if (tat == kEmpty || (live_(tat) && slot.key_.load(std::memory_order_relaxed) == key && !interned_(slot))) {
+                return probe + 1;
+            }
+        }
+        return mask_ + 1;
+    }
+
+    size_t memory_usage() const
+    {
+        size_t records = records_.load(std::memory_order_acquire) == nullptr ? 0 : slots_.size() * sizeof(Record *);
+        return sizeof(*this) + slots_.size() * sizeof(Slot) + records + arena_.bytes();
+    }
+
+    // Samples every keyed decision into trace, which must outlive the table
+    // or be detached with nullptr first. Without a trace the hot path pays
+    // one relaxed load.
+    void set_trace(DecisionTrace *trace) { trace_.store(trace, std::memory_order_relaxed); }
+
+    // Feeds the table's decisions into rates, counting cost units rather than
+    // calls; update() counts as one admitted attempt. rates must outlive the
+    // table or be detached first.
+    void set_rates(RateEstimator *rates) { rates_.store(rates, std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kStripes = 64;
+    static constexpr size_t kSweepPerInsert = 4;
+    static constexpr size_t kBatchBlock = 32;
+    static constexpr size_t kReclaimFraction = 8;   // reclaim once 1/8 of the slots are tombstones
+    static constexpr size_t kReclaimSlack = 16;     // or, after a pass, 1/16 more than it left
+    static constexpr size_t kReclaimChunk = 1024;  // slots per hold of the stripe locks
+    static constexpr size_t kReclaimProbes = 8;     // chain slots a chunk may inspect per slot for moves
+
+    // Slot states kept in the TAT word; any other value is a live key.
+    // kEmpty ends a probe chain, kDead is an evicted slot that may be reused.
+    static constexpr int64_t kEmpty = std::numeric_limits<int64_t>::min();
+    static constexpr int64_t kClaiming = kEmpty + 1;
+    static constexpr int64_t kDead = kEmpty + 2;
+    static constexpr int64_t kMoved = kEmpty + 3;  // a key moved out; reusable once a later pass makes it kDead
+
+    struct alignas(16) Slot
+    {
+        std::atomic<uint64_t> key_{0};
+        std::atomic<int64_t> tat_{kEmpty};
+    };
+
+    static_assert(sizeof(Slot) == 16, "KeyedThrottle slots must stay two words");
+
+    static size_t round_up_(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    static bool live_(int64_t tat) { return tat > kMoved; }
+
+    // An interned string key: a header word, then the bytes packed into words.
+    // Header: active (1) | capacity in words (31) | length in bytes (32).
+    using Record = std::atomic<uint64_t>;
+
+    static constexpr uint64_t kRecordActive = 1ULL << 63;
+
+    // Bump allocator for interned keys; only touched when a key is inserted.
+    class Arena
+    {
+    public:
+        Record *allocate(size_t words)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (words > kChunkWords - used_) {
+                size_t chunk_words = words > kChunkWords ? words : kChunkWords;
+                chunks_.emplace_back(new Record[chunk_words]);
+                bytes_.store(bytes_.load(std::memory_order_relaxed) + chunk_words * sizeof(Record),
+                             std::memory_order_relaxed);
+                used_ = chunk_words == kChunkWords ? 0 : kChunkWords;
+                if (chunk_words != kChunkWords) {
+                    return chunks_.back().get();
+                }
+            }
+            Record *record = chunks_.back().get() + used_;
+            used_ += words;
+            return record;
+        }
+
+        // Lock-free, so a metrics scrape never waits on allocate().
+        size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr size_t kChunkWords = 64 * 1024;
+
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Record[]>> chunks_;
+        size_t used_ = kChunkWords;
+        std::atomic<size_t> bytes_{0};  // written under mutex_
+    };
+
+    // The two kinds of key share the table. A numeric key is stored as-is and
+    // must not own an active interned string; a string key stores its hash
+    // and must match its interned bytes.
+    struct IdKey
+    {
+        KeyedThrottle &table_;
+        uint64_t key_;
+        uint64_t hash_;
+
+        uint64_t id() const { return key_; }
+
+        bool matches(const Slot &slot) const
+        {
+            return slot.key_.load(std::memory_order_relaxed) == key_ && !table_.interned_(slot);
+        }
+
+        void claim(Slot &slot) const
+        {
+            slot.key_.store(key_, std::memory_order_relaxed);
+            table_.release_bytes_(slot);
+        }
+    };
+
+    struct BytesKey
+    {
+        KeyedThrottle &table_;
+        std::string_view bytes_;
+        uint64_t hash_;
+
+        uint64_t id() const { return hash_; }
+
+        bool matches(const Slot &slot) const
+        {
+            return slot.key_.load(std::memory_order_relaxed) == hash_ && table_.bytes_equal_(slot, bytes_);
+        }
+
+        void claim(Slot &slot) const
+        {
+            slot.key_.store(hash_, std::memory_order_relaxed);
+            table_.intern_(slot, bytes_);
+        }
+    };
+
+    // The TAT is read before the key, and a recycled slot publishes its new
+    // key before its new TAT, so a matching key means tat belongs to key.
+    template <typename Key>
+    static bool owned_(const Slot &slot, int64_t tat, const Key &key)
+    {
+        return live_(tat) && key.matches(slot);
+    }
+
+    static void prefetch_(const void *address)
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch(address, 1, 3);
+#else
+        (void)address;
+#endif
+    }
+
+    static uint64_t hash_(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    static uint64_t word_(std::string_view bytes, size_t index)
+    {
+        uint64_t word = 0;
+        size_t offset = index * sizeof(uint64_t);
+        size_t length = bytes.size() - offset < sizeof(uint64_t) ? bytes.size() - offset : sizeof(uint64_t);
+        std::memcpy(&word, bytes.data() + offset, length);
+        return word;
+    }
+
+    static size_t words_(std::string_view bytes) { return (bytes.size() + sizeof(uint64_t) - 1) / sizeof(uint64_t); }
+
+    static uint64_t hash_bytes_(std::string_view bytes)
+    {
+        uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (bytes.size() * 0xff51afd7ed558ccdULL);
+        for (size_t i = 0, words = words_(bytes); i < words; ++i) {
+            hash ^= word_(bytes, i);
+            hash *= 0x9fb21c651e98df25ULL;
+            hash ^= hash >> 29;
+        }
+        return hash_(hash);
+    }
+
+    size_t index_(const Slot &slot) const { return static_cast<size_t>(&slot - slots_.data()); }
+
+    bool interned_(const Slot &slot) const
+    {
+        std::atomic<Record *> *records = records_.load(std::memory_order_acquire);
+        if (records == nullptr) {
+            return false;
+        }
+        Record *record = records[index_(slot)].load(std::memory_order_acquire);
+        return record != nullptr && (record[0].load(std::memory_order_relaxed) & kRecordActive) != 0;
+    }
+
+    // Bytes are read with relaxed atomics because a recycled slot rewrites them
+    // in place; a torn read is caught by the TAT changing under the caller.
+    bool bytes_equal_(const Slot &slot, std::string_view bytes) const
+    {
+        std::atomic<Record *> *records = records_.load(std::memory_order_acquire);
+        if (records == nullptr) {
+            return false;
+        }
+        Record *record = records[index_(slot)].load(std::memory_order_acquire);
+        if (record == nullptr || record[0].load(std::memory_order_relaxed) != header_(bytes, capacity_(record))) {
+            return false;
+        }
+        for (size_t i = 0, words = words_(bytes); i < words; ++i) {
+            if (record[1 + i].load(std::memory_order_relaxed) != word_(bytes, i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64_t capacity_(const Record *record)
+    {
+        return (record[0].load(std::memory_order_relaxed) >> 32) & 0x7fffffff;
+    }
+
+    static uint64_t header_(std::string_view bytes, uint64_t capacity)
+    {
+        return kRecordActive | (capacity << 32) | static_cast<uint32_t>(bytes.size());
+    }
+
+    // Called with the slot claimed, so only this thread writes its record.
+    void intern_(Slot &slot, std::string_view bytes)
+    {
+        if (bytes.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("KeyedThrottle key too long");
+        }
+        std::atomic<Record *> *records = records_.load(std::memory_order_acquire);
+        if (records == nullptr) {
+            std::atomic<Record *> *created = new std::atomic<Record *>[slots_.size()]();
+            if (records_.compare_exchange_strong(records, created, std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+                records = created;
+            } else {
+                delete[] created;
+            }
+        }
+
+        std::atomic<Record *> &entry = records[index_(slot)];
+        Record *record = entry.load(std::memory_order_relaxed);
+        uint64_t capacity = record == nullptr ? 0 : capacity_(record);
+        size_t words = words_(bytes);
+        if (record == nullptr || capacity < words) {
+            capacity = round_up_(words == 0 ? 1 : words);
+            record = arena_.allocate(1 + capacity);
+            record[0].store(capacity << 32, std::memory_order_relaxed);
+            entry.store(record, std::memory_order_release);
+        }
+        for (size_t i = 0; i < words; ++i) {
+            record[1 + i].store(word_(bytes, i), std::memory_order_relaxed);
+        }
+        record[0].store(header_(bytes, capacity), std::memory_order_relaxed);
+    }
+
+    void release_bytes_(Slot &slot)
+    {
+        std::atomic<Record *> *records = records_.load(std::memory_order_acquire);
+        if (records == nullptr) {
+            return;
+        }
+        Record *record = records[index_(slot)].load(std::memory_order_relaxed);
+        if (record != nullptr) {
+            record[0].store(capacity_(record) << 32, std::memory_order_relaxed);
+        }
+    }
+
+    // A key being moved back along its chain can be missed by a scan that
+    // passed its new slot before it arrived, so a miss only counts if no moves
+    // overlapped the scan. A scan that saw the old slot given up read a store
+    // made after moves_ turned odd, so the second read of moves_ sees it.
+    template <typename Key>
+    Slot *find_(const Key &key)
+    {
+        size_t index = key.hash_ & mask_;
+        for (;;) {
+            uint64_t moves = moves_.load(std::memory_order_acquire);
+            for (size_t probe = 0; probe <= mask_; ++probe) {
+                Slot &slot = slots_[(index + probe) & mask_];
+                int64_t tat = slot.tat_.load(std::memory_order_acquire);
+                if (tat == kEmpty) {
+                    break;
+                }
+                if (owned_(slot, tat, key)) {
+                    return &slot;
+                }
+            }
+            if ((moves & 1) == 0 && moves_.load(std::memory_order_acquire) == moves) {
+                return nullptr;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    template <typename Key>
+    int64_t tat_key_(const Key &key)
+    {
+        for (;;) {
+            Slot *slot = find_(key);
+            if (slot == nullptr) {
+                return 0;
+            }
+            // Re-reading the TAT confirms the slot was not recycled while the key was compared.
+            int64_t tat = slot->tat_.load(std::memory_order_acquire);
+            if (owned_(*slot, tat, key) && slot->tat_.load(std::memory_order_acquire) == tat) {
+                return tat;
+            }
+        }
+    }
+
+    template <typename Key>
+    int64_t check_key_(const Key &key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost)
+    {
+        int64_t next;
+        return CompactThrottle::admit_(tat_key_(key), rate, now, cost, next);
+    }
+
+    template <typename Key>
+    int64_t update_key_(const Key &key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost)
+    {
+        int64_t wait = decide_key_(key, rate, now, cost);
+        THROTTLE_PROBE_DECISION(this, key.hash_, wait);
+        if (DecisionTrace *trace = trace_.load(std::memory_order_relaxed)) {
+            trace->record(now, key.id(), cost, wait);
+        }
+        if (RateEstimator *rates = rates_.load(std::memory_order_relaxed)) {
+            rates->add(now, cost, wait == 0 ? cost : 0);
+        }
+        return wait;
+    }
+
+    template <typename Key>
+    int64_t decide_key_(const Key &key, const CompactThrottle::Rate &rate, int64_t now, uint32_t cost)
+    {
+        for (;;) {
+            Slot *slot = find_(key);
+            if (slot == nullptr) {
+                // A new key starts fresh, so a rejected first request needs no slot at all.
+                int64_t next;
+                int64_t wait = CompactThrottle::admit_(0, rate, now, cost, next);
+                if (wait > 0) {
+                    return wait;
+                }
+                bool inserted = false;
+                slot = insert_(key, next, inserted);
+                if (inserted) {
+                    sweep(kSweepPerInsert, now);
+                    return 0;
+                }
+            }
+
+            // Leaving the inner loop means the slot was evicted, recycled or moved underneath us.
+            int64_t tat = slot->tat_.load(std::memory_order_acquire);
+            while (owned_(*slot, tat, key)) {
+                int64_t next;
+                int64_t wait = CompactThrottle::admit_(tat, rate, now, cost, next);
+                if (wait > 0) {
+                    return wait;
+                }
+                if (slot->tat_.compare_exchange_weak(tat, next, std::memory_order_acq_rel,
+                                                     std::memory_order_acquire)) {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    template <typename Key>
+    bool restore_key_(const Key &key, int64_t tat, int64_t now)
+    {
+        if (tat <= now) {
+            return false;
+        }
+        for (;;) {
+            Slot *slot = find_(key);
+            if (slot == nullptr) {
+                bool inserted = false;
+                slot = insert_(key, tat, inserted);
+                if (inserted) {
+                    return true;
+                }
+            }
+            int64_t current = slot->tat_.load(std::memory_order_acquire);
+            while (owned_(*slot, current, key)) {
+                if (current >= tat || slot->tat_.compare_exchange_weak(current, tat, std::memory_order_acq_rel,
+                                                                       std::memory_order_acquire)) {
+                    return true;
+                }
+            }
+        }
+    }
+
+    template <typename Key>
+    void refund_key_(const Key &key, const CompactThrottle::Rate &rate, uint32_t cost)
+    {
+        for (;;) {
+            Slot *slot = find_(key);
+            if (slot == nullptr) {
+                return;
+            }
+            // Leaving the inner loop means the slot was evicted, recycled or moved underneath us.
+            int64_t tat = slot->tat_.load(std::memory_order_acquire);
+            while (owned_(*slot, tat, key)) {
+                if (slot->tat_.compare_exchange_weak(tat, tat - rate.interval_ * static_cast<int64_t>(cost),
+                                                     std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    return;
+                }
+            }
+        }
+    }
+
+    // Installs key with the given TAT, or returns its slot if another thread got there first.
+    template <typename Key>
+    Slot *insert_(const Key &key, int64_t tat, bool &inserted)
+    {
+        std::lock_guard<std::mutex> lock(stripes_[(key.hash_ >> 58) % kStripes]);
+
+        size_t index = key.hash_ & mask_;
+        for (;;) {
+            // The key may sit past evicted slots, so scan to the end of the chain before reusing one.
+            Slot *reusable = nullptr;
+            for (size_t probe = 0; probe <= mask_; ++probe) {
+                Slot &slot = slots_[(index + probe) & mask_];
+                int64_t state = slot.tat_.load(std::memory_order_acquire);
+                if (live_(state)) {
+                    // Only this stripe inserts this key, so the key check cannot race with our own claim.
+                    if (key.matches(slot)) {
+                        return &slot;
+                    }
+                    continue;
+                }
+                if ((state == kEmpty || state == kDead) && reusable == nullptr) {
+                    reusable = &slot;
+                }
+                if (state == kEmpty) {
+                    break;
+                }
+            }
+            if (reusable == nullptr) {
+                throw std::length_error("KeyedThrottle capacity exhausted");
+            }
+
+            int64_t state = reusable->tat_.load(std::memory_order_acquire);
+            if ((state == kEmpty || state == kDead) &&
+                reusable->tat_.compare_exchange_strong(state, kClaiming, std::memory_order_acq_rel,
+                                                       std::memory_order_acquire)) {
+                if (state == kDead) {
+                    dead_.fetch_sub(1, std::memory_order_relaxed);
+                }
+                try {
+                    key.claim(*reusable);
+                } catch (...) {
+                    if (state == kDead) {
+                        dead_.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    reusable->tat_.store(state, std::memory_order_release);
+                    throw;
+                }
+                // The slot was evicted at or before now and tat lies after now, so a stale
+                // CAS from the slot's previous owner can never match the new value.
+                reusable->tat_.store(tat, std::memory_order_release);
+                size_.fetch_add(1, std::memory_order_relaxed);
+                inserted = true;
+                return reusable;
+            }
+            // Another stripe took the slot first; rescan.
+        }
+    }
+
+    // Walks the table downwards from the top, at least a chunk per call, holding
+    // every stripe so no insert can be scanning or claiming meanwhile. A live
+    // key moves into the first tombstone on its chain, and a tombstone that no
+    // key's chain crosses becomes empty; walking downwards, the lowest home of
+    // the keys above the cursor says which those are. Lock-free lookups only
+    // ever see a chain end appear over slots no chain needs, or a key move
+    // earlier on its chain, which find_() catches through moves_.
+    void reclaim_(size_t max_slots)
+    {
+        if (reclaiming_.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        size_t left = reclaim_left_.load(std::memory_order_relaxed);
+        if (left == 0) {
+            left = mask_ + 1;
+            reclaim_moved_ = 0;
+        }
+        size_t walked = 0;
+        do {
+            size_t begin = left > kReclaimChunk ? left - kReclaimChunk : 0;
+            for (auto &stripe : stripes_) {
+                stripe.lock();
+            }
+            bool moving = false;
+            size_t budget = kReclaimChunk * kReclaimProbes;
+            int64_t reach = reach_(left, budget);
+            for (size_t i = left; i-- > begin;) {
+                Slot &slot = slots_[i];
+                int64_t state = slot.tat_.load(std::memory_order_acquire);
+                if (state == kMoved) {
+                    // A decider that read the old TAT here would have had to stall across a whole pass.
+                    slot.tat_.store(kDead, std::memory_order_release);
+                    state = kDead;
+                }
+                if (live_(state)) {
+                    size_t distance = distance_(slot, i);
+                    reclaim_moved_ += move_(i, state, distance, moving, budget);
+                    reach = std::min(reach, static_cast<int64_t>(i) - static_cast<int64_t>(distance));
+                } else if (state == kDead && static_cast<int64_t>(i) < reach) {
+                    slot.tat_.store(kEmpty, std::memory_order_release);
+                    dead_.fetch_sub(1, std::memory_order_relaxed);
+                    reach = std::numeric_limits<int64_t>::max();
+                } else if (state == kEmpty) {
+                    reach = std::numeric_limits<int64_t>::max();
+                }
+            }
+            if (moving) {
+                moves_.fetch_add(1, std::memory_order_release);
+            }
+            for (auto &stripe : stripes_) {
+                stripe.unlock();
+            }
+            walked += left - begin;
+            left = begin;
+        } while (left > 0 && walked < max_slots);
+        if (left == 0) {
+            // Unless keys moved, the tombstones left sit on live chains and only evictions free more.
+            size_t dead = dead_.load(std::memory_order_relaxed);
+            size_t floor = (mask_ + 1) / kReclaimFraction;
+            size_t next = reclaim_moved_ != 0 ? floor : dead + (mask_ + 1) / kReclaimSlack;
+            reclaim_at_.store(next > floor ? next : floor, std::memory_order_relaxed);
+        }
+        reclaim_left_.store(left, std::memory_order_relaxed);
+        reclaiming_.store(false, std::memory_order_release);
+    }
+
+    // The lowest slot the chains of keys at or above left reach down to, counting
+    // slots past the top of the table from its end; the minimum when that is not
+    // known within budget.
+    int64_t reach_(size_t left, size_t &budget) const
+    {
+        int64_t reach = std::numeric_limits<int64_t>::max();
+        for (size_t step = 0; step <= mask_ && budget > 0; ++step, --budget) {
+            size_t index = (left + step) & mask_;
+            int64_t state = slots_[index].tat_.load(std::memory_order_acquire);
+            if (state == kEmpty) {
+                return reach;
+            }
+            if (live_(state)) {
+                reach = std::min(reach, static_cast<int64_t>(left + step - distance_(slots_[index], index)));
+            }
+        }
+        return std::numeric_limits<int64_t>::min();
+    }
+
+    // How far the key at index sits past its home slot.
+    size_t distance_(const Slot &slot, size_t index) const
+    {
+        uint64_t key = slot.key_.load(std::memory_order_relaxed);
+        return (index - ((interned_(slot) ? key : hash_(key)) & mask_)) & mask_;
+    }
+
+    // Moves the live key at index, distance past its home, into the first dead
+    // slot on its chain, if any within budget; returns whether it moved. The old
+    // slot becomes kMoved, so a decider's stale CAS on it fails, and a later
+    // pass frees it. The first move of a chunk makes moves_ odd, unless a visit
+    // is under way.
+    bool move_(size_t index, int64_t tat, size_t distance, bool &moving, size_t &budget)
+    {
+        Slot &from = slots_[index];
+        size_t home = (index - distance) & mask_;
+        Slot *to = nullptr;
+        for (size_t probe = 0; probe < distance && budget > 0; ++probe, --budget) {
+            Slot &slot = slots_[(home + probe) & mask_];
+            if (slot.tat_.load(std::memory_order_acquire) == kDead) {
+                to = &slot;
+                break;
+            }
+        }
+        if (to == nullptr) {
+            return false;
+        }
+        if (!moving) {
+            moves_.fetch_add(1, std::memory_order_seq_cst);
+            moving = true;
+        }
+        if (visitors_.load(std::memory_order_seq_cst) != 0) {
+            return false;
+        }
+        while (!from.tat_.compare_exchange_weak(tat, kMoved, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            if (!live_(tat)) {
+                return false;
+            }
+        }
+        to->key_.store(from.key_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        if (std::atomic<Record *> *records = records_.load(std::memory_order_acquire)) {
+            std::atomic<Record *> &a = records[index_(*to)];
+            std::atomic<Record *> &b = records[index];
+            Record *record = a.load(std::memory_order_relaxed);
+            a.store(b.load(std::memory_order_relaxed), std::memory_order_release);
+            b.store(record, std::memory_order_release);
+        }
+        to->tat_.store(tat, std::memory_order_release);
+        return true;
+    }
+
+    // Holds off moves for the length of a visit, so a key cannot move past the walk.
+    class Visiting
+    {
+    public:
+        explicit Visiting(const KeyedThrottle &table) : table_(table)
+        {
+            table_.visitors_.fetch_add(1, std::memory_order_seq_cst);
+            while ((table_.moves_.load(std::memory_order_seq_cst) & 1) != 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        Visiting(const Visiting &) = delete;
+        Visiting &operator=(const Visiting &) = delete;
+
+        ~Visiting() { table_.visitors_.fetch_sub(1, std::memory_order_release); }
+
+    private:
+        const KeyedThrottle &table_;
+    };
+
+    CompactThrottle::Rate rate_;
+    size_t mask_;
+    std::vector<Slot> slots_;
+    std::atomic<uint64_t> moves_{0};  // odd while reclaim is moving keys
+    mutable std::atomic<size_t> visitors_{0};
+    std::array<std::mutex, kStripes> stripes_;
+    std::atomic<size_t> size_{0};
+    std::atomic<size_t> sweep_cursor_{0};
+    std::atomic<size_t> dead_{0};
+    std::atomic<size_t> reclaim_at_;       // tombstones that start a reclaim pass
+    std::atomic<size_t> reclaim_left_{0};  // slots below the cursor of the pass under way
+    size_t reclaim_moved_ = 0;             // keys moved by that pass, under reclaiming_
+    std::atomic<bool> reclaiming_{false};
+    std::atomic<std::atomic<Record *> *> records_{nullptr};
+    Arena arena_;
+    std::atomic<DecisionTrace *> trace_{nullptr};
+    std::atomic<RateEstimator *> rates_{nullptr};
+};
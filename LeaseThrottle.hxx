@@ -0,0 +1,497 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+
+// Hands out a global quota in batches. The pool is one CompactThrottle at
+// the global rate; a grant of n tokens is one admission of cost n, and
+// tokens handed back move the TAT back. Every grant is a lease: the node
+// may only spend it for lease_ns, after which unspent tokens are returned
+// (or simply lapse), so at any moment the global rate is exceeded by at
+// most the tokens outstanding in unexpired leases.
+//
+// This serves UDP on loopback, one datagram per message, so the protocol
+// and failover can be exercised on one machine; a production deployment
+// replaces only the transport.
+class QuotaCoordinator
+{
+public:
+    static constexpr uint32_t kAcquire = 1;
+    static constexpr uint32_t kReturn = 2;
+
+    struct Request
+    {
+        uint32_t type_;
+        uint32_t tokens_;    // wanted, for kAcquire
+        uint32_t returned_;  // unspent tokens from expired leases
+        uint32_t minimum_;   // grant nothing rather than fewer than this
+        uint64_t sequence_;
+    };
+
+    struct Reply
+    {
+        uint64_t sequence_;
+        uint32_t granted_;
+        uint32_t reserved_;
+        int64_t lease_ns_;
+        int64_t wait_;  // when nothing was granted, ns until the pool has a token again
+    };
+
+    QuotaCoordinator(uint32_t tps, uint16_t port = 0, int64_t lease_ns = 100000000LL)
+        : rate_(CompactThrottle::Rate::per_second(tps)), lease_ns_(lease_ns)
+    {
+        if (lease_ns <= 0) {
+            throw std::invalid_argument("Lease duration must be positive");
+        }
+        fd_ = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        int one = 1;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::getsockname(fd_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "bind");
+        }
+        port_ = ntohs(address.sin_port);
+        thread_ = std::thread([this]() { serve_(); });
+    }
+
+    QuotaCoordinator(const QuotaCoordinator &) = delete;
+    QuotaCoordinator &operator=(const QuotaCoordinator &) = delete;
+
+    ~QuotaCoordinator() { stop(); }
+
+    void stop()
+    {
+        if (running_.exchange(false)) {
+            thread_.join();
+            ::close(fd_);
+        }
+    }
+
+    uint16_t port() const { return port_; }
+
+    uint64_t granted() const { return granted_.load(std::memory_order_relaxed); }
+
+    uint64_t returned() const { return returned_.load(std::memory_order_relaxed); }
+
+    uint64_t requests() const { return requests_.load(std::memory_order_relaxed); }
+
+    // Grants up to tokens from the pool, but not fewer than minimum, so a
+    // drained pool is not handed out one token per round trip. Only the
+    // serving thread calls this.
+    uint32_t grant_(uint32_t tokens, int64_t now, int64_t &wait, uint32_t minimum = 1)
+    {
+        int64_t tat = pool_.tat();
+        int64_t base = tat > now ? tat : now;
+        int64_t available = (now + rate_.window_ - base) / rate_.interval_;
+        uint32_t grant = available < static_cast<int64_t>(tokens) ? static_cast<uint32_t>(available) : tokens;
+        minimum = minimum < tokens ? minimum : tokens;
+        if (grant == 0 || grant < minimum) {
+            int64_t burst = rate_.window_ / rate_.interval_;
+            wait = pool_.check_(rate_, now, static_cast<uint32_t>(minimum < burst ? minimum : burst));
+            wait = wait > 0 ? wait : rate_.interval_;
+            return 0;
+        }
+        pool_.update_(rate_, now, grant);
+        wait = 0;
+        granted_.fetch_add(grant, std::memory_order_relaxed);
+        return grant;
+    }
+
+    // A TAT moved back before now is the same as a full pool.
+    void return_(uint32_t tokens, int64_t now)
+    {
+        int64_t tat = pool_.tat() - rate_.interval_ * static_cast<int64_t>(tokens);
+        pool_.restore(tat > now ? tat : now);
+        returned_.fetch_add(tokens, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int kPollMs = 20;
+
+    void serve_()
+    {
+        while (running_.load(std::memory_order_acquire)) {
+            pollfd ready{fd_, POLLIN, 0};
+            if (::poll(&ready, 1, kPollMs) <= 0) {
+                continue;
+            }
+            Request request;
+            sockaddr_in peer{};
+            socklen_t length = sizeof(peer);
+            ssize_t size = ::recvfrom(fd_, &request, sizeof(request), 0, reinterpret_cast<sockaddr *>(&peer), &length);
+            if (size != sizeof(request)) {
+                continue;
+            }
+            requests_.fetch_add(1, std::memory_order_relaxed);
+            int64_t now = CompactThrottle::now_();
+            if (request.returned_ != 0) {
+                return_(request.returned_, now);
+            }
+            if (request.type_ != kAcquire) {
+                continue;
+            }
+            Reply reply{request.sequence_, 0, 0, lease_ns_, 0};
+            reply.granted_ = grant_(request.tokens_, now, reply.wait_, request.minimum_);
+            ::sendto(fd_, &reply, sizeof(reply), 0, reinterpret_cast<sockaddr *>(&peer), length);
+        }
+    }
+
+    CompactThrottle::Rate rate_;
+    int64_t lease_ns_;
+    CompactThrottle pool_;
+    int fd_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> running_{true};
+    std::atomic<uint64_t> granted_{0};
+    std::atomic<uint64_t> returned_{0};
+    std::atomic<uint64_t> requests_{0};
+    std::thread thread_;
+};
+
+// A node's share of a QuotaCoordinator's global quota. Requests spend
+// tokens from a locally held lease with one CAS; the coordinator is only
+// contacted when the lease runs low, runs out or expires. Batch sizes
+// follow demand: each refill asks for about one lease period's worth of
+// the rate observed since the previous refill.
+//
+// If the coordinator does not answer within rpc_timeout_ns the node falls
+// back to a local limit of fallback_tps (typically global / nodes) and
+// tries the coordinator again after retry_ns. The fallback starts with the
+// node's unspent lease tokens as its burst rather than a fresh one, so a
+// timeout adds no burst on top of tokens the node already holds; while it
+// lasts, the node still admits up to fallback_tps on top of what the
+// coordinator grants the other nodes. A grant whose reply arrives after the
+// timeout is handed back with the next request.
+class LeaseThrottle
+{
+public:
+    struct Options
+    {
+        uint32_t fallback_tps_;
+        uint32_t min_batch_ = 16;
+        uint32_t max_batch_ = 4096;
+        int64_t rpc_timeout_ns_ = 5000000LL;
+        int64_t retry_ns_ = 100000000LL;
+    };
+
+    LeaseThrottle(uint16_t coordinator_port, const Options &options)
+        : options_(options), fallback_rate_(CompactThrottle::Rate::per_second(options.fallback_tps_)),
+          batch_(options.min_batch_)
+    {
+        if (options.min_batch_ == 0 || options.min_batch_ > options.max_batch_) {
+            throw std::invalid_argument("Batch sizes must satisfy 0 < min <= max");
+        }
+        fd_ = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(coordinator_port);
+        if (::connect(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "connect");
+        }
+    }
+
+    LeaseThrottle(const LeaseThrottle &) = delete;
+    LeaseThrottle &operator=(const LeaseThrottle &) = delete;
+
+    ~LeaseThrottle()
+    {
+        release();
+        ::close(fd_);
+    }
+
+    int64_t update_(int64_t now, uint32_t cost = 1)
+    {
+        attempted_.fetch_add(cost, std::memory_order_relaxed);
+        int64_t wait = decide_(now, cost);
+        if (wait > 0) {
+            rejected_.fetch_add(cost, std::memory_order_relaxed);
+        }
+        return wait;
+    }
+
+    int64_t update_() { return update_(CompactThrottle::now_()); }
+
+    void update()
+    {
+        while (update_() > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Changes the fallback rate, the node's share of the global rate while it is
+    // on its own; e.g. from a QuotaRebalancer, so that share follows the node's
+    // demand instead of a static split. The fallback's TAT carries over.
+    void set_tps(uint32_t tps)
+    {
+        CompactThrottle::Rate rate = CompactThrottle::Rate::per_second(tps);
+        std::lock_guard<std::mutex> lock(refill_mutex_);
+        fallback_rate_ = rate;
+        options_.fallback_tps_ = tps;
+    }
+
+    uint32_t tps() const
+    {
+        std::lock_guard<std::mutex> lock(refill_mutex_);
+        return options_.fallback_tps_;
+    }
+
+    // Units attempted and rejected by update_(), leased or not.
+    uint64_t attempted() const { return attempted_.load(std::memory_order_relaxed); }
+
+    uint64_t rejected() const { return rejected_.load(std::memory_order_relaxed); }
+
+    // Hands all unspent tokens back to the coordinator now.
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(refill_mutex_);
+        collect_late_();
+        uint32_t unspent = drain_() + pending_return_;
+        pending_return_ = 0;
+        if (unspent != 0) {
+            QuotaCoordinator::Request request{QuotaCoordinator::kReturn, 0, unspent, 0, ++sequence_};
+            ::send(fd_, &request, sizeof(request), MSG_DONTWAIT);
+        }
+    }
+
+    // False while running on the fallback limit.
+    bool leased() const
+    {
+        std::lock_guard<std::mutex> lock(refill_mutex_);
+        return down_until_ == 0;
+    }
+
+    uint32_t batch() const { return batch_.load(std::memory_order_relaxed); }
+
+    uint32_t tokens() const { return static_cast<uint32_t>(bucket_.load(std::memory_order_acquire)); }
+
+    uint64_t refills() const { return refills_.load(std::memory_order_relaxed); }
+
+    // Times the node has switched to the fallback limit.
+    uint64_t fallbacks() const { return fallbacks_.load(std::memory_order_relaxed); }
+
+private:
+    int64_t decide_(int64_t now, uint32_t cost)
+    {
+        uint32_t left;
+        if (take_(now, cost, left)) {
+            // Prefetch the next batch before the lease runs dry; whoever crosses the mark refills.
+            if (left < low_mark_.load(std::memory_order_relaxed)) {
+                std::unique_lock<std::mutex> lock(refill_mutex_, std::try_to_lock);
+                if (lock.owns_lock() && empty_until_ <= now && down_until_ <= now) {
+                    refill_(now);
+                }
+            }
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> lock(refill_mutex_);
+        if (take_(now, cost, left)) {
+            return 0;
+        }
+        if (down_until_ > now) {
+            return fallback_.update_(fallback_rate_, now, cost);
+        }
+        // The pool was empty at the last refill; asking again before it refills only adds round trips.
+        if (empty_until_ > now) {
+            return empty_until_ - now;
+        }
+        int64_t wait = refill_(now);
+        if (down_until_ > now) {
+            return fallback_.update_(fallback_rate_, now, cost);
+        }
+        if (take_(now, cost, left)) {
+            return 0;
+        }
+        return wait > 0 ? wait : fallback_rate_.interval_;
+    }
+
+    // Bucket word: lease generation (32) | tokens left (32).
+    bool take_(int64_t now, uint32_t cost, uint32_t &left)
+    {
+        uint64_t word = bucket_.load(std::memory_order_acquire);
+        for (;;) {
+            uint32_t tokens = static_cast<uint32_t>(word);
+            if (tokens < cost || expires_.load(std::memory_order_acquire) <= now) {
+                return false;
+            }
+            if (bucket_.compare_exchange_weak(word, word - cost, std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+                left = tokens - cost;
+                spent_.fetch_add(cost, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    // Empties the bucket under a new generation so concurrent takes fail; returns what was left.
+    uint32_t drain_()
+    {
+        uint64_t word = bucket_.load(std::memory_order_acquire);
+        while (!bucket_.compare_exchange_weak(word, ((word >> 32) + 1) << 32, std::memory_order_acq_rel,
+                                              std::memory_order_acquire)) {
+        }
+        return static_cast<uint32_t>(word);
+    }
+
+    // Called with refill_mutex_ held. Returns the coordinator's wait when it granted nothing.
+    int64_t refill_(int64_t now)
+    {
+        int64_t elapsed = now - last_refill_;
+        uint64_t spent = spent_.load(std::memory_order_relaxed);
+        if (last_refill_ != 0 && elapsed > 0) {
+            double demand = static_cast<double>(spent - spent_at_refill_) * 1e9 / static_cast<double>(elapsed);
+            double wanted = demand * static_cast<double>(lease_ns_) / 1e9;
+            uint32_t size = wanted < options_.min_batch_ ? options_.min_batch_
+                            : wanted > options_.max_batch_ ? options_.max_batch_
+                                                           : static_cast<uint32_t>(wanted);
+            batch_.store(size, std::memory_order_relaxed);
+            low_mark_.store(size / 4, std::memory_order_relaxed);
+        }
+
+        // Tokens of a lease that has expired are not ours to spend any more.
+        if (expires_.load(std::memory_order_acquire) <= now) {
+            pending_return_ += drain_();
+        }
+
+        collect_late_();
+        QuotaCoordinator::Request request{QuotaCoordinator::kAcquire, batch_.load(std::memory_order_relaxed),
+                                          pending_return_, options_.min_batch_, ++sequence_};
+        if (::send(fd_, &request, sizeof(request), 0) != sizeof(request)) {
+            fall_back_(now);
+            return 0;
+        }
+        // Handed over once: if the request is lost they lapse, rather than risk being counted back twice.
+        pending_return_ = 0;
+        QuotaCoordinator::Reply reply;
+        if (!await_(request.sequence_, reply)) {
+            fall_back_(now);
+            return 0;
+        }
+        down_until_ = 0;
+        last_refill_ = now;
+        spent_at_refill_ = spent;
+        refills_.fetch_add(1, std::memory_order_relaxed);
+        lease_ns_ = reply.lease_ns_;
+        empty_until_ = reply.granted_ == 0 ? now + reply.wait_ : 0;
+        if (reply.granted_ == 0) {
+            return reply.wait_;
+        }
+
+        // Unspent tokens of the current lease join the new one; the lease clock restarts.
+        uint64_t word = bucket_.load(std::memory_order_acquire);
+        uint64_t fresh;
+        do {
+            fresh = (((word >> 32) + 1) << 32) | (static_cast<uint32_t>(word) + reply.granted_);
+        } while (!bucket_.compare_exchange_weak(word, fresh, std::memory_order_acq_rel, std::memory_order_acquire));
+        expires_.store(now + reply.lease_ns_, std::memory_order_release);
+        return 0;
+    }
+
+    // Called with refill_mutex_ held. Replies to earlier requests that timed
+    // out are skipped, and their grants handed back.
+    bool await_(uint64_t sequence, QuotaCoordinator::Reply &reply)
+    {
+        int64_t deadline = CompactThrottle::now_() + options_.rpc_timeout_ns_;
+        for (;;) {
+            int64_t remaining = deadline - CompactThrottle::now_();
+            if (remaining <= 0) {
+                return false;
+            }
+            pollfd ready{fd_, POLLIN, 0};
+            int timeout_ms = static_cast<int>((remaining + 999999) / 1000000);
+            if (::poll(&ready, 1, timeout_ms) <= 0) {
+                continue;
+            }
+            ssize_t size = ::recv(fd_, &reply, sizeof(reply), MSG_DONTWAIT);
+            if (size < 0 && errno == ECONNREFUSED) {
+                return false;
+            }
+            if (size != sizeof(reply)) {
+                continue;
+            }
+            if (reply.sequence_ == sequence) {
+                return true;
+            }
+            pending_return_ += reply.granted_;
+        }
+    }
+
+    // Called with refill_mutex_ held; picks up replies that arrived after their request timed out.
+    void collect_late_()
+    {
+        QuotaCoordinator::Reply reply;
+        while (::recv(fd_, &reply, sizeof(reply), MSG_DONTWAIT) == sizeof(reply)) {
+            pending_return_ += reply.granted_;
+        }
+    }
+
+    // Called with refill_mutex_ held. On the switch, the lease's unspent tokens
+    // become the fallback's burst instead of being spendable beside a full one.
+    void fall_back_(int64_t now)
+    {
+        if (down_until_ == 0) {
+            int64_t burst = fallback_rate_.window_ / fallback_rate_.interval_;
+            int64_t unspent = drain_();
+            int64_t credit = unspent < burst ? unspent : burst;
+            fallback_.restore(now + fallback_rate_.window_ - credit * fallback_rate_.interval_);
+            fallbacks_.fetch_add(1, std::memory_order_relaxed);
+        }
+        down_until_ = now + options_.retry_ns_;
+    }
+
+    Options options_;
+    CompactThrottle::Rate fallback_rate_;
+    CompactThrottle fallback_;
+    int fd_ = -1;
+
+    std::atomic<uint64_t> bucket_{0};
+    std::atomic<int64_t> expires_{0};
+    std::atomic<uint64_t> spent_{0};
+    std::atomic<uint32_t> batch_;
+    std::atomic<uint32_t> low_mark_{0};
+    std::atomic<uint64_t> refills_{0};
+    std::atomic<uint64_t> fallbacks_{0};
+    std::atomic<uint64_t> attempted_{0};
+    std::atomic<uint64_t> rejected_{0};
+
+    // Guarded by refill_mutex_.
+    mutable std::mutex refill_mutex_;
+    uint64_t sequence_ = 0;
+    uint32_t pending_return_ = 0;
+    int64_t down_until_ = 0;
+    int64_t empty_until_ = 0;
+    int64_t last_refill_ = 0;
+    uint64_t spent_at_refill_ = 0;
+    int64_t lease_ns_ = 0;
+};
@@ -0,0 +1,465 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+#include "ThrottleCrontol.hxx"
+
+// Buffers OpenMetrics text in a fixed chunk and hands every full chunk to
+// a sink, so rendering any number of limiters never holds more than one
+// chunk of output.
+class MetricsWriter
+{
+public:
+    using Sink = std::function<void(const char *, size_t)>;
+
+    explicit MetricsWriter(Sink sink) : sink_(std::move(sink)) {}
+
+    MetricsWriter(const MetricsWriter &) = delete;
+    MetricsWriter &operator=(const MetricsWriter &) = delete;
+
+    ~MetricsWriter() { flush(); }
+
+    void flush()
+    {
+        if (used_ > 0) {
+            sink_(buffer_, used_);
+            used_ = 0;
+        }
+    }
+
+    MetricsWriter &text(std::string_view text)
+    {
+        while (!text.empty()) {
+            if (used_ == kChunk) {
+                flush();
+            }
+            size_t length = std::min(text.size(), kChunk - used_);
+            std::memcpy(buffer_ + used_, text.data(), length);
+            used_ += length;
+            text.remove_prefix(length);
+        }
+        return *this;
+    }
+
+    // A label value with \, " and newlines escaped.
+    MetricsWriter &label(std::string_view value)
+    {
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                char escaped[2] = {'\\', c};
+                text(std::string_view(escaped, 2));
+            } else if (c == '\n') {
+                text("\\n");
+            } else {
+                text(std::string_view(&c, 1));
+            }
+        }
+        return *this;
+    }
+
+    MetricsWriter &number(uint64_t value)
+    {
+        char digits[24];
+        int length = std::snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value));
+        return text(std::string_view(digits, static_cast<size_t>(length)));
+    }
+
+    MetricsWriter &real(double value)
+    {
+        char digits[32];
+        int length = std::snprintf(digits, sizeof(digits), "%.9g", value);
+        return text(std::string_view(digits, static_cast<size_t>(length)));
+    }
+
+private:
+    static constexpr size_t kChunk = 16 * 1024;
+
+    Sink sink_;
+    char buffer_[kChunk];
+    size_t used_ = 0;
+};
+
+// Limiters registered by name, rendered in the OpenMetrics text format.
+//
+// The registry is a copy-on-write list: add() and remove() publish a new
+// list under a mutex that only they take, and a scrape works from the list
+// it loaded, so scrapes and admissions never share a lock. What a scrape
+// reads from a limiter is the same lock-free state the limiter exposes
+// anyway (stats(), state(), the keyed table's visit()).
+//
+// Families, all labelled with limiter="<name>":
+//   throttle_capacity, throttle_occupancy               ThrottleControl gauges
+//   throttle_admitted, throttle_rejected,
+//   throttle_blocking_calls, throttle_wait_seconds      only with stats enabled
+//   throttle_keys, throttle_key_capacity,
+//   throttle_memory_bytes                               KeyedThrottle gauges
+//   throttle_key_backlog_seconds{key="..."}             the top-N keys by how far their
+//                                                       TAT runs ahead of now
+class MetricsRegistry
+{
+public:
+    void add(const std::string &name, ThrottleControl &throttle) { add_(Entry{name, &throttle, nullptr, 0}); }
+
+    void add(const std::string &name, KeyedThrottle &throttle, size_t top_keys = 10)
+    {
+        add_(Entry{name, nullptr, &throttle, top_keys});
+    }
+
+    // Returns once no scrape can still be reading the limiter, so it may be destroyed afterwards.
+    bool remove(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<const Entries> current = std::atomic_load(&entries_);
+        auto entries = std::make_shared<Entries>(*current);
+        auto found = std::find_if(entries->begin(), entries->end(), [&](const Entry &e) { return e.name_ == name; });
+        if (found == entries->end()) {
+            return false;
+        }
+        entries->erase(found);
+        std::atomic_store(&entries_, std::shared_ptr<const Entries>(std::move(entries)));
+        while (current.use_count() > 1) {
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    size_t size() const { return std::atomic_load(&entries_)->size(); }
+
+    void render(MetricsWriter &writer, int64_t now) const
+    {
+        std::shared_ptr<const Entries> entries = std::atomic_load(&entries_);
+        std::vector<ControlSample> controls;
+        std::vector<std::pair<uint64_t, int64_t>> top;
+        for (const Entry &entry : *entries) {
+            if (entry.control_ != nullptr) {
+                controls.push_back(ControlSample{&entry, entry.control_->state(now), entry.control_->stats(),
+                                                 entry.control_->blocked_histogram()});
+            }
+        }
+
+        family_(writer, "throttle_capacity", "gauge", "Admissions allowed per second.");
+        for (const ControlSample &sample : controls) {
+            sample_(writer, "throttle_capacity", *sample.entry_).number(sample.state_.capacity_).text("\n");
+        }
+        family_(writer, "throttle_occupancy", "gauge", "Admissions within the last second.");
+        for (const ControlSample &sample : controls) {
+            sample_(writer, "throttle_occupancy", *sample.entry_).number(sample.state_.occupancy_).text("\n");
+        }
+        counter_(writer, controls, "throttle_admitted", "Requests admitted.", &ThrottleControl::Stats::allowed_);
+        counter_(writer, controls, "throttle_rejected", "Requests rejected by update_().",
+                 &ThrottleControl::Stats::rejected_);
+        counter_(writer, controls, "throttle_blocking_calls", "Calls to update() and check_and_wait().",
+                 &ThrottleControl::Stats::blocking_calls_);
+
+        family_(writer, "throttle_wait_seconds", "summary", "Time spent in blocking calls.");
+        for (const ControlSample &sample : controls) {
+            if (!sample.entry_->control_->stats_enabled()) {
+                continue;
+            }
+            for (double quantile : {0.5, 0.9, 0.99, 0.999}) {
+                sample_(writer, "throttle_wait_seconds", *sample.entry_, "quantile", quantile)
+                    .real(sample.blocked_.percentile(quantile) / 1e9)
+                    .text("\n");
+            }
+            sample_(writer, "throttle_wait_seconds_sum", *sample.entry_)
+                .real(sample.stats_.total_wait_ns_ / 1e9)
+                .text("\n");
+            sample_(writer, "throttle_wait_seconds_count", *sample.entry_)
+                .number(sample.stats_.blocking_calls_)
+                .text("\n");
+        }
+
+        keyed_(writer, *entries, "throttle_keys", "Keys with state.", [](const KeyedThrottle &t) { return t.size(); });
+        keyed_(writer, *entries, "throttle_key_capacity", "Slots in the key table.",
+               [](const KeyedThrottle &t) { return t.capacity(); });
+        keyed_(writer, *entries, "throttle_memory_bytes", "Memory held by the key table.",
+               [](const KeyedThrottle &t) { return t.memory_usage(); });
+
+        family_(writer, "throttle_key_backlog_seconds", "gauge",
+                "How far the busiest keys' TATs run ahead of now; string keys appear as their hash.");
+        for (const Entry &entry : *entries) {
+            if (entry.keyed_ == nullptr || entry.top_keys_ == 0) {
+                continue;
+            }
+            top_keys_(*entry.keyed_, entry.top_keys_, now, top);
+            for (const auto &key : top) {
+                sample_(writer, "throttle_key_backlog_seconds", entry, "key", key.first)
+                    .real((key.second - now) / 1e9)
+                    .text("\n");
+            }
+        }
+        writer.text("# EOF\n");
+    }
+
+    void render(MetricsWriter &writer) const { render(writer, CompactThrottle::now_()); }
+
+    std::string render() const
+    {
+        std::string text;
+        {
+            MetricsWriter writer([&text](const char *data, size_t size) { text.append(data, size); });
+            render(writer);
+        }
+        return text;
+    }
+
+private:
+    struct Entry
+    {
+        std::string name_;
+        ThrottleControl *control_;
+        KeyedThrottle *keyed_;
+        size_t top_keys_;
+    };
+
+    using Entries = std::vector<Entry>;
+
+    struct ControlSample
+    {
+        const Entry *entry_;
+        ThrottleControl::State state_;
+        ThrottleControl::Stats stats_;
+        WaitHistogram::Snapshot blocked_;
+    };
+
+    void add_(Entry entry)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::shared_ptr<const Entries> current = std::atomic_load(&entries_);
+        for (const Entry &existing : *current) {
+            if (existing.name_ == entry.name_) {
+                throw std::invalid_argument("A limiter named " + entry.name_ + " is already registered");
+            }
+        }
+        auto entries = std::make_shared<Entries>(*current);
+        entries->push_back(std::move(entry));
+        std::atomic_store(&entries_, std::shared_ptr<const Entries>(std::move(entries)));
+    }
+
+    static void family_(MetricsWriter &writer, const char *name, const char *type, const char *help)
+    {
+        writer.text("# TYPE ").text(name).text(" ").text(type).text("\n");
+        writer.text("# HELP ").text(name).text(" ").text(help).text("\n");
+    }
+
+    static MetricsWriter &sample_(MetricsWriter &writer, const char *name, const Entry &entry)
+    {
+        return writer.text(name).text("{limiter=\"").label(entry.name_).text("\"} ");
+    }
+
+    template <typename Value>
+    static MetricsWriter &sample_(MetricsWriter &writer, const char *name, const Entry &entry, const char *label,
+                                  Value value)
+    {
+        writer.text(name).text("{limiter=\"").label(entry.name_).text("\",").text(label).text("=\"");
+        if constexpr (std::is_floating_point<Value>::value) {
+            writer.real(value);
+        } else {
+            writer.number(value);
+        }
+        return writer.text("\"} ");
+    }
+
+    static void counter_(MetricsWriter &writer, const std::vector<ControlSample> &controls, const char *name,
+                         const char *help, uint64_t ThrottleControl::Stats::*field)
+    {
+        family_(writer, name, "counter", help);
+        for (const ControlSample &sample : controls) {
+            if (sample.entry_->control_->stats_enabled()) {
+                writer.text(name).text("_total{limiter=\"").label(sample.entry_->name_).text("\"} ");
+                writer.number(sample.stats_.*field).text("\n");
+            }
+        }
+    }
+
+    template <typename Read>
+    static void keyed_(MetricsWriter &writer, const Entries &entries, const char *name, const char *help, Read read)
+    {
+        family_(writer, name, "gauge", help);
+        for (const Entry &entry : entries) {
+            if (entry.keyed_ != nullptr) {
+                sample_(writer, name, entry).number(read(*entry.keyed_)).text("\n");
+            }
+        }
+    }
+
+    // The count keys with the latest TATs still ahead of now, latest first, kept in a bounded min-heap.
+    static void top_keys_(const KeyedThrottle &throttle, size_t count, int64_t now,
+                          std::vector<std::pair<uint64_t, int64_t>> &top)
+    {
+        auto later = [](const std::pair<uint64_t, int64_t> &a, const std::pair<uint64_t, int64_t> &b) {
+            return a.second > b.second;
+        };
+        top.clear();
+        top.reserve(count);
+        throttle.visit([&](uint64_t key, int64_t tat) {
+            if (tat <= now) {
+                return;
+            }
+            if (top.size() < count) {
+                top.emplace_back(key, tat);
+                std::push_heap(top.begin(), top.end(), later);
+            } else if (tat > top.front().second) {
+                std::pop_heap(top.begin(), top.end(), later);
+                top.back() = {key, tat};
+                std::push_heap(top.begin(), top.end(), later);
+            }
+        });
+        std::sort_heap(top.begin(), top.end(), later);
+    }
+
+    std::shared_ptr<const Entries> entries_ = std::make_shared<const Entries>();
+    std::mutex mutex_;
+};
+
+// Serves GET /metrics from a MetricsRegistry on 127.0.0.1, one connection
+// at a time, streaming each rendered chunk straight to the socket as an
+// HTTP/1.1 chunk, so the length never has to be known up front.
+class MetricsServer
+{
+public:
+    MetricsServer(const MetricsRegistry &registry, uint16_t port = 0) : registry_(registry)
+    {
+        fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+        int one = 1;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        socklen_t length = sizeof(address);
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd_, 16) != 0 ||
+            ::getsockname(fd_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+            int error = errno;
+            ::close(fd_);
+            throw std::system_error(error, std::generic_category(), "bind");
+        }
+        port_ = ntohs(address.sin_port);
+        thread_ = std::thread([this]() { serve_(); });
+    }
+
+    MetricsServer(const MetricsServer &) = delete;
+    MetricsServer &operator=(const MetricsServer &) = delete;
+
+    ~MetricsServer() { stop(); }
+
+    void stop()
+    {
+        if (running_.exchange(false)) {
+            thread_.join();
+            ::close(fd_);
+        }
+    }
+
+    uint16_t port() const { return port_; }
+
+    uint64_t scrapes() const { return scrapes_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr int kPollMs = 50;
+    static constexpr int kRequestTimeoutMs = 1000;
+
+    void serve_()
+    {
+        while (running_.load(std::memory_order_acquire)) {
+            pollfd ready{fd_, POLLIN, 0};
+            if (::poll(&ready, 1, kPollMs) <= 0) {
+                continue;
+            }
+            int client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                respond_(client);
+                ::close(client);
+            }
+        }
+    }
+
+    void respond_(int client)
+    {
+        char request[2048];
+        size_t used = 0;
+        // The request line and headers end with an empty line; the body, if any, is ignored.
+        while (used < sizeof(request) - 1) {
+            pollfd ready{client, POLLIN, 0};
+            if (::poll(&ready, 1, kRequestTimeoutMs) <= 0) {
+                return;
+            }
+            ssize_t got = ::recv(client, request + used, sizeof(request) - 1 - used, 0);
+            if (got <= 0) {
+                return;
+            }
+            used += static_cast<size_t>(got);
+            request[used] = '\0';
+            if (std::strstr(request, "\r\n\r\n") != nullptr || std::strstr(request, "\n\n") != nullptr) {
+                break;
+            }
+        }
+
+        std::string_view line(request, used);
+        if (line.rfind("GET /metrics ", 0) != 0 && line.rfind("GET /metrics?", 0) != 0) {
+            send_(client, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            return;
+        }
+        send_(client, "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                      "Transfer-Encoding: chunked\r\n"
+                      "Connection: close\r\n\r\n");
+        MetricsWriter writer([client](const char *data, size_t size) {
+            char header[24];
+            int length = std::snprintf(header, sizeof(header), "%zx\r\n", size);
+            send_(client, std::string_view(header, static_cast<size_t>(length)));
+            send_(client, std::string_view(data, size));
+            send_(client, "\r\n");
+        });
+        registry_.render(writer);
+        writer.flush();
+        send_(client, "0\r\n\r\n");
+        scrapes_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void send_(int client, std::string_view data)
+    {
+        while (!data.empty()) {
+            ssize_t sent = ::send(client, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return;
+            }
+            data.remove_prefix(static_cast<size_t>(sent));
+        }
+    }
+
+    const MetricsRegistry &registry_;
+    int fd_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> running_{true};
+    std::atomic<uint64_t> scrapes_{0};
+    std::thread thread_;
+};
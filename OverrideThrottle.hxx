@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+
+// Maps keys to rates. A rule matches key when (key & mask_) == value_, so
+// mask_ = ~0 is an exact id and narrower masks cover id ranges or bit
+// patterns; the rule with the most mask bits wins and unmatched keys get
+// the default rate.
+//
+// Rules live in an immutable snapshot with one hash table per distinct
+// mask. reload() builds a new snapshot off to the side, publishes it with
+// one pointer store and frees the old one once no reader can still see it.
+// lookup() never locks or allocates: a reader only bumps a counter on its
+// own cache line for the generation it entered under, and re-checks the
+// generation so a reload that raced past the bump cannot free under it.
+class RuleTable
+{
+public:
+    struct Rule
+    {
+        uint64_t mask_;
+        uint64_t value_;
+        CompactThrottle::Rate rate_;
+    };
+
+    explicit RuleTable(CompactThrottle::Rate default_rate) : current_(new Snapshot(default_rate, {})) {}
+
+    RuleTable(const RuleTable &) = delete;
+    RuleTable &operator=(const RuleTable &) = delete;
+
+    ~RuleTable() { delete current_.load(std::memory_order_acquire); }
+
+    CompactThrottle::Rate lookup(uint64_t key) const
+    {
+        Stripe &stripe = stripes_[stripe_index_()];
+        uint64_t generation = generation_.load(std::memory_order_seq_cst);
+        for (;;) {
+            std::atomic<uint64_t> &readers = stripe.readers_[generation & 1];
+            readers.fetch_add(1, std::memory_order_seq_cst);
+            // A reload that advanced the generation before the count was visible may
+            // not wait for it; retry under the new generation. Once the generation is
+            // confirmed, the next reload waits for this count before freeing anything,
+            // and reloads are serialised, so whatever snapshot is loaded stays alive.
+            uint64_t confirmed = generation_.load(std::memory_order_seq_cst);
+            if (confirmed != generation) {
+                readers.fetch_sub(1, std::memory_order_release);
+                generation = confirmed;
+                continue;
+            }
+            CompactThrottle::Rate rate = current_.load(std::memory_order_seq_cst)->lookup(key);
+            readers.fetch_sub(1, std::memory_order_release);
+            return rate;
+        }
+    }
+
+    void reload(CompactThrottle::Rate default_rate, const std::vector<Rule> &rules)
+    {
+        Snapshot *fresh = new Snapshot(default_rate, rules);
+
+        std::lock_guard<std::mutex> lock(reload_mutex_);
+        Snapshot *old = current_.exchange(fresh, std::memory_order_seq_cst);
+
+        // Readers that entered under the previous generation may still hold old.
+        uint64_t previous = generation_.fetch_add(1, std::memory_order_seq_cst);
+        for (auto &stripe : stripes_) {
+            while (stripe.readers_[previous & 1].load(std::memory_order_acquire) != 0) {
+                std::this_thread::yield();
+            }
+        }
+        delete old;
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(reload_mutex_);
+        return current_.load(std::memory_order_acquire)->size();
+    }
+
+private:
+    static constexpr size_t kStripes = 64;
+
+    struct alignas(64) Stripe
+    {
+        std::atomic<uint64_t> readers_[2] = {};
+    };
+
+    class Snapshot
+    {
+    public:
+        Snapshot(CompactThrottle::Rate default_rate, const std::vector<Rule> &rules) : default_(default_rate)
+        {
+            std::map<uint64_t, std::vector<const Rule *>> by_mask;
+            for (const auto &rule : rules) {
+                if ((rule.value_ & ~rule.mask_) != 0) {
+                    throw std::invalid_argument("Rule value has bits outside its mask");
+                }
+                by_mask[rule.mask_].push_back(&rule);
+            }
+            for (const auto &entry : by_mask) {
+                groups_.emplace_back(entry.first, entry.second);
+            }
+            std::sort(groups_.begin(), groups_.end(), [](const Group &a, const Group &b) {
+                return __builtin_popcountll(a.mask_) > __builtin_popcountll(b.mask_);
+            });
+            size_ = rules.size();
+        }
+
+        CompactThrottle::Rate lookup(uint64_t key) const
+        {
+            for (const auto &group : groups_) {
+                if (const CompactThrottle::Rate *rate = group.find(key & group.mask_)) {
+                    return *rate;
+                }
+            }
+            return default_;
+        }
+
+        size_t size() const { return size_; }
+
+    private:
+        struct Entry
+        {
+            uint64_t value_;
+            CompactThrottle::Rate rate_;
+            bool used_;
+        };
+
+        struct Group
+        {
+            Group(uint64_t mask, const std::vector<const Rule *> &rules) : mask_(mask)
+            {
+                size_t capacity = 2;
+                while (capacity < rules.size() * 2) {
+                    capacity <<= 1;
+                }
+                entries_.assign(capacity, Entry{0, CompactThrottle::Rate{0, 0}, false});
+                for (const Rule *rule : rules) {
+                    size_t index = mix_(rule->value_) & (capacity - 1);
+                    while (entries_[index].used_ && entries_[index].value_ != rule->value_) {
+                        index = (index + 1) & (capacity - 1);
+                    }
+                    // Later duplicates replace earlier ones.
+                    entries_[index] = Entry{rule->value_, rule->rate_, true};
+                }
+            }
+
+            const CompactThrottle::Rate *find(uint64_t value) const
+            {
+                size_t mask = entries_.size() - 1;
+                for (size_t index = mix_(value) & mask;; index = (index + 1) & mask) {
+                    const Entry &entry = entries_[index];
+                    if (!entry.used_) {
+                        return nullptr;
+                    }
+                    if (entry.value_ == value) {
+                        return &entry.rate_;
+                    }
+                }
+            }
+
+            uint64_t mask_;
+            std::vector<Entry> entries_;
+        };
+
+        static uint64_t mix_(uint64_t key)
+        {
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdULL;
+            key ^= key >> 33;
+            key *= 0xc4ceb9fe1a85ec53ULL;
+            key ^= key >> 33;
+            return key;
+        }
+
+        CompactThrottle::Rate default_;
+        std::vector<Group> groups_;
+        size_t size_;
+    };
+
+    static size_t stripe_index_()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return index;
+    }
+
+    std::atomic<Snapshot *> current_;
+    std::atomic<uint64_t> generation_{0};
+    mutable std::array<Stripe, kStripes> stripes_;
+    mutable std::mutex reload_mutex_;
+};
+
+// KeyedThrottle whose per-key rate comes from a RuleTable. Every key's
+// state is the same 8-byte TAT whatever its rate, so reloading rules never
+// reallocates or resets limiter state. A key keeps how full its window is
+// and drains at its new rate from its next request on.
+class OverrideThrottle
+{
+public:
+    OverrideThrottle(CompactThrottle::Rate default_rate, size_t capacity)
+        : rules_(default_rate), keys_(default_rate, capacity)
+    {
+    }
+
+    OverrideThrottle(uint32_t default_tps, size_t capacity)
+        : OverrideThrottle(CompactThrottle::Rate::per_second(default_tps), capacity)
+    {
+    }
+
+    int64_t check_(uint64_t key, int64_t now, uint32_t cost = 1)
+    {
+        return keys_.check_(key, rules_.lookup(key), now, cost);
+    }
+
+    int64_t check_(uint64_t key) { return check_(key, CompactThrottle::now_()); }
+
+    int64_t update_(uint64_t key, int64_t now, uint32_t cost = 1)
+    {
+        return keys_.update_(key, rules_.lookup(key), now, cost);
+    }
+
+    int64_t update_(uint64_t key) { return update_(key, CompactThrottle::now_()); }
+
+    RuleTable &rules() { return rules_; }
+
+    KeyedThrottle &keys() { return keys_; }
+
+private:
+    RuleTable rules_;
+    KeyedThrottle keys_;
+};
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+#include "CompactThrottle.hxx"
+
+// A CompactThrottle whose rate can be changed while it is in use, counting
+// attempts and rejections for a QuotaRebalancer. The rate is one packed
+// word, so a decision always sees a consistent interval and burst, and the
+// TAT carries over a rate change like OverrideThrottle's keys do.
+class RebalancedThrottle
+{
+public:
+    explicit RebalancedThrottle(uint32_t tps) { set_tps(tps); }
+
+    int64_t check_(int64_t now, uint32_t cost = 1) const { return state_.check_(rate(), now, cost); }
+
+    int64_t check_() const { return check_(CompactThrottle::now_()); }
+
+    int64_t update_(int64_t now, uint32_t cost = 1)
+    {
+        attempted_.fetch_add(cost, std::memory_order_relaxed);
+        int64_t wait = state_.update_(rate(), now, cost);
+        if (wait > 0) {
+            rejected_.fetch_add(cost, std::memory_order_relaxed);
+        }
+        return wait;
+    }
+
+    int64_t update_() { return update_(CompactThrottle::now_()); }
+
+    void set_tps(uint32_t tps)
+    {
+        CompactThrottle::Rate rate = CompactThrottle::Rate::per_second(tps);
+        rate_.store(static_cast<uint64_t>(rate.interval_) << 32 | tps, std::memory_order_release);
+    }
+
+    uint32_t tps() const { return static_cast<uint32_t>(rate_.load(std::memory_order_acquire)); }
+
+    CompactThrottle::Rate rate() const
+    {
+        uint64_t word = rate_.load(std::memory_order_acquire);
+        int64_t interval = static_cast<int64_t>(word >> 32);
+        return CompactThrottle::Rate{interval, interval * static_cast<uint32_t>(word)};
+    }
+
+    uint64_t attempted() const { return attempted_.load(std::memory_order_relaxed); }
+
+    uint64_t rejected() const { return rejected_.load(std::memory_order_relaxed); }
+
+private:
+    CompactThrottle state_;
+    // interval_ in ns (32) | tps (32); per_second() keeps the interval below 2^30.
+    std::atomic<uint64_t> rate_{0};
+    std::atomic<uint64_t> attempted_{0};
+    std::atomic<uint64_t> rejected_{0};
+};
+
+// Periodically redistributes a fixed total rate among members by their
+// recent demand, instead of a static total / n split.
+//
+// A member is two hooks: sample() returns its cumulative attempted and
+// rejected counts, and apply(tps) installs its new rate. Any limiter with
+// attempted(), rejected() and set_tps() can be added directly:
+// RebalancedThrottle, SharedThrottle (whose rate then changes for every
+// process on the segment) and LeaseThrottle (whose fallback share does).
+// rebalance() turns the counts since a member's previous sample into an
+// EWMA of its offered load (a member that
+// rejected anything is assumed to want at least 25% more than it has),
+// then water-fills: every member gets min_tps, members are raised towards
+// their demand smallest first, and whatever no one asked for is split
+// evenly so every member can absorb a burst. New rates are applied
+// decreases first, so the sum of the members' rates never exceeds the
+// total between two apply() calls.
+class QuotaRebalancer
+{
+public:
+    struct Counters
+    {
+        uint64_t attempted_;
+        uint64_t rejected_;
+    };
+
+    QuotaRebalancer(uint32_t total_tps, uint32_t min_tps = 1, int64_t half_life_ns = 2000000000LL)
+        : total_(total_tps), min_(min_tps), half_life_ns_(half_life_ns)
+    {
+        if (total_tps == 0 || min_tps == 0) {
+            throw std::invalid_argument("TPS must be positive");
+        }
+        if (half_life_ns <= 0) {
+            throw std::invalid_argument("Half-life must be positive");
+        }
+    }
+
+    // Adds a member and splits the total evenly again, lowering the others
+    // before apply() raises the new one. Returns its index.
+    size_t add(std::function<Counters()> sample, std::function<void(uint32_t)> apply, int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if ((members_.size() + 1) * static_cast<uint64_t>(min_) > total_) {
+            throw std::length_error("Total rate cannot give every member its minimum");
+        }
+        Counters counters = sample();
+        members_.push_back(Member{std::move(sample), std::move(apply), counters, now, 0.0, 0});
+
+        std::vector<uint32_t> even(members_.size(), total_ / static_cast<uint32_t>(members_.size()));
+        apply_(even);
+        return members_.size() - 1;
+    }
+
+    template <typename Throttle>
+    size_t add(Throttle &throttle, int64_t now)
+    {
+        return add([&throttle]() { return Counters{throttle.attempted(), throttle.rejected()}; },
+                   [&throttle](uint32_t tps) { throttle.set_tps(tps); }, now);
+    }
+
+    template <typename Throttle>
+    size_t add(Throttle &throttle)
+    {
+        return add(throttle, CompactThrottle::now_());
+    }
+
+    // Samples every member and applies new rates; call it every few hundred ms.
+    void rebalance(int64_t now)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (members_.empty()) {
+            return;
+        }
+
+        std::vector<double> wants(members_.size());
+        for (size_t i = 0; i < members_.size(); ++i) {
+            Member &member = members_[i];
+            int64_t elapsed = now - member.last_;
+            if (elapsed <= 0) {
+                wants[i] = member.demand_;
+                continue;
+            }
+            member.last_ = now;
+            double seconds = static_cast<double>(elapsed) / 1e9;
+            double weight = 1.0 - std::exp2(-static_cast<double>(elapsed) / static_cast<double>(half_life_ns_));
+            Counters counters = member.sample_();
+            double offered = static_cast<double>(counters.attempted_ - member.counters_.attempted_) / seconds;
+            bool rejected = counters.rejected_ != member.counters_.rejected_;
+            member.counters_ = counters;
+            member.demand_ += weight * (offered - member.demand_);
+            wants[i] = std::max(member.demand_, rejected ? member.tps_ * 1.25 : 0.0);
+        }
+        apply_(fill_(wants));
+    }
+
+    void rebalance() { rebalance(CompactThrottle::now_()); }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return members_.size();
+    }
+
+    uint32_t allocation(size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return members_.at(index).tps_;
+    }
+
+    // Smoothed offered load of a member, in requests per second.
+    double demand(size_t index) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return members_.at(index).demand_;
+    }
+
+    uint32_t total() const { return total_; }
+
+private:
+    struct Member
+    {
+        std::function<Counters()> sample_;
+        std::function<void(uint32_t)> apply_;
+        Counters counters_;
+        int64_t last_;  // when counters_ was sampled
+        double demand_;
+        uint32_t tps_;
+    };
+
+    // Max-min fair shares of total_ for the given wants, each at least min_.
+    std::vector<uint32_t> fill_(const std::vector<double> &wants) const
+    {
+        size_t count = wants.size();
+        std::vector<uint32_t> shares(count, min_);
+        uint64_t left = total_ - count * static_cast<uint64_t>(min_);
+
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return wants[a] < wants[b]; });
+        for (size_t rank = 0; rank < count; ++rank) {
+            size_t i = order[rank];
+            double extra = std::ceil(wants[i]) - min_;
+            uint64_t fair = left / (count - rank);
+            uint64_t grant = extra <= 0 ? 0 : std::min<uint64_t>(static_cast<uint64_t>(extra), fair);
+            shares[i] += static_cast<uint32_t>(grant);
+            left -= grant;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t spare = left / (count - i);
+            shares[i] += static_cast<uint32_t>(spare);
+            left -= spare;
+        }
+        return shares;
+    }
+
+    // Lowers rates before raising any, keeping the sum within total_ throughout.
+    void apply_(const std::vector<uint32_t> &shares)
+    {
+        for (int raising = 0; raising < 2; ++raising) {
+            for (size_t i = 0; i < members_.size(); ++i) {
+                Member &member = members_[i];
+                bool raise = shares[i] > member.tps_;
+                if (shares[i] != member.tps_ && raise == (raising == 1)) {
+                    member.apply_(shares[i]);
+                    member.tps_ = shares[i];
+                }
+            }
+        }
+    }
+
+    uint32_t total_;
+    uint32_t min_;
+    int64_t half_life_ns_;
+    std::vector<Member> members_;
+    mutable std::mutex mutex_;
+};
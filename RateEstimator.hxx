@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include "ShardOwners.hxx"
+
+// Exponentially weighted moving averages of the attempted (offered) and
+// admitted request rates, per second.
+//
+// add() bumps two counters in the calling thread's stripe and compares now
+// with the next tick. As in WaitHistogram, a thread counts in the stripe it
+// owns through ShardOwners with a plain load and store; threads whose
+// stripe is owned by another share one extra stripe through fetch_add.
+// Once per tick (time constant / kTicksPerConstant) the first thread past
+// it folds the stripe totals into the averages:
+// rate += (1 - e^(-dt/tau)) * (events / dt - rate). Readers load the folded
+// rate and, once a fold is more than a tick old, decay it by the time
+// since, so an idle limiter's rates fall towards zero without any writer,
+// in O(1).
+//
+// The averages lag traffic by up to one tick, and a reader may pair one
+// fold's rate with the next fold's timestamp, which is off by at most one
+// tick's decay.
+class RateEstimator
+{
+public:
+    static constexpr int64_t kTicksPerConstant = 32;
+
+    explicit RateEstimator(int64_t time_constant_ns = 1000000000LL)
+        : time_constant_(static_cast<double>(time_constant_ns)),
+          tick_(time_constant_ns / kTicksPerConstant > 0 ? time_constant_ns / kTicksPerConstant : 1)
+    {
+        if (time_constant_ns <= 0) {
+            throw std::invalid_argument("Time constant must be positive");
+        }
+    }
+
+    RateEstimator(const RateEstimator &) = delete;
+    RateEstimator &operator=(const RateEstimator &) = delete;
+
+    void add(int64_t now, uint64_t attempted, uint64_t admitted)
+    {
+        size_t index = owners_.claim();
+        if (index < kStripes) {
+            Stripe &stripe = stripes_[index];
+            stripe.attempted_.store(stripe.attempted_.load(std::memory_order_relaxed) + attempted,
+                                    std::memory_order_relaxed);
+            stripe.admitted_.store(stripe.admitted_.load(std::memory_order_relaxed) + admitted,
+                                   std::memory_order_relaxed);
+        } else {
+            stripes_[kStripes].attempted_.fetch_add(attempted, std::memory_order_relaxed);
+            stripes_[kStripes].admitted_.fetch_add(admitted, std::memory_order_relaxed);
+        }
+        if (now >= next_tick_.load(std::memory_order_relaxed)) {
+            fold_(now);
+        }
+    }
+
+    // Records one decision that returned wait.
+    void add(int64_t now, int64_t wait) { add(now, 1, wait == 0 ? 1 : 0); }
+
+    double attempted_rate(int64_t now) const { return read_(attempted_rate_, now); }
+
+    double admitted_rate(int64_t now) const { return read_(admitted_rate_, now); }
+
+    int64_t time_constant() const { return static_cast<int64_t>(time_constant_); }
+
+    int64_t tick() const { return tick_; }
+
+private:
+    static constexpr size_t kStripes = 64;
+
+    struct alignas(64) Stripe
+    {
+        std::atomic<uint64_t> attempted_{0};
+        std::atomic<uint64_t> admitted_{0};
+    };
+
+    double read_(const std::atomic<double> &rate, int64_t now) const
+    {
+        int64_t folded = folded_at_.load(std::memory_order_acquire);
+        double value = rate.load(std::memory_order_relaxed);
+        if (folded == 0 || now <= folded + tick_) {
+            return value;
+        }
+        return value * std::exp(-static_cast<double>(now - folded - tick_) / time_constant_);
+    }
+
+    void fold_(int64_t now)
+    {
+        if (folding_.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        // A timestamp at or before the last fold leaves the counts for the next, so folded_at_ never moves back
+        int64_t folded = folded_at_.load(std::memory_order_relaxed);
+        if (now >= next_tick_.load(std::memory_order_relaxed) && (folded == 0 || now > folded)) {
+            uint64_t attempted = 0, admitted = 0;
+            for (const auto &stripe : stripes_) {
+                attempted += stripe.attempted_.load(std::memory_order_relaxed);
+                admitted += stripe.admitted_.load(std::memory_order_relaxed);
+            }
+            if (folded != 0) {
+                double dt = static_cast<double>(now - folded);
+                double alpha = 1 - std::exp(-dt / time_constant_);
+                blend_(attempted_rate_, static_cast<double>(attempted - attempted_total_) * 1e9 / dt, alpha);
+                blend_(admitted_rate_, static_cast<double>(admitted - admitted_total_) * 1e9 / dt, alpha);
+            }
+            attempted_total_ = attempted;
+            admitted_total_ = admitted;
+            folded_at_.store(now, std::memory_order_release);
+            next_tick_.store(now + tick_, std::memory_order_relaxed);
+        }
+        folding_.store(false, std::memory_order_release);
+    }
+
+    static void blend_(std::atomic<double> &rate, double sample, double alpha)
+    {
+        double value = rate.load(std::memory_order_relaxed);
+        rate.store(value + alpha * (sample - value), std::memory_order_relaxed);
+    }
+
+    const double time_constant_;
+    const int64_t tick_;
+    alignas(64) std::atomic<int64_t> next_tick_{0};
+    std::atomic<int64_t> folded_at_{0};
+    std::atomic<double> attempted_rate_{0};
+    std::atomic<double> admitted_rate_{0};
+    std::atomic<bool> folding_{false};
+    uint64_t attempted_total_ = 0;  // owned by the folding thread
+    uint64_t admitted_total_ = 0;
+    ShardOwners<kStripes> owners_;
+    Stripe stripes_[kStripes + 1];  // the last one is shared
+};
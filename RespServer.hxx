@@ -0,0 +1,596 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+
+// Incremental parser for the subset of RESP2 that clients send: arrays of
+// bulk strings, plus inline commands for telnet-style use. Arguments are
+// views into the caller's buffer, so parsing allocates nothing.
+class RespParser
+{
+public:
+    static constexpr size_t kMaxArgs = 16;
+    static constexpr size_t kMaxBulk = 64 * 1024;
+
+    struct Command
+    {
+        std::string_view args_[kMaxArgs];
+        size_t count_ = 0;  // may exceed kMaxArgs; only the first kMaxArgs are kept
+    };
+
+    // Returns the bytes consumed by one complete command, 0 if more input is needed, or -1 on a protocol error.
+    static ptrdiff_t parse(const char *data, size_t size, Command &command)
+    {
+        command.count_ = 0;
+        if (size == 0) {
+            return 0;
+        }
+        if (data[0] != '*') {
+            return parse_inline_(data, size, command);
+        }
+
+        size_t offset = 1;
+        int64_t count;
+        ptrdiff_t used = number_(data + offset, size - offset, count);
+        if (used <= 0) {
+            return used;
+        }
+        offset += static_cast<size_t>(used);
+        if (count < 0 || count > 1024) {
+            return -1;
+        }
+        for (int64_t i = 0; i < count; ++i) {
+            if (offset == size) {
+                return 0;
+            }
+            if (data[offset] != '$') {
+                return -1;
+            }
+            ++offset;
+            int64_t length;
+            used = number_(data + offset, size - offset, length);
+            if (used <= 0) {
+                return used;
+            }
+            offset += static_cast<size_t>(used);
+            if (length < 0 || static_cast<uint64_t>(length) > kMaxBulk) {
+                return -1;
+            }
+            if (size - offset < static_cast<size_t>(length) + 2) {
+                return 0;
+            }
+            if (data[offset + length] != '\r' || data[offset + length + 1] != '\n') {
+                return -1;
+            }
+            if (command.count_ < kMaxArgs) {
+                command.args_[command.count_] = std::string_view(data + offset, static_cast<size_t>(length));
+            }
+            ++command.count_;
+            offset += static_cast<size_t>(length) + 2;
+        }
+        return static_cast<ptrdiff_t>(offset);
+    }
+
+private:
+    // Parses digits up to CRLF; returns bytes consumed including CRLF.
+    static ptrdiff_t number_(const char *data, size_t size, int64_t &value)
+    {
+        size_t i = 0;
+        bool negative = i < size && data[i] == '-';
+        i += negative;
+        value = 0;
+        size_t digits = 0;
+        for (; i < size && data[i] >= '0' && data[i] <= '9'; ++i, ++digits) {
+            if (digits == 18) {
+                return -1;
+            }
+            value = value * 10 + (data[i] - '0');
+        }
+        if (i + 1 >= size) {
+            return size - i > 2 ? -1 : 0;
+        }
+        if (digits == 0 || data[i] != '\r' || data[i + 1] != '\n') {
+            return -1;
+        }
+        value = negative ? -value : value;
+        return static_cast<ptrdiff_t>(i + 2);
+    }
+
+    static ptrdiff_t parse_inline_(const char *data, size_t size, Command &command)
+    {
+        const char *end = static_cast<const char *>(std::memchr(data, '\n', size));
+        if (end == nullptr) {
+            return size > kMaxBulk ? -1 : 0;
+        }
+        size_t length = static_cast<size_t>(end - data);
+        std::string_view line(data, length > 0 && data[length - 1] == '\r' ? length - 1 : length);
+        size_t start = 0;
+        while (start < line.size()) {
+            size_t space = line.find(' ', start);
+            size_t stop = space == std::string_view::npos ? line.size() : space;
+            if (stop > start) {
+                if (command.count_ < kMaxArgs) {
+                    command.args_[command.count_] = line.substr(start, stop - start);
+                }
+                ++command.count_;
+            }
+            start = stop + 1;
+        }
+        return static_cast<ptrdiff_t>(length + 1);
+    }
+};
+
+// Standalone rate-limit service speaking RESP, so services in any language
+// can use a redis client against one shared KeyedThrottle. Commands:
+//
+//   CL.THROTTLE <key> <max_burst> <count> <period_s> [<quantity>]
+//       as in redis-cell: GCRA allowing count per period with bursts of
+//       max_burst + 1. Replies [limited, limit, remaining, retry_after_s,
+//       reset_after_s]; retry_after is -1 when allowed. A quantity of 0
+//       only peeks.
+//   PING [message], ECHO message, COMMAND, QUIT
+//
+// Each thread runs its own epoll loop over a SO_REUSEPORT listener, so the
+// kernel spreads connections and threads share nothing but the throttle.
+// Pipelined commands are decided back to back from the read buffer and
+// their replies leave in one write. A client that sends faster than it
+// reads is paused once kMaxPending bytes of its replies are queued.
+class RespServer
+{
+public:
+    // Bytes of replies a connection may have queued before the server stops reading from it.
+    static constexpr size_t kMaxPending = 1024 * 1024;
+
+    RespServer(KeyedThrottle &throttle, uint16_t port = 0, size_t threads = 1) : throttle_(throttle)
+    {
+        if (threads == 0) {
+            throw std::invalid_argument("Thread count must be positive");
+        }
+        for (size_t i = 0; i < threads; ++i) {
+            loops_.emplace_back(new Loop(*this, port));
+            port = loops_.front()->port_;
+        }
+        port_ = port;
+        for (auto &loop : loops_) {
+            Loop *raw = loop.get();
+            loop->thread_ = std::thread([raw]() { raw->run(); });
+        }
+    }
+
+    RespServer(const RespServer &) = delete;
+    RespServer &operator=(const RespServer &) = delete;
+
+    ~RespServer() { stop(); }
+
+    void stop()
+    {
+        if (running_.exchange(false)) {
+            for (auto &loop : loops_) {
+                loop->thread_.join();
+            }
+            loops_.clear();
+        }
+    }
+
+    uint16_t port() const { return port_; }
+
+    uint64_t commands() const { return commands_.load(std::memory_order_relaxed); }
+
+    // Runs one command and appends its reply. Returns false when the connection should close after the reply.
+    static bool execute(KeyedThrottle &throttle, const RespParser::Command &command, std::string &out, int64_t now)
+    {
+        if (command.count_ == 0) {
+            return true;
+        }
+        if (command.count_ > RespParser::kMaxArgs) {
+            out += "-ERR too many arguments\r\n";
+            return true;
+        }
+        std::string_view name = command.args_[0];
+        if (equals_(name, "CL.THROTTLE")) {
+            throttle_command_(throttle, command, out, now);
+        } else if (equals_(name, "PING")) {
+            if (command.count_ == 1) {
+                out += "+PONG\r\n";
+            } else {
+                bulk_(out, command.args_[1]);
+            }
+        } else if (equals_(name, "ECHO")) {
+            if (command.count_ == 2) {
+                bulk_(out, command.args_[1]);
+            } else {
+                out += "-ERR wrong number of arguments for 'echo' command\r\n";
+            }
+        } else if (equals_(name, "COMMAND")) {
+            out += "*0\r\n";
+        } else if (equals_(name, "QUIT")) {
+            out += "+OK\r\n";
+            return false;
+        } else {
+            out += "-ERR unknown command '";
+            out.append(name.data(), name.size() < 64 ? name.size() : 64);
+            out += "'\r\n";
+        }
+        return true;
+    }
+
+private:
+    static constexpr int kMaxEvents = 64;
+    static constexpr size_t kReadSize = 16 * 1024;
+    static constexpr int64_t kMaxPeriodSeconds = 100LL * 365 * 86400;
+    // Bounds interval * (burst + 1) and interval * quantity, so TATs stay far from overflow.
+    static constexpr int64_t kMaxSpan = kMaxPeriodSeconds * 1000000000LL;
+
+    struct Connection
+    {
+        int fd_;
+        std::string in_;
+        std::string out_;
+        size_t sent_ = 0;
+        bool closing_ = false;
+        bool eof_ = false;           // the peer shut down its side; answer what it sent, then close
+        uint32_t events_ = EPOLLIN;  // what epoll is watching for
+
+        size_t pending() const { return out_.size() - sent_; }
+    };
+
+    class Loop
+    {
+    public:
+        Loop(RespServer &server, uint16_t port) : server_(server)
+        {
+            listen_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            epoll_ = ::epoll_create1(EPOLL_CLOEXEC);
+            if (listen_ < 0 || epoll_ < 0) {
+                fail_("socket");
+            }
+            int one = 1;
+            ::setsockopt(listen_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ::setsockopt(listen_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            address.sin_port = htons(port);
+            socklen_t length = sizeof(address);
+            if (::bind(listen_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+                ::listen(listen_, SOMAXCONN) != 0 ||
+                ::getsockname(listen_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+                fail_("bind");
+            }
+            port_ = ntohs(address.sin_port);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = listen_;
+            if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, listen_, &event) != 0) {
+                fail_("epoll_ctl");
+            }
+        }
+
+        Loop(const Loop &) = delete;
+        Loop &operator=(const Loop &) = delete;
+
+        ~Loop()
+        {
+            for (auto &entry : connections_) {
+                ::close(entry.first);
+            }
+            close_fds_();
+        }
+
+        void run()
+        {
+            epoll_event events[kMaxEvents];
+            std::vector<char> buffer(kReadSize);
+            while (server_.running_.load(std::memory_order_acquire)) {
+                int ready = ::epoll_wait(epoll_, events, kMaxEvents, 50);
+                for (int i = 0; i < ready; ++i) {
+                    int fd = events[i].data.fd;
+                    if (fd == listen_) {
+                        accept_();
+                        continue;
+                    }
+                    auto found = connections_.find(fd);
+                    if (found == connections_.end()) {
+                        continue;
+                    }
+                    Connection &connection = *found->second;
+                    bool open = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0;
+                    if (open && (events[i].events & EPOLLIN) != 0) {
+                        open = read_(connection, buffer);
+                    }
+                    if (open) {
+                        open = serve_(connection);
+                    }
+                    if (!open) {
+                        ::close(fd);
+                        connections_.erase(found);
+                    }
+                }
+            }
+        }
+
+        uint16_t port_ = 0;
+        std::thread thread_;
+
+    private:
+        [[noreturn]] void fail_(const char *call)
+        {
+            int error = errno;
+            close_fds_();
+            throw std::system_error(error, std::generic_category(), call);
+        }
+
+        void close_fds_()
+        {
+            if (listen_ >= 0) {
+                ::close(listen_);
+                listen_ = -1;
+            }
+            if (epoll_ >= 0) {
+                ::close(epoll_);
+                epoll_ = -1;
+            }
+        }
+
+        void accept_()
+        {
+            for (;;) {
+                int fd = ::accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                    return;
+                }
+                int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                if (::epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) {
+                    ::close(fd);
+                    continue;
+                }
+                connections_[fd].reset(new Connection{fd, {}, {}, 0, false, false, EPOLLIN});
+            }
+        }
+
+        // Buffers what is available; returns false if reading failed. At EOF the commands already
+        // buffered are still answered: a client may shut down its side right after its last command.
+        bool read_(Connection &connection, std::vector<char> &buffer)
+        {
+            for (;;) {
+                ssize_t got = ::read(connection.fd_, buffer.data(), buffer.size());
+                if (got == 0) {
+                    connection.eof_ = true;
+                    break;
+                }
+                if (got < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    return false;
+                }
+                connection.in_.append(buffer.data(), static_cast<size_t>(got));
+                if (static_cast<size_t>(got) < buffer.size()) {
+                    break;
+                }
+            }
+            return true;
+        }
+
+        // Answers buffered commands and sends the replies until the socket is full or the connection has
+        // kMaxPending bytes of replies queued; then stops reading from it until the client catches up.
+        bool serve_(Connection &connection)
+        {
+            for (;;) {
+                bool stalled = execute_(connection);
+                // Nothing can complete what is left after EOF; close once the replies are out.
+                if (connection.eof_ && !stalled) {
+                    connection.closing_ = true;
+                }
+                if (!write_(connection)) {
+                    return false;
+                }
+                if (!stalled || connection.pending() >= kMaxPending) {
+                    break;
+                }
+            }
+            uint32_t events = 0;
+            events |= !connection.eof_ && connection.pending() < kMaxPending ? static_cast<uint32_t>(EPOLLIN) : 0;
+            events |= connection.pending() > 0 ? static_cast<uint32_t>(EPOLLOUT) : 0;
+            if (events != connection.events_) {
+                epoll_event event{};
+                event.events = events;
+                event.data.fd = connection.fd_;
+                ::epoll_ctl(epoll_, EPOLL_CTL_MOD, connection.fd_, &event);
+                connection.events_ = events;
+            }
+            return true;
+        }
+
+        // Runs the complete commands in in_; returns true if it stopped at kMaxPending with some left.
+        bool execute_(Connection &connection)
+        {
+            int64_t now = CompactThrottle::now_();
+            size_t offset = 0;
+            uint64_t executed = 0;
+            bool stalled = false;
+            RespParser::Command command;
+            while (!connection.closing_ && offset < connection.in_.size()) {
+                if (connection.pending() >= kMaxPending) {
+                    stalled = true;
+                    break;
+                }
+                ptrdiff_t used = RespParser::parse(connection.in_.data() + offset, connection.in_.size() - offset,
+                                                   command);
+                if (used == 0) {
+                    break;
+                }
+                if (used < 0) {
+                    connection.out_ += "-ERR Protocol error\r\n";
+                    connection.closing_ = true;
+                    break;
+                }
+                offset += static_cast<size_t>(used);
+                connection.closing_ = !execute(server_.throttle_, command, connection.out_, now);
+                ++executed;
+            }
+            connection.in_.erase(0, offset);
+            server_.commands_.fetch_add(executed, std::memory_order_relaxed);
+            return stalled;
+        }
+
+        bool write_(Connection &connection)
+        {
+            while (connection.sent_ < connection.out_.size()) {
+                ssize_t wrote = ::send(connection.fd_, connection.out_.data() + connection.sent_,
+                                       connection.out_.size() - connection.sent_, MSG_NOSIGNAL);
+                if (wrote < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        return false;
+                    }
+                    break;
+                }
+                connection.sent_ += static_cast<size_t>(wrote);
+            }
+            if (connection.pending() == 0) {
+                connection.out_.clear();
+                connection.sent_ = 0;
+                return !connection.closing_;
+            }
+            if (connection.sent_ >= kMaxPending) {
+                connection.out_.erase(0, connection.sent_);
+                connection.sent_ = 0;
+            }
+            return true;
+        }
+
+        RespServer &server_;
+        int listen_ = -1;
+        int epoll_ = -1;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+    };
+
+    static bool equals_(std::string_view a, const char *b)
+    {
+        size_t length = std::strlen(b);
+        if (a.size() != length) {
+            return false;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            char c = a[i] >= 'a' && a[i] <= 'z' ? static_cast<char>(a[i] - 'a' + 'A') : a[i];
+            if (c != b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool integer_(std::string_view text, int64_t &value)
+    {
+        if (text.empty() || text.size() > 18) {
+            return false;
+        }
+        value = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') {
+                return false;
+            }
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    static void bulk_(std::string &out, std::string_view value)
+    {
+        out += '$';
+        out += std::to_string(value.size());
+        out += "\r\n";
+        out.append(value.data(), value.size());
+        out += "\r\n";
+    }
+
+    static void integer_reply_(std::string &out, int64_t value)
+    {
+        out += ':';
+        out += std::to_string(value);
+        out += "\r\n";
+    }
+
+    static int64_t seconds_(int64_t ns) { return ns <= 0 ? 0 : (ns + 999999999) / 1000000000; }
+
+    static void throttle_command_(KeyedThrottle &throttle, const RespParser::Command &command, std::string &out,
+                                  int64_t now)
+    {
+        if (command.count_ != 5 && command.count_ != 6) {
+            out += "-ERR wrong number of arguments for 'cl.throttle' command\r\n";
+            return;
+        }
+        int64_t burst, count, period, quantity = 1;
+        if (!integer_(command.args_[2], burst) || !integer_(command.args_[3], count) ||
+            !integer_(command.args_[4], period) || (command.count_ == 6 && !integer_(command.args_[5], quantity))) {
+            out += "-ERR value is not an integer or out of range\r\n";
+            return;
+        }
+        if (count == 0 || period == 0 || period > kMaxPeriodSeconds || count > period * 1000000000LL ||
+            burst >= (1LL << 31) || quantity >= (1LL << 31)) {
+            out += "-ERR invalid rate\r\n";
+            return;
+        }
+
+        CompactThrottle::Rate rate;
+        rate.interval_ = period * 1000000000LL / count;
+        int64_t spent;
+        if (__builtin_mul_overflow(rate.interval_, burst + 1, &rate.window_) || rate.window_ > kMaxSpan ||
+            __builtin_mul_overflow(rate.interval_, quantity, &spent) || spent > kMaxSpan) {
+            out += "-ERR invalid rate\r\n";
+            return;
+        }
+        std::string_view key = command.args_[1];
+        int64_t wait;
+        try {
+            wait = quantity == 0 ? throttle.check_(key, rate, now, 0)
+                                 : throttle.update_(key, rate, now, static_cast<uint32_t>(quantity));
+        } catch (const std::length_error &) {
+            out += "-ERR limiter capacity exhausted\r\n";
+            return;
+        }
+
+        int64_t tat = throttle.tat(key);
+        tat = tat > now ? tat : now;
+        // Left after this request, or, when limited, still available to a smaller one
+        int64_t remaining = (now + rate.window_ - tat) / rate.interval_;
+        out += "*5\r\n";
+        integer_reply_(out, wait > 0 ? 1 : 0);
+        integer_reply_(out, burst + 1);
+        integer_reply_(out, remaining < 0 ? 0 : remaining);
+        integer_reply_(out, wait > 0 ? seconds_(wait) : -1);
+        integer_reply_(out, seconds_(tat - now));
+    }
+
+    KeyedThrottle &throttle_;
+    uint16_t port_ = 0;
+    std::atomic<bool> running_{true};
+    std::atomic<uint64_t> commands_{0};
+    std::vector<std::unique_ptr<Loop>> loops_;
+};
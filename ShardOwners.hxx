@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Assigns each of Shards per-thread shards to at most one live thread, so
+// the owner can update the shard with plain loads and stores. A thread maps
+// to shard (thread id % Shards) and claims it on first use; claim() returns
+// Shards while another thread holds it, and the caller falls back to a
+// shared, atomic path. A thread releases its shards when it exits, so a
+// shard is not lost to a thread that has gone; the release and the next
+// claim pair up as release and acquire, so the next owner sees everything
+// the last one wrote.
+//
+// The owner words live in a block that exiting threads share with the
+// structure, so a thread may outlive the structure it recorded into.
+template <size_t Shards>
+class ShardOwners
+{
+public:
+    static_assert(Shards > 0, "At least one shard");
+
+    ShardOwners() : block_(std::make_shared<Block>()), owners_(block_->owners_) {}
+
+    ShardOwners(const ShardOwners &) = delete;
+    ShardOwners &operator=(const ShardOwners &) = delete;
+
+    ~ShardOwners() { block_->retired_.store(true, std::memory_order_relaxed); }
+
+    // The shard the calling thread owns, claimed now if it was free, or Shards.
+    size_t claim()
+    {
+        uint32_t self = token();
+        size_t shard = self % Shards;
+        uint32_t owner = owners_[shard].load(std::memory_order_relaxed);
+        if (owner == self) {
+            return shard;
+        }
+        return owner == 0 ? claim_(shard, self) : Shards;
+    }
+
+    // The thread holding shard, or 0.
+    uint32_t owner(size_t shard) const { return owners_[shard].load(std::memory_order_relaxed); }
+
+    // Process-wide, non-zero id of the calling thread.
+    static uint32_t token() { return ShardOwners<1>::token_(); }
+
+private:
+    template <size_t>
+    friend class ShardOwners;
+
+    struct Block
+    {
+        std::atomic<uint32_t> owners_[Shards] = {};
+        std::atomic<bool> retired_{false};  // the ShardOwners is gone
+    };
+
+    struct Claim
+    {
+        std::shared_ptr<void> block_;
+        const std::atomic<bool> *retired_;
+        std::atomic<uint32_t> *owner_;
+    };
+
+    // Shards the calling thread holds, in any ShardOwners; released when the thread exits.
+    class Held
+    {
+    public:
+        Held() = default;
+        Held(const Held &) = delete;
+        Held &operator=(const Held &) = delete;
+
+        ~Held()
+        {
+            for (auto &claim : claims_) {
+                claim.owner_->store(0, std::memory_order_release);
+            }
+        }
+
+        void add(std::shared_ptr<void> block, const std::atomic<bool> *retired, std::atomic<uint32_t> *owner)
+        {
+            // Drops the claims of structures that are gone, so a long-lived thread does not pile them up.
+            for (size_t i = 0; i < claims_.size();) {
+                if (claims_[i].retired_->load(std::memory_order_relaxed)) {
+                    claims_[i] = std::move(claims_.back());
+                    claims_.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            claims_.push_back(Claim{std::move(block), retired, owner});
+        }
+
+    private:
+        std::vector<Claim> claims_;
+    };
+
+    // Kept out of line so that claim() stays small enough to inline.
+    size_t claim_(size_t shard, uint32_t self)
+    {
+        uint32_t owner = 0;
+        if (!owners_[shard].compare_exchange_strong(owner, self, std::memory_order_acquire)) {
+            return Shards;
+        }
+        ShardOwners<1>::held_().add(block_, &block_->retired_, &owners_[shard]);
+        return shard;
+    }
+
+    static uint32_t token_()
+    {
+        static std::atomic<uint32_t> next{1};
+        thread_local uint32_t token = 0;  // constant-initialized, so reading it needs no guard
+        if (token == 0) {
+            token = next.fetch_add(1, std::memory_order_relaxed);
+        }
+        return token;
+    }
+
+    static Held &held_()
+    {
+        thread_local Held held;
+        return held;
+    }
+
+    std::shared_ptr<Block> block_;
+    std::atomic<uint32_t> *owners_;
+};
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "CompactThrottle.hxx"
+#include "SpscQueue.hxx"
+
+// Keyed limiter for thread-per-core services. Every key is owned by one
+// shard, chosen by jump consistent hashing, and each shard is driven by
+// exactly one thread, so the owner decides with plain loads and stores.
+//
+// A thread that sees a key it does not own submit()s it to the owner. The
+// request is buffered per destination and sent with the next flush() or
+// poll() through a single-producer single-consumer queue for that pair of
+// shards; the owner answers through the queue going the other way. The
+// only shared writes are the queue indices, once per batch.
+class ShardedThrottle
+{
+public:
+    struct Request
+    {
+        uint64_t key_;
+        uint64_t cookie_;
+        uint32_t cost_;
+    };
+
+    struct Reply
+    {
+        uint64_t cookie_;
+        int64_t wait_;
+    };
+
+    class Shard
+    {
+    public:
+        size_t index() const { return index_; }
+
+        bool owns(uint64_t key) const { return parent_.owner(key) == index_; }
+
+        // Decides immediately; only valid for keys this shard owns.
+        int64_t check_(uint64_t key, int64_t now, uint32_t cost = 1)
+        {
+            require_owned_(key);
+            const int64_t *tat = table_.find(key);
+            int64_t next;
+            return CompactThrottle::admit_(tat == nullptr ? 0 : *tat, parent_.rate_, now, cost, next);
+        }
+
+        int64_t update_(uint64_t key, int64_t now, uint32_t cost = 1)
+        {
+            require_owned_(key);
+            return decide_(key, now, cost);
+        }
+
+        // Queues a decision for key on its owner. The answer is passed to the
+        // poll() callback as (cookie, wait), including for keys owned here.
+        void submit(uint64_t key, uint64_t cookie, uint32_t cost = 1)
+        {
+            outbox_[parent_.owner(key)].push_back(Request{key, cookie, cost});
+            ++in_flight_;
+        }
+
+        // Sends buffered requests to their owners. Returns how many are still
+        // buffered because the owner's queue is full.
+        size_t flush()
+        {
+            size_t buffered = 0;
+            for (size_t to = 0; to < outbox_.size(); ++to) {
+                if (to != index_) {
+                    buffered += send_(outbox_[to], parent_.request_queue_(index_, to));
+                }
+            }
+            return buffered;
+        }
+
+        // Flushes requests, answers requests from other shards and delivers
+        // answers to this shard's requests. Call it from the shard's loop.
+        // Returns the number of answers passed to on_reply.
+        template <typename Callback>
+        size_t poll(int64_t now, Callback &&on_reply)
+        {
+            flush();
+
+            size_t delivered = 0;
+            for (const Request &request : outbox_[index_]) {
+                on_reply(request.cookie_, decide_(request.key_, now, request.cost_));
+                ++delivered;
+            }
+            outbox_[index_].clear();
+
+            for (size_t from = 0; from < replies_.size(); ++from) {
+                if (from == index_) {
+                    continue;
+                }
+                std::vector<Reply> &replies = replies_[from];
+                SpscQueue<Reply> &reply_queue = parent_.reply_queue_(index_, from);
+                // A peer that is slow to read its answers is not served more until it catches up.
+                if (send_(replies, reply_queue) != 0) {
+                    continue;
+                }
+                SpscQueue<Request> &requests = parent_.request_queue_(from, index_);
+                size_t count;
+                while ((count = requests.pop(requests_, kBatch)) != 0) {
+                    for (size_t i = 0; i < count; ++i) {
+                        const Request &request = requests_[i];
+                        replies.push_back(Reply{request.cookie_, decide_(request.key_, now, request.cost_)});
+                    }
+                }
+                send_(replies, reply_queue);
+            }
+
+            for (size_t from = 0; from < replies_.size(); ++from) {
+                if (from == index_) {
+                    continue;
+                }
+                SpscQueue<Reply> &replies = parent_.reply_queue_(from, index_);
+                size_t count;
+                while ((count = replies.pop(answers_, kBatch)) != 0) {
+                    for (size_t i = 0; i < count; ++i) {
+                        on_reply(answers_[i].cookie_, answers_[i].wait_);
+                    }
+                    delivered += count;
+                }
+            }
+            in_flight_ -= delivered;
+            return delivered;
+        }
+
+        // Requests submitted from this shard that have not been answered yet.
+        size_t pending() const { return in_flight_; }
+
+        size_t size() const { return table_.size(); }
+
+    private:
+        friend class ShardedThrottle;
+
+        static constexpr size_t kBatch = 64;
+
+        // Open addressing without tombstones: idle keys are dropped by
+        // rebuilding into a spare array once the table reaches capacity.
+        class Table
+        {
+        public:
+            explicit Table(size_t capacity)
+                : limit_(capacity), mask_(round_up_(capacity * 2) - 1), entries_(mask_ + 1), spare_(mask_ + 1)
+            {
+            }
+
+            const int64_t *find(uint64_t key) const
+            {
+                for (size_t index = hash_(key) & mask_;; index = (index + 1) & mask_) {
+                    const Entry &entry = entries_[index];
+                    if (entry.tat_ == kEmpty) {
+                        return nullptr;
+                    }
+                    if (entry.key_ == key) {
+                        return &entry.tat_;
+                    }
+                }
+            }
+
+            int64_t *find(uint64_t key)
+            {
+                return const_cast<int64_t *>(static_cast<const Table *>(this)->find(key));
+            }
+
+            int64_t *insert(uint64_t key, int64_t now)
+            {
+                if (size_ == limit_) {
+                    compact_(now);
+                    if (size_ == limit_) {
+                        throw std::length_error("ShardedThrottle shard capacity exhausted");
+                    }
+                }
+                ++size_;
+                return place_(entries_, key, 0);
+            }
+
+            size_t size() const { return size_; }
+
+        private:
+            static constexpr int64_t kEmpty = std::numeric_limits<int64_t>::min();
+
+            struct Entry
+            {
+                uint64_t key_ = 0;
+                int64_t tat_ = kEmpty;
+            };
+
+            int64_t *place_(std::vector<Entry> &entries, uint64_t key, int64_t tat)
+            {
+                size_t index = hash_(key) & mask_;
+                while (entries[index].tat_ != kEmpty) {
+                    index = (index + 1) & mask_;
+                }
+                entries[index] = Entry{key, tat};
+                return &entries[index].tat_;
+            }
+
+            // A TAT at or before now is indistinguishable from a fresh key.
+            void compact_(int64_t now)
+            {
+                for (auto &entry : spare_) {
+                    entry = Entry{};
+                }
+                size_ = 0;
+                for (const auto &entry : entries_) {
+                    if (entry.tat_ != kEmpty && entry.tat_ > now) {
+                        place_(spare_, entry.key_, entry.tat_);
+                        ++size_;
+                    }
+                }
+                entries_.swap(spare_);
+            }
+
+            size_t limit_;
+            size_t mask_;
+            size_t size_ = 0;
+            std::vector<Entry> entries_;
+            std::vector<Entry> spare_;
+        };
+
+        Shard(ShardedThrottle &parent, size_t index, size_t capacity)
+            : parent_(parent), index_(index), table_(capacity), outbox_(parent.shards_), replies_(parent.shards_)
+        {
+        }
+
+        void require_owned_(uint64_t key) const
+        {
+            if (!owns(key)) {
+                throw std::invalid_argument("Key is owned by another shard");
+            }
+        }
+
+        int64_t decide_(uint64_t key, int64_t now, uint32_t cost)
+        {
+            int64_t *tat = table_.find(key);
+            int64_t next;
+            int64_t wait = CompactThrottle::admit_(tat == nullptr ? 0 : *tat, parent_.rate_, now, cost, next);
+            if (wait > 0) {
+                return wait;
+            }
+            if (tat == nullptr) {
+                tat = table_.insert(key, now);
+            }
+            *tat = next;
+            return 0;
+        }
+
+        template <typename T>
+        static size_t send_(std::vector<T> &buffer, SpscQueue<T> &queue)
+        {
+            if (buffer.empty()) {
+                return 0;
+            }
+            size_t sent = queue.push(buffer.data(), buffer.size());
+            buffer.erase(buffer.begin(), buffer.begin() + sent);
+            return buffer.size();
+        }
+
+        ShardedThrottle &parent_;
+        size_t index_;
+        Table table_;
+        std::vector<std::vector<Request>> outbox_;
+        std::vector<std::vector<Reply>> replies_;
+        size_t in_flight_ = 0;
+        Request requests_[kBatch];
+        Reply answers_[kBatch];
+    };
+
+    ShardedThrottle(uint32_t tps, size_t shards, size_t capacity, size_t queue_capacity = 1024)
+        : ShardedThrottle(CompactThrottle::Rate::per_second(tps), shards, capacity, queue_capacity)
+    {
+    }
+
+    // capacity is the number of keys each shard can hold.
+    ShardedThrottle(CompactThrottle::Rate rate, size_t shards, size_t capacity, size_t queue_capacity = 1024)
+        : rate_(rate), shards_(shards)
+    {
+        if (shards == 0 || shards > kMaxShards) {
+            throw std::invalid_argument("Shard count must be between 1 and 1024");
+        }
+        if (capacity == 0) {
+            throw std::invalid_argument("Capacity must be positive");
+        }
+        for (size_t i = 0; i < shards * shards; ++i) {
+            requests_.emplace_back(new SpscQueue<Request>(queue_capacity));
+            replies_.emplace_back(new SpscQueue<Reply>(queue_capacity));
+        }
+        for (size_t i = 0; i < shards; ++i) {
+            shard_list_.emplace_back(new Shard(*this, i, capacity));
+        }
+    }
+
+    ShardedThrottle(const ShardedThrottle &) = delete;
+    ShardedThrottle &operator=(const ShardedThrottle &) = delete;
+
+    // Each shard must only be used by one thread at a time.
+    Shard &shard(size_t index) { return *shard_list_.at(index); }
+
+    size_t shards() const { return shards_; }
+
+    // Jump consistent hash (Lamping & Veach): going from n to n + 1 shards
+    // moves only 1/(n + 1) of the keys.
+    size_t owner(uint64_t key) const
+    {
+        int64_t bucket = -1;
+        int64_t jump = 0;
+        while (jump < static_cast<int64_t>(shards_)) {
+            bucket = jump;
+            key = key * 2862933555777941757ULL + 1;
+            jump = static_cast<int64_t>((bucket + 1) * (static_cast<double>(1LL << 31) /
+                                                         static_cast<double>((key >> 33) + 1)));
+        }
+        return static_cast<size_t>(bucket);
+    }
+
+private:
+    static constexpr size_t kMaxShards = 1024;
+
+    static size_t round_up_(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    static uint64_t hash_(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    SpscQueue<Request> &request_queue_(size_t from, size_t to) { return *requests_[from * shards_ + to]; }
+
+    SpscQueue<Reply> &reply_queue_(size_t from, size_t to) { return *replies_[from * shards_ + to]; }
+
+    CompactThrottle::Rate rate_;
+    size_t shards_;
+    std::vector<std::unique_ptr<SpscQueue<Request>>> requests_;
+    std::vector<std::unique_ptr<SpscQueue<Reply>>> replies_;
+    std::vector<std::unique_ptr<Shard>> shard_list_;
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+
+// One quota shared by every process that opens the same name, e.g. the
+// pre-forked workers of one server. The state is a CompactThrottle inside a
+// POSIX shared-memory segment (/dev/shm/<name>), so all processes decide
+// lock-free with one CAS on the same word instead of splitting tps between
+// them.
+//
+// The segment holds no pointers, so it can be mapped at any address, and
+// every state change is one atomic store or CAS, so a process killed at any
+// instruction leaves the segment consistent:
+//  - sizing is idempotent: whoever opens a segment shorter than the layout
+//    extends it with ftruncate(), which zero-fills;
+//  - the first word is 0 (fresh), the pid of the process initializing it,
+//    or kReady. Initialization is claimed by CAS from 0 and published by
+//    storing kReady last; a survivor that finds the claiming pid dead takes
+//    the claim over and initializes again;
+//  - once ready, a decision is a single CAS on the TAT, so a crash either
+//    committed the admission or left no trace of it;
+//  - the rate is one packed word, so set_rate() from any process is a single
+//    store and every decision sees a whole interval and burst. The TAT
+//    carries over a change, as with RebalancedThrottle.
+// The segment also counts attempted and rejected units for a QuotaRebalancer;
+// those are statistics, and a crash may leave them one decision apart.
+// The segment outlives the processes until unlink() is called.
+class SharedThrottle
+{
+public:
+    SharedThrottle(const std::string &name, uint32_t tps)
+        : SharedThrottle(name, CompactThrottle::Rate::per_second(tps))
+    {
+    }
+
+    // Creates the segment or attaches to an existing one, which must have been created with the same rate,
+    // whatever it has been changed to since. The rate must be a whole burst of intervals, with intervals under
+    // 2^36 ns (about 68 s) and bursts under 2^28.
+    SharedThrottle(const std::string &name, CompactThrottle::Rate rate) : name_(name)
+    {
+        if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos) {
+            throw std::invalid_argument("Name must be '/' followed by at least one character and no other '/'");
+        }
+        uint64_t packed = pack_(rate);
+
+        fd_ = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd_ < 0) {
+            fail_("shm_open");
+        }
+        struct stat info;
+        if (::fstat(fd_, &info) != 0) {
+            fail_("fstat");
+        }
+        if (static_cast<size_t>(info.st_size) < sizeof(Segment) && ::ftruncate(fd_, sizeof(Segment)) != 0) {
+            fail_("ftruncate");
+        }
+
+        void *address = ::mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (address == MAP_FAILED) {
+            fail_("mmap");
+        }
+        segment_ = static_cast<Segment *>(address);
+
+        initialize_(packed);
+        if (segment_->created_ != packed) {
+            close_();
+            throw std::invalid_argument("Shared segment exists with a different rate");
+        }
+    }
+
+    SharedThrottle(const SharedThrottle &) = delete;
+    SharedThrottle &operator=(const SharedThrottle &) = delete;
+
+    ~SharedThrottle() { close_(); }
+
+    // Removes the name; processes that have it mapped keep using the segment.
+    static bool unlink(const std::string &name) { return ::shm_unlink(name.c_str()) == 0; }
+
+    int64_t check_(int64_t now, uint32_t cost = 1) const { return segment_->throttle_.check_(rate(), now, cost); }
+
+    int64_t check_() const { return check_(CompactThrottle::now_()); }
+
+    int64_t update_(int64_t now, uint32_t cost = 1)
+    {
+        segment_->attempted_.fetch_add(cost, std::memory_order_relaxed);
+        int64_t wait = segment_->throttle_.update_(rate(), now, cost);
+        if (wait > 0) {
+            segment_->rejected_.fetch_add(cost, std::memory_order_relaxed);
+        }
+        return wait;
+    }
+
+    int64_t update_() { return update_(CompactThrottle::now_()); }
+
+    bool check() const { return check_() == 0; }
+
+    void update()
+    {
+        while (update_() > 0) {
+            std::this_thread::yield();
+        }
+    }
+
+    CompactThrottle::Rate rate() const
+    {
+        uint64_t word = segment_->rate_.load(std::memory_order_acquire);
+        int64_t interval = static_cast<int64_t>(word >> kBurstBits);
+        return CompactThrottle::Rate{interval, interval * static_cast<int64_t>(word & kBurstMask)};
+    }
+
+    // Changes the rate for every process sharing the segment.
+    void set_rate(CompactThrottle::Rate rate) { segment_->rate_.store(pack_(rate), std::memory_order_release); }
+
+    void set_tps(uint32_t tps) { set_rate(CompactThrottle::Rate::per_second(tps)); }
+
+    // Units attempted and rejected by update_() in every process since the segment was created.
+    uint64_t attempted() const { return segment_->attempted_.load(std::memory_order_relaxed); }
+
+    uint64_t rejected() const { return segment_->rejected_.load(std::memory_order_relaxed); }
+
+    int64_t tat() const { return segment_->throttle_.tat(); }
+
+    const std::string &name() const { return name_; }
+
+    // True in the process whose constructor initialized the segment.
+    bool created() const { return created_; }
+
+private:
+    static constexpr uint64_t kReady = 0x5448524f54544c32ULL;  // "THROTTL2"
+    static constexpr int64_t kInitTimeoutNs = 5000000000LL;
+    static constexpr int kBurstBits = 28;
+    static constexpr uint64_t kBurstMask = (1ULL << kBurstBits) - 1;
+
+    static_assert(std::atomic<int64_t>::is_always_lock_free, "Shared state needs address-free atomics");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared state needs address-free atomics");
+
+    // Never constructed: the mapping starts zero-filled, which is the fresh state.
+    // Rates are packed as interval in ns (36) | burst (28).
+    struct Segment
+    {
+        std::atomic<uint64_t> state_;
+        uint64_t created_;  // the rate at creation, which attaching handles must match
+        std::atomic<uint64_t> rate_;
+        alignas(64) CompactThrottle throttle_;
+        alignas(64) std::atomic<uint64_t> attempted_;
+        std::atomic<uint64_t> rejected_;
+    };
+
+    static uint64_t pack_(const CompactThrottle::Rate &rate)
+    {
+        if (rate.interval_ <= 0 || rate.window_ < rate.interval_ || rate.window_ % rate.interval_ != 0 ||
+            static_cast<uint64_t>(rate.interval_) >> (64 - kBurstBits) != 0 ||
+            static_cast<uint64_t>(rate.window_ / rate.interval_) > kBurstMask) {
+            throw std::invalid_argument("Rate does not fit a shared segment");
+        }
+        uint64_t burst = static_cast<uint64_t>(rate.window_ / rate.interval_);
+        return static_cast<uint64_t>(rate.interval_) << kBurstBits | burst;
+    }
+
+    [[noreturn]] void fail_(const char *call)
+    {
+        int error = errno;
+        close_();
+        throw std::system_error(error, std::generic_category(), std::string(call) + " " + name_);
+    }
+
+    void close_()
+    {
+        if (segment_ != nullptr) {
+            ::munmap(segment_, sizeof(Segment));
+            segment_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    static bool alive_(uint64_t pid) { return ::kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM; }
+
+    void initialize_(uint64_t rate)
+    {
+        uint64_t self = static_cast<uint64_t>(::getpid());
+        int64_t deadline = CompactThrottle::now_() + kInitTimeoutNs;
+        uint64_t state = segment_->state_.load(std::memory_order_acquire);
+        while (state != kReady) {
+            // A fresh segment, or one whose initializer died before publishing it.
+            if ((state == 0 || !alive_(state)) &&
+                segment_->state_.compare_exchange_strong(state, self, std::memory_order_acq_rel,
+                                                         std::memory_order_acquire)) {
+                segment_->created_ = rate;
+                segment_->rate_.store(rate, std::memory_order_relaxed);
+                segment_->throttle_.restore(0);
+                segment_->attempted_.store(0, std::memory_order_relaxed);
+                segment_->rejected_.store(0, std::memory_order_relaxed);
+                segment_->state_.store(kReady, std::memory_order_release);
+                created_ = true;
+                return;
+            }
+            if (CompactThrottle::now_() > deadline) {
+                close_();
+                throw std::runtime_error("Timed out waiting for shared segment " + name_ + " to be initialized");
+            }
+            std::this_thread::yield();
+            state = segment_->state_.load(std::memory_order_acquire);
+        }
+    }
+
+    std::string name_;
+    int fd_ = -1;
+    bool created_ = false;
+    Segment *segment_ = nullptr;
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include "CompactThrottle.hxx"
+
+// Approximate per-key limiting for unbounded key spaces (e.g. every IPv6
+// source) in fixed memory. Admitted costs are counted in a count-min
+// sketch of rows x width cells. Each cell is one cache line holding eight
+// sub-window counters tagged with their epoch, so expired sub-windows are
+// reset lazily by the next writer instead of by a sweep.
+//
+// A key's estimate is the minimum over rows of the sum of its cells' last
+// eight sub-windows. The sketch only over-counts, and any one-second
+// interval overlaps at most eight sub-windows of just over 1/7 s, so a key
+// never gets more than tps admitted in any second. In return, a steady key may see
+// some rejections just below the limit, and colliding keys can be
+// over-counted by about e/width of the total traffic, except with
+// probability e^-rows.
+class SketchThrottle
+{
+public:
+    SketchThrottle(uint32_t tps, size_t width = 8192, size_t rows = 4)
+        : limit_(tps), rows_(rows), mask_(width - 1), cells_(new Cell[rows * width])
+    {
+        if (tps == 0) {
+            throw std::invalid_argument("TPS must be positive");
+        }
+        if (width == 0 || (width & mask_) != 0) {
+            throw std::invalid_argument("Width must be a power of two");
+        }
+        if (rows == 0 || rows > kMaxRows) {
+            throw std::invalid_argument("Rows must be between 1 and 8");
+        }
+    }
+
+    int64_t check_(uint64_t key, int64_t now, uint32_t cost = 1) const
+    {
+        size_t cells[kMaxRows];
+        locate_(key, cells);
+        uint64_t epoch = epoch_(now);
+        return estimate_(cells, epoch) + cost > limit_ ? wait_(now) : 0;
+    }
+
+    int64_t check_(uint64_t key) const { return check_(key, CompactThrottle::now_()); }
+
+    // Adds to every row, then re-reads every row; a request is admitted only
+    // if the sketch still holds at most limit after all concurrent adds it can
+    // see. The last admitted request therefore sees every other admitted one.
+    int64_t update_(uint64_t key, int64_t now, uint32_t cost = 1)
+    {
+        size_t cells[kMaxRows];
+        locate_(key, cells);
+        uint64_t epoch = epoch_(now);
+
+        if (estimate_(cells, epoch) + cost > limit_) {
+            return wait_(now);
+        }
+        for (size_t row = 0; row < rows_; ++row) {
+            add_(cells_[cells[row]], epoch, cost);
+        }
+        if (estimate_(cells, epoch) > limit_) {
+            for (size_t row = 0; row < rows_; ++row) {
+                subtract_(cells_[cells[row]], epoch, cost);
+            }
+            return wait_(now);
+        }
+        return 0;
+    }
+
+    int64_t update_(uint64_t key) { return update_(key, CompactThrottle::now_()); }
+
+    bool check(uint64_t key) const { return check_(key) == 0; }
+
+    uint64_t estimate(uint64_t key, int64_t now) const
+    {
+        size_t cells[kMaxRows];
+        locate_(key, cells);
+        return estimate_(cells, epoch_(now));
+    }
+
+    size_t memory_usage() const { return sizeof(*this) + rows_ * (mask_ + 1) * sizeof(Cell); }
+
+private:
+    static constexpr size_t kMaxRows = 8;
+    static constexpr size_t kSubWindows = 8;
+    // Rounded up, so the last seven sub-windows always span a whole second.
+    static constexpr int64_t kSubWindowNs = (1000000000LL + kSubWindows - 2) / (kSubWindows - 1);
+
+    // Counter word: epoch (32) | count (32).
+    struct alignas(64) Cell
+    {
+        std::atomic<uint64_t> counts_[kSubWindows] = {};
+    };
+
+    static uint64_t epoch_(int64_t now) { return static_cast<uint64_t>(now / kSubWindowNs); }
+
+    static int64_t wait_(int64_t now)
+    {
+        int64_t into = now % kSubWindowNs;
+        return kSubWindowNs - (into < 0 ? into + kSubWindowNs : into);
+    }
+
+    static uint64_t pack_(uint64_t epoch, uint64_t count) { return (epoch << 32) | count; }
+
+    static bool current_(uint64_t word, uint64_t epoch) { return (word >> 32) == (epoch & 0xffffffffULL); }
+
+    static uint64_t mix_(uint64_t key)
+    {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    // Double hashing: row r probes h1 + r * h2, with h2 odd.
+    void locate_(uint64_t key, size_t *cells) const
+    {
+        uint64_t hash = mix_(key);
+        uint64_t h1 = hash;
+        uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+        for (size_t row = 0; row < rows_; ++row) {
+            cells[row] = row * (mask_ + 1) + ((h1 + row * h2) & mask_);
+        }
+    }
+
+    uint64_t row_sum_(const Cell &cell, uint64_t epoch) const
+    {
+        uint64_t sum = 0;
+        for (size_t back = 0; back < kSubWindows; ++back) {
+            uint64_t word = cell.counts_[(epoch - back) % kSubWindows].load(std::memory_order_seq_cst);
+            if (current_(word, epoch - back)) {
+                sum += word & 0xffffffffULL;
+            }
+        }
+        return sum;
+    }
+
+    uint64_t estimate_(const size_t *cells, uint64_t epoch) const
+    {
+        uint64_t estimate = UINT64_MAX;
+        for (size_t row = 0; row < rows_; ++row) {
+            uint64_t sum = row_sum_(cells_[cells[row]], epoch);
+            estimate = sum < estimate ? sum : estimate;
+        }
+        return estimate;
+    }
+
+    static void add_(Cell &cell, uint64_t epoch, uint32_t cost)
+    {
+        std::atomic<uint64_t> &counter = cell.counts_[epoch % kSubWindows];
+        uint64_t word = counter.load(std::memory_order_relaxed);
+        for (;;) {
+            uint64_t count = current_(word, epoch) ? (word & 0xffffffffULL) + cost : cost;
+            count = count > 0xffffffffULL ? 0xffffffffULL : count;
+            if (counter.compare_exchange_weak(word, pack_(epoch & 0xffffffffULL, count), std::memory_order_seq_cst)) {
+                return;
+            }
+        }
+    }
+
+    static void subtract_(Cell &cell, uint64_t epoch, uint32_t cost)
+    {
+        std::atomic<uint64_t> &counter = cell.counts_[epoch % kSubWindows];
+        uint64_t word = counter.load(std::memory_order_relaxed);
+        while (current_(word, epoch)) {
+            uint64_t count = word & 0xffffffffULL;
+            count = count > cost ? count - cost : 0;
+            if (counter.compare_exchange_weak(word, pack_(epoch & 0xffffffffULL, count), std::memory_order_seq_cst)) {
+                return;
+            }
+        }
+    }
+
+    uint32_t limit_;
+    size_t rows_;
+    size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+
+// Bounded single-producer single-consumer ring. push() and pop() move whole
+// batches and publish each batch with one release store, so a batch of n
+// messages costs the two cores one cache-line transfer rather than n.
+// Each side caches the other's index and only re-reads it when the ring
+// looks full or empty.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity) : mask_(round_up_(capacity) - 1), items_(new T[mask_ + 1])
+    {
+        if (capacity == 0) {
+            throw std::invalid_argument("Capacity must be positive");
+        }
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Producer only. Returns how many of the items were queued.
+    size_t push(const T *items, size_t count)
+    {
+        size_t tail = producer_.tail_.load(std::memory_order_relaxed);
+        size_t room = mask_ + 1 - (tail - producer_.cached_head_);
+        if (room < count) {
+            producer_.cached_head_ = consumer_.head_.load(std::memory_order_acquire);
+            room = mask_ + 1 - (tail - producer_.cached_head_);
+        }
+        count = count < room ? count : room;
+        for (size_t i = 0; i < count; ++i) {
+            items_[(tail + i) & mask_] = items[i];
+        }
+        if (count != 0) {
+            producer_.tail_.store(tail + count, std::memory_order_release);
+        }
+        return count;
+    }
+
+    bool push(const T &item) { return push(&item, 1) == 1; }
+
+    // Consumer only. Returns how many items were copied out.
+    size_t pop(T *items, size_t max)
+    {
+        size_t head = consumer_.head_.load(std::memory_order_relaxed);
+        size_t ready = consumer_.cached_tail_ - head;
+        if (ready < max) {
+            consumer_.cached_tail_ = producer_.tail_.load(std::memory_order_acquire);
+            ready = consumer_.cached_tail_ - head;
+        }
+        size_t count = max < ready ? max : ready;
+        for (size_t i = 0; i < count; ++i) {
+            items[i] = items_[(head + i) & mask_];
+        }
+        if (count != 0) {
+            consumer_.head_.store(head + count, std::memory_order_release);
+        }
+        return count;
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // Approximate unless called from one of the two owning threads.
+    size_t size() const
+    {
+        return producer_.tail_.load(std::memory_order_acquire) - consumer_.head_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct alignas(64) Producer
+    {
+        std::atomic<size_t> tail_{0};
+        size_t cached_head_ = 0;
+    };
+
+    struct alignas(64) Consumer
+    {
+        std::atomic<size_t> head_{0};
+        size_t cached_tail_ = 0;
+    };
+
+    static size_t round_up_(size_t n)
+    {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    Producer producer_;
+    Consumer consumer_;
+    size_t mask_;
+    std::unique_ptr<T[]> items_;
+};
@@ -0,0 +1,313 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "BatchProtocol.hxx"
+
+static std::string socket_path(const char *test)
+{
+    return "/tmp/throttle-test-" + std::string(test) + "-" + std::to_string(::getpid()) + ".sock";
+}
+
+// An autobound datagram socket that sends straight to path.
+static int raw_socket()
+{
+    int fd = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+    sa_family_t family = AF_UNIX;
+    ::bind(fd, reinterpret_cast<sockaddr *>(&family), sizeof(family));
+    return fd;
+}
+
+TEST_CASE("BatchProtocol - A Batch Is Decided In One Round Trip", "[batch][basic]") {
+    KeyedThrottle throttle(5, 64);
+    BatchServer server(throttle, socket_path("basic"));
+    BatchClient client(server.path());
+
+    std::vector<BatchProtocol::Request> requests;
+    for (uint64_t i = 0; i < 10; ++i) {
+        requests.push_back(BatchProtocol::Request{42, 1, 0});
+    }
+    requests.push_back(BatchProtocol::Request{7, 5, 0});
+    requests.push_back(BatchProtocol::Request{7, 1, 0});
+    std::vector<int64_t> waits(requests.size(), -1);
+    client.decide(requests.data(), requests.size(), waits.data());
+
+    // Replies come back in request order
+    for (size_t i = 0; i < 10; ++i) {
+        INFO("request " << i);
+        REQUIRE((waits[i] == 0) == (i < 5));
+    }
+    REQUIRE(waits[10] == 0);
+    REQUIRE(waits[11] > 0);
+    REQUIRE(client.round_trips() == 1);
+    REQUIRE(server.messages() == 1);
+    REQUIRE(server.decisions() == 12);
+
+    client.decide(requests.data(), 0, waits.data());
+    REQUIRE(client.round_trips() == 2);
+
+    // New keys beyond the server's capacity are reported, not admitted
+    requests.clear();
+    for (uint64_t i = 0; i < 1000; ++i) {
+        requests.push_back(BatchProtocol::Request{1000 + i, 1, 0});
+    }
+    waits.resize(requests.size());
+    client.decide(requests.data(), requests.size(), waits.data());
+    REQUIRE(waits.front() == 0);
+    REQUIRE(waits.back() == BatchProtocol::kFull);
+}
+
+TEST_CASE("BatchProtocol - Concurrent Callers Are Coalesced", "[batch][multithread]") {
+    const uint32_t tps_limit = 1000;
+    const int num_threads = 8;
+    const int calls = 2000;
+    KeyedThrottle throttle(tps_limit, 1024);
+    BatchServer server(throttle, socket_path("coalesce"));
+    BatchClient client(server.path());
+
+    std::atomic<int> admitted{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < calls; ++j) {
+                admitted += client.update(12345);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    REQUIRE(server.decisions() == static_cast<uint64_t>(num_threads * calls));
+    REQUIRE(admitted.load() >= static_cast<int>(tps_limit));
+    REQUIRE(admitted.load() <= static_cast<int>(2 * tps_limit));
+    // Callers queued behind a round trip share the next one
+    INFO("round trips " << client.round_trips());
+    REQUIRE(client.round_trips() < static_cast<uint64_t>(num_threads * calls));
+}
+
+TEST_CASE("BatchProtocol - Malformed Datagrams And Dead Servers", "[batch][failure]") {
+    KeyedThrottle throttle(10, 64);
+    std::string path = socket_path("failure");
+    std::unique_ptr<BatchServer> server(new BatchServer(throttle, path));
+    BatchClient client(path, 20000000LL);
+
+    // Bad magic, then a count that does not match the size: no reply, and the client keeps working
+    int fd = raw_socket();
+    sockaddr_un address = BatchProtocol::address_(path);
+    BatchProtocol::Header header{0, 0, 1};
+    ::sendto(fd, &header, sizeof(header), 0, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    header = BatchProtocol::Header{BatchProtocol::kMagic, 3, 2};
+    ::sendto(fd, &header, sizeof(header), 0, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    ::close(fd);
+    REQUIRE(client.update_(1) == 0);
+    REQUIRE(server->dropped() == 2);
+
+    server.reset();
+    REQUIRE_THROWS_AS(client.update_(1), std::system_error);
+    BatchProtocol::Request request{1, 1, 0};
+    int64_t wait;
+    REQUIRE_THROWS_AS(client.decide(&request, 1, &wait), std::system_error);
+
+    // A restarted server on the same path is picked up by the same client
+    server.reset(new BatchServer(throttle, path));
+    REQUIRE(client.update_(1) == 0);
+}
+
+TEST_CASE("BatchProtocol - A Client That Does Not Read Only Loses Its Own Replies", "[batch][failure]") {
+    KeyedThrottle throttle(1000000, 1024);
+    BatchServer server(throttle, socket_path("stuck"));
+    BatchClient client(server.path());
+
+    // Far more requests than the stuck client's queue can hold replies for
+    int fd = raw_socket();
+    sockaddr_un address = BatchProtocol::address_(server.path());
+    struct
+    {
+        BatchProtocol::Header header_;
+        BatchProtocol::Request request_;
+    } message{{BatchProtocol::kMagic, 1, 1}, {7, 1, 0}};
+    for (int i = 0; i < 1000; ++i) {
+        while (::sendto(fd, &message, sizeof(message), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&address),
+                        sizeof(address)) < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    while (server.messages() < 1000) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(server.unsent() > 0);
+
+    // The server is still answering everyone else
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(client.update_(static_cast<uint64_t>(i)) == 0);
+    }
+    ::close(fd);
+}
+
+TEST_CASE("BatchProtocol - A Full Server Queue Times Out Instead Of Blocking", "[batch][failure]") {
+    // A bound socket that nobody reads stands in for a wedged server
+    std::string path = socket_path("wedged");
+    ::unlink(path.c_str());
+    int server = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+    sockaddr_un address = BatchProtocol::address_(path);
+    REQUIRE(::bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+    int fd = raw_socket();
+    BatchProtocol::Header header{0, 0, 0};
+    while (::sendto(fd, &header, sizeof(header), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&address),
+                    sizeof(address)) == sizeof(header)) {
+    }
+    REQUIRE(errno == EAGAIN);
+
+    BatchClient client(path, 20000000LL);
+    auto start = std::chrono::steady_clock::now();
+    int error = 0;
+    try {
+        client.update_(1);
+    } catch (const std::system_error &e) {
+        error = e.code().value();
+    }
+    REQUIRE(error == ETIMEDOUT);
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    REQUIRE(client.round_trips() == 0);
+    ::close(fd);
+    ::close(server);
+    ::unlink(path.c_str());
+}
+
+TEST_CASE("BatchProtocol - A Sender Hands Off After Its Own Batch", "[batch][multithread]") {
+    std::string path = socket_path("handoff");
+    ::unlink(path.c_str());
+    int server = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+    sockaddr_un address = BatchProtocol::address_(path);
+    REQUIRE(::bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+    BatchClient client(path, 5000000000LL);
+
+    // Answers one datagram by hand, admitting everything in it
+    auto answer = [server]() {
+        char buffer[BatchProtocol::kMaxRequestSize];
+        sockaddr_un peer{};
+        socklen_t length = sizeof(peer);
+        ssize_t size = ::recvfrom(server, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr *>(&peer), &length);
+        BatchProtocol::Header header;
+        std::memcpy(&header, buffer, sizeof(header));
+        REQUIRE(size == static_cast<ssize_t>(sizeof(header) + header.count_ * sizeof(BatchProtocol::Request)));
+        std::vector<char> reply(sizeof(header) + header.count_ * sizeof(int64_t), 0);
+        std::memcpy(reply.data(), &header, sizeof(header));
+        ::sendto(server, reply.data(), reply.size(), 0, reinterpret_cast<sockaddr *>(&peer), length);
+    };
+
+    // The first caller's request is in flight when the second queues behind it
+    std::atomic<bool> first_done{false}, second_done{false};
+    std::thread first([&]() {
+        client.update_(1);
+        first_done = true;
+    });
+    while (client.round_trips() == 0) {
+        std::this_thread::yield();
+    }
+    std::thread second([&]() {
+        client.update_(2);
+        second_done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    answer();
+
+    // The first caller returns without sending, or waiting for, the second's batch
+    auto start = std::chrono::steady_clock::now();
+    while (!first_done && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+        std::this_thread::yield();
+    }
+    REQUIRE(first_done);
+    first.join();
+    while (client.round_trips() < 2) {
+        std::this_thread::yield();
+    }
+    REQUIRE(!second_done);
+    answer();
+    second.join();
+    REQUIRE(second_done);
+    REQUIRE(client.round_trips() == 2);
+    ::close(server);
+    ::unlink(path.c_str());
+}
+
+TEST_CASE("BatchProtocol - Exception Handling", "[batch][exception]") {
+    KeyedThrottle throttle(10, 64);
+    REQUIRE_THROWS_AS(BatchServer(throttle, ""), std::invalid_argument);
+    REQUIRE_THROWS_AS(BatchServer(throttle, std::string(200, 'x')), std::invalid_argument);
+    REQUIRE_THROWS_AS(BatchServer(throttle, "/nonexistent-dir/throttle.sock"), std::system_error);
+    REQUIRE_THROWS_AS(BatchClient("/nonexistent-dir/throttle.sock"), std::system_error);
+
+    BatchServer server(throttle, socket_path("exception"));
+    REQUIRE_THROWS_AS(BatchClient(server.path(), 0), std::invalid_argument);
+    BatchClient client(server.path());
+    std::vector<BatchProtocol::Request> requests(BatchProtocol::kMaxBatch + 1, BatchProtocol::Request{1, 1, 0});
+    std::vector<int64_t> waits(requests.size());
+    REQUIRE_THROWS_AS(client.decide(requests.data(), requests.size(), waits.data()), std::invalid_argument);
+}
+
+TEST_CASE("BatchProtocol - Cross-Process Decision Benchmark", "[.benchmark][batch]") {
+    const int num_clients = 4;
+    const auto duration = std::chrono::seconds(2);
+    KeyedThrottle throttle(1000000, 1 << 20);
+    BatchServer server(throttle, socket_path("benchmark"));
+
+    // Full batches from callers that already have them
+    std::atomic<uint64_t> decisions{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_clients; ++i) {
+        threads.emplace_back([&, i]() {
+            BatchClient client(server.path());
+            std::vector<BatchProtocol::Request> requests(BatchProtocol::kMaxBatch);
+            std::vector<int64_t> waits(requests.size());
+            uint64_t key = static_cast<uint64_t>(i) << 32, local = 0;
+            while (std::chrono::steady_clock::now() - start < duration) {
+                for (auto &request : requests) {
+                    request = BatchProtocol::Request{key++ % 100000, 1, 0};
+                }
+                client.decide(requests.data(), requests.size(), waits.data());
+                local += requests.size();
+            }
+            decisions += local;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Batched: " << decisions.load() / seconds / 1e6 << "M decisions/s with " << num_clients
+              << " clients" << std::endl;
+
+    // Single-request callers sharing one coalescing client
+    BatchClient shared(server.path());
+    std::atomic<uint64_t> calls{0};
+    threads.clear();
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 16; ++i) {
+        threads.emplace_back([&, i]() {
+            uint64_t key = static_cast<uint64_t>(i) << 32, local = 0;
+            while (std::chrono::steady_clock::now() - start < duration) {
+                shared.update_(key++ % 100000);
+                ++local;
+            }
+            calls += local;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Coalesced: " << calls.load() / seconds / 1e6 << "M decisions/s from 16 threads, "
+              << (double)calls.load() / shared.round_trips() << " per round trip" << std::endl;
+    REQUIRE(server.dropped() == 0);
+}
@@ -0,0 +1,133 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+#include "ThrottleCrontol.hxx"
+
+TEST_CASE("CompactThrottle - Burst Then Steady Rate", "[compact][basic]") {
+    auto rate = CompactThrottle::Rate::per_second(5);
+    CompactThrottle throttle;
+    const int64_t now = 1000000000000LL;
+
+    for (int i = 0; i < 5; ++i) {
+        REQUIRE(throttle.update_(rate, now) == 0);
+    }
+    int64_t wait = throttle.update_(rate, now);
+    REQUIRE(wait == rate.interval_);
+    REQUIRE(throttle.check_(rate, now) == wait);
+
+    // Exactly one slot frees up per interval
+    REQUIRE(throttle.update_(rate, now + wait) == 0);
+    REQUIRE(throttle.update_(rate, now + wait) > 0);
+}
+
+TEST_CASE("CompactThrottle - Idle State Equals Fresh State", "[compact][idle]") {
+    auto rate = CompactThrottle::Rate::per_second(3);
+    CompactThrottle used;
+    CompactThrottle fresh;
+    const int64_t now = 1000000000000LL;
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(used.update_(rate, now) == 0);
+    }
+    REQUIRE_FALSE(used.idle(now));
+    REQUIRE(used.idle(now + rate.window_));
+    REQUIRE(used.check_(rate, now + rate.window_, 3) == fresh.check_(rate, now + rate.window_, 3));
+}
+
+TEST_CASE("CompactThrottle - Strict Rate Never Exceeds TPS In A Second", "[compact][window]") {
+    const int64_t now = 1000000000000LL;
+    for (uint32_t tps : {1u, 3u, 7u, 10u, 1000u}) {
+        auto rate = CompactThrottle::Rate::strict_per_second(tps);
+        REQUIRE(rate.window_ == rate.interval_);
+        REQUIRE(rate.interval_ * tps >= 1000000000LL);
+
+        // Offered every 100 us for three seconds; count admissions in every window of one second
+        CompactThrottle throttle;
+        std::vector<int64_t> admitted;
+        for (int64_t t = now; t < now + 3000000000LL; t += 100000LL) {
+            if (throttle.update_(rate, t) == 0) {
+                admitted.push_back(t);
+            }
+        }
+        for (size_t i = 0, j = 0; i < admitted.size(); ++i) {
+            while (admitted[i] - admitted[j] >= 1000000000LL) {
+                ++j;
+            }
+            REQUIRE(i - j + 1 <= tps);
+        }
+        REQUIRE(admitted.size() >= 3 * tps - 1);
+    }
+}
+
+TEST_CASE("CompactThrottle - Exception Handling", "[compact][exception]") {
+    REQUIRE_THROWS_AS(CompactThrottle::Rate::per_second(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(CompactThrottle::Rate::strict_per_second(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(CompactThrottle::Rate::per_duration(10, 5), std::invalid_argument);
+}
+
+TEST_CASE("CompactThrottle - Concurrent Updates", "[compact][multithread]") {
+    const int tps_limit = 100;
+    const int num_threads = 8;
+    auto rate = CompactThrottle::Rate::per_second(tps_limit);
+    CompactThrottle throttle;
+    const int64_t now = CompactThrottle::now_();
+    std::atomic<int> allowed_count{0};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < 50; ++j) {
+                if (throttle.update_(rate, now) == 0) {
+                    allowed_count++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    REQUIRE(allowed_count.load() == tps_limit);
+}
+
+static size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+TEST_CASE("CompactThrottle - Memory Benchmark 10M Keys", "[.benchmark][compact][memory]") {
+    const size_t num_keys = 10000000;
+    const uint32_t tps = 100;
+
+    size_t before = resident_bytes();
+    KeyedThrottle throttle(tps, num_keys + num_keys / 4);
+    const int64_t now = CompactThrottle::now_();
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        throttle.update_(key, now);
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+    size_t after = resident_bytes();
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
+    size_t ring_bytes = sizeof(ThrottleControl) + tps * sizeof(std::atomic<int64_t>);
+    std::cout << "Keys: " << throttle.size() << ", inserted in " << duration.count() << "ms" << std::endl;
+    std::cout << "KeyedThrottle table: " << throttle.memory_usage() / (1024 * 1024) << " MB, "
+              << (double)throttle.memory_usage() / num_keys << " bytes/key" << std::endl;
+    std::cout << "Resident growth: " << (after - before) / (1024 * 1024) << " MB" << std::endl;
+    std::cout << "ThrottleControl per key at tps=" << tps << ": " << ring_bytes << " bytes, "
+              << ring_bytes * num_keys / (1024 * 1024) << " MB for " << num_keys << " keys" << std::endl;
+
+    REQUIRE(throttle.size() == num_keys);
+    REQUIRE(throttle.memory_usage() / num_keys <= 32);
+}
@@ -0,0 +1,233 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <iostream>
+#include <unistd.h>
+#include "ThrottleCrontol.hxx"
+#include "KeyedThrottle.hxx"
+
+static std::string trace_path(const char *test)
+{
+    return "/tmp/throttle-trace-" + std::string(test) + "-" + std::to_string(::getpid()) + ".bin";
+}
+
+static std::vector<DecisionTrace::Record> drain_all(DecisionTrace &trace)
+{
+    std::vector<DecisionTrace::Record> records;
+    trace.drain([&](const DecisionTrace::Record *batch, size_t count) {
+        records.insert(records.end(), batch, batch + count);
+    });
+    return records;
+}
+
+TEST_CASE("DecisionTrace - Sampling Rate Is Adjustable At Runtime", "[trace][sampling]") {
+    DecisionTrace trace(1024);
+    REQUIRE(trace.sample_every() == 0);
+    for (int i = 0; i < 100; ++i) {
+        trace.record(i, 7, 1, 0);
+    }
+    REQUIRE(drain_all(trace).empty());
+
+    trace.set_sample_every(1);
+    for (int i = 0; i < 100; ++i) {
+        trace.record(i, 7, 1, i % 2);
+    }
+    auto records = drain_all(trace);
+    REQUIRE(records.size() == 100);
+    REQUIRE(records[3].time_ == 3);
+    REQUIRE(records[3].verdict_ == DecisionTrace::kRejected);
+    REQUIRE(records[4].verdict_ == DecisionTrace::kAdmitted);
+
+    trace.set_sample_every(10);
+    for (int i = 0; i < 1000; ++i) {
+        trace.record(i, 7, 1, 0);
+    }
+    REQUIRE(drain_all(trace).size() == 100);
+
+    // Lowering the rate applies to the very next decision
+    trace.set_sample_every(1000000);
+    trace.set_sample_every(1);
+    trace.record(0, 7, 1, 0);
+    REQUIRE(drain_all(trace).size() == 1);
+
+    // A full ring drops instead of blocking the caller
+    for (int i = 0; i < 2000; ++i) {
+        trace.record(i, 7, 1, 0);
+    }
+    REQUIRE(trace.dropped() == 2000 - 1024);
+    REQUIRE(drain_all(trace).size() == 1024);
+}
+
+TEST_CASE("DecisionTrace - Limiters Record Into A File", "[trace][file]") {
+    DecisionTrace trace(1024, 1);
+    KeyedThrottle keys(2, 64);
+    ThrottleControl control(2);
+    keys.set_trace(&trace);
+    control.set_trace(&trace);
+
+    const int64_t now = CompactThrottle::now_();
+    REQUIRE(keys.update_(42, now, 1) == 0);
+    REQUIRE(keys.update_(42, now, 5) > 0);
+    REQUIRE(keys.update_(std::string_view("token"), now) == 0);
+    REQUIRE(control.update_() == 0);
+
+    std::string path = trace_path("file");
+    {
+        TraceFile file(path);
+        REQUIRE(file.append(trace) == 4);
+        REQUIRE(file.append(trace) == 0);
+        REQUIRE(file.records() == 4);
+    }
+    auto records = TraceFile::load(path);
+    ::unlink(path.c_str());
+    REQUIRE(records.size() == 4);
+    REQUIRE(records[0].key_ == 42);
+    REQUIRE(records[0].time_ == now);
+    REQUIRE(records[0].verdict_ == DecisionTrace::kAdmitted);
+    REQUIRE(records[1].cost_ == 5);
+    REQUIRE(records[1].verdict_ == DecisionTrace::kRejected);
+    REQUIRE(records[1].wait_ > 0);
+    REQUIRE(records[2].key_ != 0);
+    REQUIRE(records[3].key_ == 0);
+    // The same timestamp the decision stored in the ring
+    REQUIRE(records[3].time_ == control.state().newest_);
+
+    keys.set_trace(nullptr);
+    keys.update_(42, now);
+    REQUIRE(drain_all(trace).empty());
+}
+
+TEST_CASE("DecisionTrace - Concurrent Recording And Draining", "[trace][multithread]") {
+    const int num_threads = 4;
+    const int decisions = 50000;
+    DecisionTrace trace(256, 1);
+    std::atomic<int> finished{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int j = 0; j < decisions; ++j) {
+                trace.record(j, static_cast<uint64_t>(i), 1, 0);
+            }
+            finished++;
+        });
+    }
+
+    // Per thread, records come out in the order they were made
+    std::vector<int64_t> last(num_threads, -1);
+    bool ordered = true;
+    uint64_t drained = 0;
+    auto sink = [&](const DecisionTrace::Record *records, size_t count) {
+        for (size_t k = 0; k < count; ++k) {
+            ordered = ordered && records[k].time_ > last[records[k].key_];
+            last[records[k].key_] = records[k].time_;
+        }
+        drained += count;
+    };
+    while (finished.load() < num_threads) {
+        trace.drain(sink);
+    }
+    trace.drain(sink);
+    for (auto &t : threads) {
+        t.join();
+    }
+    REQUIRE(ordered);
+    REQUIRE(drained + trace.dropped() == static_cast<uint64_t>(num_threads * decisions));
+}
+
+TEST_CASE("DecisionTrace - Short-Lived Threads Keep Recording", "[trace][multithread]") {
+    // Twice as many threads as rings, one after another; each hands its ring back when it exits
+    const int num_threads = 2 * static_cast<int>(DecisionTrace::kRings) + 1;
+    DecisionTrace trace(64, 1);
+    for (int i = 0; i < num_threads; ++i) {
+        std::thread([&, i]() {
+            for (int j = 0; j < 4; ++j) {
+                trace.record(i * 4 + j, static_cast<uint64_t>(i), 1, 0);
+            }
+        }).join();
+    }
+    std::vector<DecisionTrace::Record> records = drain_all(trace);
+    REQUIRE(trace.dropped() == 0);
+    REQUIRE(records.size() == static_cast<size_t>(num_threads * 4));
+
+    std::vector<int> seen(num_threads, 0);
+    for (const auto &record : records) {
+        ++seen[record.key_];
+    }
+    for (int count : seen) {
+        REQUIRE(count == 4);
+    }
+}
+
+TEST_CASE("DecisionTrace - Exception Handling", "[trace][exception]") {
+    REQUIRE_THROWS_AS(DecisionTrace(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(TraceFile("/nonexistent-dir/trace.bin"), std::system_error);
+    REQUIRE_THROWS_AS(TraceFile::load("/nonexistent-dir/trace.bin"), std::system_error);
+
+    std::string path = trace_path("exception");
+    {
+        TraceFile file(path);
+    }
+    REQUIRE(TraceFile::load(path).empty());
+    REQUIRE(::truncate(path.c_str(), 10) == 0);
+    REQUIRE_THROWS_AS(TraceFile::load(path), std::invalid_argument);
+    ::unlink(path.c_str());
+}
+
+TEST_CASE("DecisionTrace - Overhead And Replay Benchmark", "[.benchmark][trace]") {
+    const int calls = 5000000;
+    KeyedThrottle keys(1000, 1 << 16);
+    DecisionTrace trace(1 << 16, 0);
+    keys.set_trace(&trace);
+
+    for (uint32_t every : {0u, 1000u, 100u, 1u}) {
+        trace.set_sample_every(every);
+        auto start = std::chrono::steady_clock::now();
+        int64_t now = CompactThrottle::now_();
+        for (int i = 0; i < calls; ++i) {
+            keys.update_(static_cast<uint64_t>(i) % 500, now + i * 200);
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+        std::cout << "update_ with sample_every " << every << ": " << ns << " ns/op" << std::endl;
+        if (every != 1) {
+            drain_all(trace);
+        }
+    }
+
+    // Record 10 seconds of traffic at 400/s per key, draining as a reader thread
+    // would, then replay it against different limits
+    keys.set_trace(nullptr);
+    DecisionTrace replay_trace(1 << 16, 1);
+    KeyedThrottle recorded(1000, 1 << 16);
+    recorded.set_trace(&replay_trace);
+    std::string path = trace_path("replay");
+    {
+        TraceFile file(path);
+        int64_t now = CompactThrottle::now_();
+        for (int i = 0; i < 2000000; ++i) {
+            recorded.update_(static_cast<uint64_t>(i) % 500, now + i * 5000LL);
+            if (i % 32768 == 0) {
+                file.append(replay_trace);
+            }
+        }
+        file.append(replay_trace);
+    }
+    auto records = TraceFile::load(path);
+    ::unlink(path.c_str());
+    // The keys here are numeric. A record of a string key holds its hash, so replaying it through
+    // update_(uint64_t) keeps the keys apart but puts them in different slots from the original run.
+    for (uint32_t tps : {100u, 200u, 400u, 800u}) {
+        KeyedThrottle replay(tps, 1 << 16);
+        size_t admitted = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &record : records) {
+            admitted += replay.update_(record.key_, record.time_, record.cost_) == 0;
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Replayed " << records.size() << " decisions at " << tps << "/s per key in " << ms << " ms: "
+                  << 100.0 * admitted / records.size() << "% admitted" << std::endl;
+    }
+    REQUIRE(replay_trace.dropped() == 0);
+}
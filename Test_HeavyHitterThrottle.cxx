@@ -0,0 +1,180 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include "HeavyHitterThrottle.hxx"
+
+namespace {
+
+// Zipf(s) over [0, n) by inverse CDF lookup
+class ZipfKeys {
+public:
+    ZipfKeys(size_t n, double s) : cdf_(n) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i + 1), s);
+            cdf_[i] = sum;
+        }
+        for (auto &c : cdf_) {
+            c /= sum;
+        }
+    }
+
+    template <typename Gen>
+    uint64_t operator()(Gen &gen) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(gen);
+        return std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+    }
+
+private:
+    std::vector<double> cdf_;
+};
+
+}  // namespace
+
+TEST_CASE("HeavyHitterThrottle - Heavy Key Is Limited, Light Keys Pass", "[heavy][basic]") {
+    HeavyHitterThrottle throttle(10, 20, 16);
+    const int64_t now = 1000000000000LL;
+
+    int heavy_allowed = 0;
+    for (int i = 0; i < 200; ++i) {
+        if (throttle.update_(1, now) == 0) {
+            heavy_allowed++;
+        }
+        // Each light key is seen once
+        REQUIRE(throttle.update_(1000 + i, now) == 0);
+    }
+
+    // Admitted freely until detected, then precisely up to the limit
+    REQUIRE(heavy_allowed <= 20 + 10);
+    REQUIRE(throttle.update_(1, now) > 0);
+    REQUIRE(throttle.check_(1, now) > 0);
+    REQUIRE(throttle.check_(1000, now) == 0);
+    REQUIRE(throttle.estimate(1, now) >= 20);
+
+    int tracked = 0;
+    throttle.visit_heavy([&](uint64_t key, int64_t) {
+        REQUIRE(key == 1);
+        tracked++;
+    });
+    REQUIRE(tracked == 1);
+}
+
+TEST_CASE("HeavyHitterThrottle - Estimates Decay Across Windows", "[heavy][timing]") {
+    HeavyHitterThrottle throttle(100, 50, 16);
+    const int64_t now = 1000000000000LL;
+
+    for (int i = 0; i < 40; ++i) {
+        throttle.update_(7, now);
+    }
+    REQUIRE(throttle.estimate(7, now) == 40);
+    REQUIRE(throttle.estimate(7, now + 1000000000LL) == 20);
+    REQUIRE(throttle.estimate(7, now + 30 * 1000000000LL) == 0);
+}
+
+TEST_CASE("HeavyHitterThrottle - Memory Is Independent Of Key Count", "[heavy][memory]") {
+    HeavyHitterThrottle throttle(10, 100, 64);
+    const int64_t now = 1000000000000LL;
+    size_t before = throttle.memory_usage();
+
+    for (uint64_t key = 0; key < 200000; ++key) {
+        REQUIRE(throttle.update_(key, now) == 0);
+    }
+    REQUIRE(throttle.memory_usage() == before);
+}
+
+TEST_CASE("HeavyHitterThrottle - Exception Handling", "[heavy][exception]") {
+    REQUIRE_THROWS_AS(HeavyHitterThrottle(0, 10, 16), std::invalid_argument);
+    REQUIRE_THROWS_AS(HeavyHitterThrottle(10, 0, 16), std::invalid_argument);
+    REQUIRE_THROWS_AS(HeavyHitterThrottle(10, 10, 0), std::invalid_argument);
+}
+
+TEST_CASE("HeavyHitterThrottle - Zipfian Accuracy Benchmark", "[.benchmark][heavy]") {
+    const size_t num_keys = 1000000;
+    const size_t num_requests = 4000000;
+    const size_t top_k = 100;
+
+    ZipfKeys zipf(num_keys, 1.1);
+    std::mt19937_64 gen(7);
+    std::vector<uint64_t> keys(num_requests);
+    for (auto &key : keys) {
+        key = zipf(gen);
+    }
+
+    std::unordered_map<uint64_t, uint32_t> exact;
+    for (auto key : keys) {
+        exact[key]++;
+    }
+    std::vector<std::pair<uint32_t, uint64_t>> ranked;
+    for (auto &entry : exact) {
+        ranked.emplace_back(entry.second, entry.first);
+    }
+    std::sort(ranked.rbegin(), ranked.rend());
+
+    // Everything lands in one window, so estimates are directly comparable to exact counts
+    HeavyHitterThrottle throttle(1000000000, ranked[top_k - 1].first, top_k);
+    const int64_t now = 1000000000000LL;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto key : keys) {
+        throttle.update_(key, now);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    size_t found = 0;
+    double relative_error = 0;
+    for (size_t i = 0; i < top_k; ++i) {
+        uint32_t estimate = throttle.estimate(ranked[i].second, now);
+        found += estimate >= ranked[top_k - 1].first;
+        relative_error += std::abs(static_cast<double>(estimate) - ranked[i].first) / ranked[i].first;
+    }
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << "Distinct keys: " << exact.size() << ", sketch memory: " << throttle.memory_usage() << " bytes"
+              << std::endl;
+    std::cout << "Top-" << top_k << " recall: " << found << "/" << top_k
+              << ", mean relative error: " << relative_error / top_k << std::endl;
+    std::cout << "Throughput: " << (double)ns / num_requests << " ns per update_()" << std::endl;
+    REQUIRE(found >= top_k * 9 / 10);
+}
+
+TEST_CASE("HeavyHitterThrottle - Zipfian Throughput Benchmark", "[.benchmark][heavy][multithread]") {
+    const size_t num_keys = 1000000;
+    const size_t requests_per_thread = 1000000;
+    const unsigned num_threads = std::max(2u, std::thread::hardware_concurrency());
+
+    ZipfKeys zipf(num_keys, 1.1);
+    HeavyHitterThrottle throttle(1000, 2000, 1000);
+    std::atomic<size_t> rejected{0};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            std::mt19937_64 gen(t);
+            std::vector<uint64_t> keys(requests_per_thread);
+            for (auto &key : keys) {
+                key = zipf(gen);
+            }
+            size_t local_rejected = 0;
+            for (auto key : keys) {
+                local_rejected += throttle.update_(key) > 0;
+            }
+            rejected += local_rejected;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    std::cout << num_threads << " threads, " << num_threads * requests_per_thread << " requests in " << ms
+              << "ms (including key generation), rejected " << rejected.load() << std::endl;
+    REQUIRE(rejected.load() > 0);
+}
@@ -0,0 +1,83 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "HierarchicalThrottle.hxx"
+
+TEST_CASE("HierarchicalThrottle - Inner Rejection Does Not Leak Outer Quota", "[hierarchical][basic]") {
+    // tenant 3/s, user 5/s, endpoint 1/s
+    HierarchicalThrottle throttle({3, 5, 1}, 64);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.acquire_({1, 10, 100}, now) == 0);
+    for (int i = 0; i < 5; ++i) {
+        REQUIRE(throttle.acquire_({1, 10, 100}, now) > 0);
+    }
+
+    // The tenant still has two requests left for other endpoints
+    REQUIRE(throttle.acquire_({1, 10, 101}, now) == 0);
+    REQUIRE(throttle.acquire_({1, 11, 100}, now) == 0);
+    REQUIRE(throttle.acquire_({1, 12, 100}, now) > 0);
+
+    // Another tenant is unaffected, even with the same user and endpoint ids
+    REQUIRE(throttle.acquire_({2, 10, 100}, now) == 0);
+}
+
+TEST_CASE("HierarchicalThrottle - Prefix Paths Charge Only Their Levels", "[hierarchical][api]") {
+    HierarchicalThrottle throttle({2, 1}, 64);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.depth() == 2);
+    REQUIRE(throttle.acquire_({7}, now) == 0);
+    REQUIRE(throttle.acquire_({7, 1}, now) == 0);
+    REQUIRE(throttle.acquire_({7, 2}, now) > 0);
+    REQUIRE(throttle.level(1).size() == 1);
+}
+
+TEST_CASE("HierarchicalThrottle - Exception Handling", "[hierarchical][exception]") {
+    REQUIRE_THROWS_AS(HierarchicalThrottle({}, 64), std::invalid_argument);
+    REQUIRE_THROWS_AS(HierarchicalThrottle({1, 0}, 64), std::invalid_argument);
+
+    HierarchicalThrottle throttle({1, 1}, 64);
+    REQUIRE_THROWS_AS(throttle.acquire_({1, 2, 3}), std::invalid_argument);
+}
+
+TEST_CASE("HierarchicalThrottle - Concurrent Requests Respect Every Level", "[hierarchical][multithread]") {
+    const int tenant_limit = 20;
+    const int user_limit = 8;
+    const int num_users = 6;
+    const int num_threads = 8;
+
+    HierarchicalThrottle throttle({tenant_limit, user_limit, 100}, 256);
+    const int64_t now = CompactThrottle::now_();
+    std::vector<std::atomic<int>> allowed(num_users);
+    std::atomic<bool> start_flag{false};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            while (!start_flag.load()) {
+                std::this_thread::yield();
+            }
+            for (int j = 0; j < 40; ++j) {
+                int user = (i + j) % num_users;
+                if (throttle.acquire_({1, static_cast<uint64_t>(user), static_cast<uint64_t>(j % 3)}, now) == 0) {
+                    allowed[user]++;
+                }
+            }
+        });
+    }
+
+    start_flag.store(true);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    int total = 0;
+    for (auto &count : allowed) {
+        REQUIRE(count.load() <= user_limit);
+        total += count.load();
+    }
+    REQUIRE(total == tenant_limit);
+}
@@ -0,0 +1,609 @@
+#include <catch2/catch_test_macros.hpp>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <new>
+#include <cstdlib>
+#include <string>
+#include "KeyedThrottle.hxx"
+
+// Counts heap allocations so the string key benchmark can show the hot path makes none
+static std::atomic<size_t> g_allocations{0};
+
+void *operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC cannot tell these replace the global operators and warns that free() pairs with new
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+TEST_CASE("KeyedThrottle - Keys Are Limited Independently", "[keyed][basic]") {
+    KeyedThrottle throttle(3, 16);
+
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(throttle.update_(1) == 0);
+    }
+    REQUIRE(throttle.update_(1) > 0);
+
+    // Another key still has its whole quota
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(throttle.update_(2) == 0);
+    }
+    REQUIRE(throttle.update_(2) > 0);
+    REQUIRE(throttle.size() == 2);
+}
+
+TEST_CASE("KeyedThrottle - check_() Does Not Create State", "[keyed][api]") {
+    KeyedThrottle throttle(2, 16);
+
+    REQUIRE(throttle.check_(42) == 0);
+    REQUIRE(throttle.check(42));
+    REQUIRE(throttle.size() == 0);
+
+    REQUIRE(throttle.update_(42) == 0);
+    REQUIRE(throttle.update_(42) == 0);
+    REQUIRE(throttle.check_(42) > 0);
+    REQUIRE(throttle.size() == 1);
+}
+
+TEST_CASE("KeyedThrottle - Weighted Requests With Explicit Time", "[keyed][cost]") {
+    KeyedThrottle throttle(10, 16);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.update_(7, now, 6) == 0);
+    REQUIRE(throttle.check_(7, now, 4) == 0);
+    REQUIRE(throttle.update_(7, now, 5) > 0);  // only 4 units left
+    REQUIRE(throttle.update_(7, now, 4) == 0);
+
+    // One interval later exactly one unit has drained
+    REQUIRE(throttle.update_(7, now + 100000000LL, 2) > 0);
+    REQUIRE(throttle.update_(7, now + 100000000LL, 1) == 0);
+}
+
+TEST_CASE("KeyedThrottle - One Second Admits A Burst Plus The Refill", "[keyed][window]") {
+    const int tps_limit = 10;
+    KeyedThrottle throttle(tps_limit, 16);
+    const int64_t now = 1000000000000LL;
+
+    // Offered far above the limit for one second, 1 ms apart
+    int admitted = 0;
+    for (int64_t t = now; t < now + 1000000000LL; t += 1000000LL) {
+        for (int i = 0; i < 5; ++i) {
+            admitted += throttle.update_(1, t) == 0;
+        }
+    }
+    REQUIRE(admitted == 2 * tps_limit - 1);
+
+    // A strict rate never exceeds tps in any one-second window
+    KeyedThrottle strict(CompactThrottle::Rate::strict_per_second(tps_limit), 16);
+    admitted = 0;
+    for (int64_t t = now; t < now + 1000000000LL; t += 1000000LL) {
+        for (int i = 0; i < 5; ++i) {
+            admitted += strict.update_(1, t) == 0;
+        }
+    }
+    REQUIRE(admitted == tps_limit);
+}
+
+TEST_CASE("KeyedThrottle - Exception Handling", "[keyed][exception]") {
+    REQUIRE_THROWS_AS(KeyedThrottle(0, 16), std::invalid_argument);
+    REQUIRE_THROWS_AS(KeyedThrottle(1, 0), std::invalid_argument);
+
+    KeyedThrottle throttle(1, 4);
+    for (uint64_t key = 0; key < 4; ++key) {
+        REQUIRE(throttle.update_(key) == 0);
+    }
+    REQUIRE_THROWS_AS(throttle.update_(100), std::length_error);
+}
+
+TEST_CASE("KeyedThrottle - Concurrent Insertion Of The Same Keys", "[keyed][multithread]") {
+    const int tps_limit = 5;
+    const int num_threads = 8;
+    const int num_keys = 64;
+
+    KeyedThrottle throttle(tps_limit, 256);
+    const int64_t now = CompactThrottle::now_();
+    std::vector<std::atomic<int>> allowed(num_keys);
+    std::atomic<bool> start_flag{false};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            while (!start_flag.load()) {
+                std::this_thread::yield();
+            }
+            for (int round = 0; round < tps_limit; ++round) {
+                for (int key = 0; key < num_keys; ++key) {
+                    if (throttle.update_(key, now) == 0) {
+                        allowed[key]++;
+                    }
+                }
+            }
+        });
+    }
+
+    start_flag.store(true);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    REQUIRE(throttle.size() == num_keys);
+    for (int key = 0; key < num_keys; ++key) {
+        REQUIRE(allowed[key].load() == tps_limit);
+    }
+}
+
+TEST_CASE("KeyedThrottle - Idle Keys Are Evicted Without Losing Quota", "[keyed][eviction]") {
+    KeyedThrottle throttle(2, 16);
+    const int64_t now = 1000000000000LL;
+    const int64_t later = now + 2000000000LL;
+
+    REQUIRE(throttle.update_(1, now) == 0);
+    REQUIRE(throttle.update_(1, now) == 0);
+    REQUIRE(throttle.update_(2, later) == 0);
+    REQUIRE(throttle.size() == 2);
+
+    // Key 1 is still busy at now, so nothing can go yet
+    REQUIRE(throttle.sweep(throttle.capacity(), now) == 0);
+
+    // Key 1 has been idle for its whole window, key 2 has not
+    REQUIRE(throttle.sweep(throttle.capacity(), later) == 1);
+    REQUIRE(throttle.size() == 1);
+    REQUIRE(throttle.check_(1, later, 2) == 0);
+    REQUIRE(throttle.check_(2, later, 2) > 0);
+
+    REQUIRE(throttle.update_(1, later) == 0);
+    REQUIRE(throttle.update_(1, later) == 0);
+    REQUIRE(throttle.update_(1, later) > 0);
+}
+
+TEST_CASE("KeyedThrottle - Churning Keys Reuse Evicted Slots", "[keyed][eviction]") {
+    KeyedThrottle throttle(1, 64);
+    int64_t now = 1000000000000LL;
+
+    // Far more distinct keys than slots, but only a few are active at a time
+    for (uint64_t key = 0; key < 10000; ++key) {
+        if (key % 8 == 0) {
+            now += 2000000000LL;
+        }
+        REQUIRE(throttle.update_(key, now) == 0);
+        REQUIRE(throttle.update_(key, now) > 0);
+    }
+    REQUIRE(throttle.size() <= throttle.capacity());
+}
+
+TEST_CASE("KeyedThrottle - Tombstones Do Not Lengthen Probes", "[keyed][eviction]") {
+    KeyedThrottle throttle(10, 1024);
+    int64_t now = 1000000000000LL;
+
+    // One-shot keys, each idle long before the next thousand arrive
+    for (uint64_t key = 0; key < 200000; ++key) {
+        REQUIRE(throttle.update_(key, now) == 0);
+        now += 1000000LL;
+    }
+    REQUIRE(throttle.tombstones() <= throttle.capacity() / 8);
+
+    size_t longest = 0;
+    for (uint64_t key = 1000000; key < 1001000; ++key) {
+        longest = std::max(longest, throttle.probe_length_(key));
+    }
+    INFO("longest probe " << longest);
+    REQUIRE(longest < throttle.capacity() / 8);
+    REQUIRE(throttle.update_(1000000, now) == 0);
+    REQUIRE(throttle.probe_length_(1000000) < throttle.capacity() / 8);
+}
+
+TEST_CASE("KeyedThrottle - Concurrent Churn Never Duplicates A Key", "[keyed][eviction][multithread]") {
+    const int tps_limit = 3;
+    const int num_threads = 4;
+    const int keys_per_round = 16;
+    const int rounds = 2000;
+
+    // Many more distinct keys than slots, so evicted slots are reused and reclaimed throughout
+    KeyedThrottle throttle(tps_limit, 64);
+    const int64_t base = 1000000000000LL;
+    std::vector<std::atomic<int>> allowed(keys_per_round * rounds);
+    std::atomic<int> finished{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            for (int round = 0; round < rounds; ++round) {
+                // Rounds run in lockstep so no thread sweeps with a clock ahead of another's keys
+                while (finished.load() < round * num_threads) {
+                    std::this_thread::yield();
+                }
+                int64_t now = base + round * 2000000000LL;
+                for (int attempt = 0; attempt < tps_limit; ++attempt) {
+                    for (int key = 0; key < keys_per_round; ++key) {
+                        if (throttle.update_(static_cast<uint64_t>(round * keys_per_round + key), now) == 0) {
+                            allowed[round * keys_per_round + key]++;
+                        }
+                    }
+                }
+                finished++;
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (auto &count : allowed) {
+        REQUIRE(count.load() == tps_limit);
+    }
+    REQUIRE(throttle.tombstones() <= throttle.capacity());
+}
+
+TEST_CASE("KeyedThrottle - Concurrent Sweeping Never Over-Admits", "[keyed][eviction][multithread]") {
+    const int tps_limit = 4;
+    const int num_threads = 6;
+    const int num_keys = 32;
+    const int rounds = 200;
+
+    KeyedThrottle throttle(tps_limit, 64);
+    const int64_t window = 1000000000LL;
+    const int64_t base = 1000000000000LL;
+    std::vector<std::atomic<int>> allowed(num_keys * rounds);
+    std::vector<std::atomic<int>> current(num_threads);
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+
+    // sweep() must not run ahead of any worker's clock, so it sweeps with the slowest one
+    std::thread sweeper([&]() {
+        while (!done.load()) {
+            int slowest = rounds;
+            for (auto &round : current) {
+                slowest = std::min(slowest, round.load());
+            }
+            throttle.sweep(throttle.capacity(), base + slowest * window * 2);
+        }
+    });
+
+    // Each round jumps past the previous window, so every key starts the round fresh
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int round = 0; round < rounds; ++round) {
+                current[i] = round;
+                int64_t now = base + round * window * 2;
+                for (int attempt = 0; attempt < tps_limit; ++attempt) {
+                    for (int key = 0; key < num_keys; ++key) {
+                        if (throttle.update_(key, now) == 0) {
+                            allowed[round * num_keys + key]++;
+                        }
+                    }
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    done.store(true);
+    sweeper.join();
+
+    for (auto &count : allowed) {
+        REQUIRE(count.load() <= tps_limit);
+    }
+}
+
+TEST_CASE("KeyedThrottle - Churn Around Long-Lived Keys Keeps Chains Short", "[keyed][eviction]") {
+    KeyedThrottle throttle(1, 4096);
+    const auto busy = CompactThrottle::Rate::per_duration(4, 4000000000000LL);
+    const auto brief = CompactThrottle::Rate::per_duration(1, 10000000LL);
+    int64_t now = 1000000000000LL;
+
+    // Long-lived keys fill most of the table, so tombstones land between them
+    std::vector<int64_t> tats;
+    for (uint64_t key = 0; key < 2000; ++key) {
+        REQUIRE(throttle.update_(key, busy, now) == 0);
+        tats.push_back(throttle.tat(key));
+    }
+    for (int key = 0; key < 300; ++key) {
+        REQUIRE(throttle.update_("user-" + std::to_string(key), busy, now) == 0);
+    }
+    for (uint64_t key = 1000000; key < 1200000; ++key) {
+        REQUIRE(throttle.update_(key, brief, now) == 0);
+        now += 1000000LL;
+    }
+    INFO("tombstones " << throttle.tombstones());
+    REQUIRE(throttle.tombstones() <= throttle.capacity() / 4);
+
+    size_t longest = 0;
+    for (uint64_t key = 2000000; key < 2001000; ++key) {
+        longest = std::max(longest, throttle.probe_length_(key));
+    }
+    INFO("longest probe " << longest);
+    REQUIRE(longest < throttle.capacity() / 8);
+
+    // Keys moved back along their chains keep their state, string keys their bytes
+    for (uint64_t key = 0; key < 2000; ++key) {
+        REQUIRE(throttle.tat(key) == tats[key]);
+    }
+    for (int key = 0; key < 300; ++key) {
+        std::string name = "user-" + std::to_string(key);
+        REQUIRE(throttle.tat(name) == tats[0]);
+        REQUIRE(throttle.update_(name, busy, now) == 0);
+    }
+    size_t visited = 0;
+    throttle.visit([&](uint64_t, int64_t) { ++visited; });
+    REQUIRE(visited == throttle.size());
+}
+
+TEST_CASE("KeyedThrottle - Moving Keys Never Over-Admits Or Hides Them", "[keyed][eviction][multithread]") {
+    const int num_threads = 3;
+    const int hot_keys = 2400;
+    const uint32_t burst = 4;
+
+    // Hot keys stay busy far beyond the churn clock, so only the churn is evicted, but reclaim keeps moving them
+    KeyedThrottle throttle(1, 4096);
+    const auto busy = CompactThrottle::Rate::per_duration(burst, 4000000000000LL);
+    const auto brief = CompactThrottle::Rate::per_duration(1, 10000000LL);
+    const int64_t base = 1000000000000LL;
+    std::vector<std::atomic<int>> allowed(hot_keys);
+    std::atomic<bool> done{false};
+    std::atomic<int> missing{0}, visits{0};
+
+    std::thread churn([&]() {
+        int64_t now = base;
+        for (uint64_t key = 1000000; key < 1300000; ++key) {
+            throttle.update_(key, brief, now);
+            now += 1000000LL;
+        }
+        done = true;
+    });
+    std::thread visitor([&]() {
+        while (!done) {
+            std::vector<uint64_t> seen;
+            throttle.visit([&](uint64_t key, int64_t) {
+                if (key < static_cast<uint64_t>(hot_keys)) {
+                    seen.push_back(key);
+                }
+            });
+            std::sort(seen.begin(), seen.end());
+            if (std::adjacent_find(seen.begin(), seen.end()) != seen.end()) {
+                missing++;
+            }
+            visits++;
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            while (!done) {
+                for (int key = 0; key < hot_keys; ++key) {
+                    if (throttle.update_(static_cast<uint64_t>(key), busy, base) == 0) {
+                        allowed[key]++;
+                    }
+                    if (!throttle.contains(static_cast<uint64_t>(key))) {
+                        missing++;
+                    }
+                }
+            }
+        });
+    }
+    churn.join();
+    visitor.join();
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (auto &count : allowed) {
+        REQUIRE(count.load() == static_cast<int>(burst));
+    }
+    REQUIRE(missing.load() == 0);
+    REQUIRE(visits.load() > 0);
+}
+
+TEST_CASE("KeyedThrottle - Refund Returns Quota", "[keyed][refund]") {
+    KeyedThrottle throttle(3, 16);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.update_(9, now, 3) == 0);
+    REQUIRE(throttle.update_(9, now) > 0);
+
+    throttle.refund_(9, 2);
+    REQUIRE(throttle.update_(9, now, 2) == 0);
+    REQUIRE(throttle.update_(9, now) > 0);
+
+    // Refunding an unknown key is a no-op
+    throttle.refund_(10);
+    REQUIRE(throttle.size() == 1);
+}
+
+TEST_CASE("KeyedThrottle - decide_batch Matches Per-Record Decisions", "[keyed][batch]") {
+    KeyedThrottle batched(3, 1024);
+    KeyedThrottle single(3, 1024);
+    const int64_t now = 1000000000000LL;
+
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> costs;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back(i % 97);
+        costs.push_back(1 + i % 2);
+    }
+    std::vector<int64_t> results(keys.size(), -1);
+
+    size_t admitted = batched.decide_batch(keys.data(), costs.data(), keys.size(), now, results.data());
+
+    size_t expected_admitted = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int64_t wait = single.update_(keys[i], now, costs[i]);
+        REQUIRE(results[i] == wait);
+        expected_admitted += wait == 0;
+    }
+    REQUIRE(admitted == expected_admitted);
+
+    // Unit costs when no cost array is given
+    REQUIRE(batched.decide_batch(keys.data() + 1, nullptr, 0, now, results.data()) == 0);
+    uint64_t fresh_keys[3] = {1000, 1000, 1001};
+    REQUIRE(batched.decide_batch(fresh_keys, nullptr, 3, now, results.data()) == 3);
+}
+
+TEST_CASE("KeyedThrottle - String Keys Are Compared By Bytes", "[keyed][string]") {
+    KeyedThrottle throttle(2, 64);
+    const int64_t now = 1000000000000LL;
+    std::string token = "api-token-0123456789abcdef";
+
+    REQUIRE(throttle.update_(std::string_view(token), now) == 0);
+    REQUIRE(throttle.update_(std::string_view("api-token-0123456789abcdef"), now) == 0);
+    REQUIRE(throttle.update_(std::string_view(token), now) > 0);
+    REQUIRE(throttle.check_(std::string_view(token), now) > 0);
+
+    // Prefixes, extensions and the empty key are all distinct keys
+    REQUIRE(throttle.update_(std::string_view("api-token-0123456789abcde"), now) == 0);
+    REQUIRE(throttle.update_(std::string_view("api-token-0123456789abcdef0"), now) == 0);
+    REQUIRE(throttle.update_(std::string_view(""), now) == 0);
+    REQUIRE(throttle.contains(std::string_view("")));
+    REQUIRE(!throttle.contains(std::string_view("/v1/users")));
+
+    // A string key never aliases the numeric key equal to its slot word
+    REQUIRE(throttle.check_(std::string_view("/v1/users"), now) == 0);
+    throttle.refund_(std::string_view(token));
+    REQUIRE(throttle.update_(std::string_view(token), now) == 0);
+    REQUIRE(throttle.size() == 4);
+}
+
+TEST_CASE("KeyedThrottle - Recycled Slots Reuse Interned Keys", "[keyed][string][eviction]") {
+    KeyedThrottle throttle(10, 16);
+    int64_t now = 1000000000000LL;
+
+    // Sixteen slots cycling through a thousand keys of growing length
+    for (int i = 0; i < 1000; ++i) {
+        std::string key = "/tenant/" + std::to_string(i) + std::string(i % 40, 'x');
+        REQUIRE(throttle.update_(std::string_view(key), now) == 0);
+        REQUIRE(throttle.contains(std::string_view(key)));
+        now += 200000000LL;
+    }
+    REQUIRE(throttle.size() <= throttle.capacity());
+    // Each slot keeps at most one record per doubling of key length
+    REQUIRE(throttle.memory_usage() < 2 * 1024 * 1024);
+
+    // Numeric keys can take over slots that held strings
+    throttle.sweep(throttle.capacity(), now);
+    for (uint64_t key = 0; key < 8; ++key) {
+        REQUIRE(throttle.update_(key, now) == 0);
+        REQUIRE(throttle.contains(key));
+    }
+}
+
+TEST_CASE("KeyedThrottle - Concurrent String Keys Never Over-Admit", "[keyed][string][multithread]") {
+    const uint32_t tps_limit = 20;
+    const int num_threads = 8;
+    KeyedThrottle throttle(tps_limit, 256);
+    const int64_t now = 1000000000000LL;
+    std::atomic<int> allowed[4] = {};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < 200; ++j) {
+                std::string key = "client-" + std::to_string(j % 4);
+                if (throttle.update_(std::string_view(key), now) == 0) {
+                    allowed[j % 4]++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (auto &count : allowed) {
+        REQUIRE(count.load() == static_cast<int>(tps_limit));
+    }
+    REQUIRE(throttle.size() == 4);
+}
+
+TEST_CASE("KeyedThrottle - String Key Allocation Benchmark", "[.benchmark][keyed][string]") {
+    const size_t num_keys = 100000;
+    const size_t num_requests = 10000000;
+    KeyedThrottle throttle(1000, num_keys * 2);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys; ++i) {
+        keys.push_back("Bearer sk-live-" + std::to_string(i * 2654435761ULL));
+    }
+    const int64_t now = CompactThrottle::now_();
+    for (const auto &key : keys) {
+        throttle.update_(std::string_view(key), now);
+    }
+
+    size_t before = g_allocations.load();
+    size_t admitted = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_requests; ++i) {
+        admitted += throttle.update_(std::string_view(keys[(i * 7919) % num_keys]), now) == 0;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    size_t allocations = g_allocations.load() - before;
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << "String key update_(): " << (double)ns / num_requests << " ns, admitted " << admitted << std::endl;
+    std::cout << "Heap allocations per decision: " << (double)allocations / num_requests << std::endl;
+    std::cout << "Memory: " << throttle.memory_usage() / 1024 << " KB" << std::endl;
+    REQUIRE(allocations == 0);
+}
+
+TEST_CASE("KeyedThrottle - Batch Benchmark", "[.benchmark][keyed][batch]") {
+    const size_t num_keys = 2000000;
+    const size_t batch_size = 65536;
+    const int batches = 32;
+
+    KeyedThrottle per_record(1000, num_keys * 2);
+    KeyedThrottle batched(1000, num_keys * 2);
+    std::mt19937_64 gen(42);
+    std::uniform_int_distribution<uint64_t> key_dist(0, num_keys - 1);
+    std::vector<uint64_t> keys(batch_size);
+    std::vector<int64_t> results(batch_size);
+    const int64_t now = CompactThrottle::now_();
+
+    // Populate both tables so the timed loops only see lookups of existing keys
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        per_record.update_(key, now);
+        batched.update_(key, now);
+    }
+
+    std::chrono::nanoseconds single_time{0}, batch_time{0};
+    for (int b = 0; b < batches; ++b) {
+        for (auto &key : keys) {
+            key = key_dist(gen);
+        }
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < batch_size; ++i) {
+            results[i] = per_record.update_(keys[i], now);
+        }
+        auto middle = std::chrono::high_resolution_clock::now();
+        batched.decide_batch(keys.data(), nullptr, batch_size, now, results.data());
+        auto end = std::chrono::high_resolution_clock::now();
+        single_time += middle - start;
+        batch_time += end - middle;
+    }
+
+    double records = static_cast<double>(batch_size) * batches;
+    std::cout << "update_() per record: " << single_time.count() / records << " ns" << std::endl;
+    std::cout << "decide_batch() per record: " << batch_time.count() / records << " ns" << std::endl;
+    REQUIRE(batch_time.count() > 0);
+}
@@ -0,0 +1,269 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include "LeaseThrottle.hxx"
+
+TEST_CASE("LeaseThrottle - Coordinator Grants From The Global Pool", "[lease][coordinator]") {
+    QuotaCoordinator coordinator(100);
+    const int64_t now = 1000000000000LL;
+    int64_t wait = 0;
+
+    REQUIRE(coordinator.grant_(60, now, wait) == 60);
+    REQUIRE(coordinator.grant_(60, now, wait) == 40);
+    REQUIRE(coordinator.grant_(1, now, wait) == 0);
+    REQUIRE(wait > 0);
+
+    // Unspent tokens handed back can be granted again
+    coordinator.return_(25, now);
+    REQUIRE(coordinator.grant_(60, now, wait) == 25);
+    REQUIRE(coordinator.granted() == 125);
+    REQUIRE(coordinator.returned() == 25);
+
+    // 100ms later the pool has refilled by 10 tokens
+    REQUIRE(coordinator.grant_(60, now + 100000000LL, wait) == 10);
+}
+
+TEST_CASE("LeaseThrottle - Nodes Share One Global Limit", "[lease][multithread]") {
+    const uint32_t global_tps = 2000;
+    const int num_nodes = 4;
+    QuotaCoordinator coordinator(global_tps);
+    std::vector<std::unique_ptr<LeaseThrottle>> nodes;
+    for (int i = 0; i < num_nodes; ++i) {
+        nodes.emplace_back(new LeaseThrottle(coordinator.port(), LeaseThrottle::Options{global_tps / num_nodes}));
+    }
+
+    std::atomic<int> admitted{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_nodes; ++i) {
+        threads.emplace_back([&, i]() {
+            while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(1000)) {
+                if (nodes[i]->update_() == 0) {
+                    admitted++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    // A fresh pool admits its burst plus one second at the rate. A node whose
+    // refill timed out admits up to its fallback rate on top for the rest of the second.
+    int fell_back = 0;
+    for (auto &node : nodes) {
+        fell_back += node->fallbacks() != 0;
+        REQUIRE((node->leased() || node->fallbacks() != 0));
+    }
+    INFO("admitted " << admitted.load() << ", coordinator requests " << coordinator.requests() << ", nodes fell back "
+                     << fell_back);
+    REQUIRE(admitted.load() >= static_cast<int>(global_tps));
+    REQUIRE(admitted.load() <= static_cast<int>(2 * global_tps + fell_back * global_tps / num_nodes));
+    if (fell_back == 0) {
+        REQUIRE(coordinator.granted() - coordinator.returned() >= static_cast<uint64_t>(admitted.load()));
+    }
+}
+
+TEST_CASE("LeaseThrottle - Unspent Tokens Are Returned", "[lease][return]") {
+    QuotaCoordinator coordinator(1000, 0, 20000000LL);
+    LeaseThrottle::Options options{100};
+    options.min_batch_ = 50;
+    LeaseThrottle node(coordinator.port(), options);
+
+    REQUIRE(node.update_() == 0);
+    REQUIRE(node.tokens() == 49);
+    node.release();
+    REQUIRE(node.tokens() == 0);
+    for (int i = 0; i < 100 && coordinator.returned() == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(coordinator.returned() == 49);
+
+    // After the lease expires, the next refill hands the leftover back with its request
+    REQUIRE(node.update_() == 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    REQUIRE(node.update_() == 0);
+    REQUIRE(coordinator.returned() >= 49 + 49);
+}
+
+TEST_CASE("LeaseThrottle - Falls Back When The Coordinator Is Gone", "[lease][failover]") {
+    std::unique_ptr<QuotaCoordinator> coordinator(new QuotaCoordinator(10000, 0, 10000000LL));
+    uint16_t port = coordinator->port();
+    LeaseThrottle::Options options{5};
+    options.retry_ns_ = 50000000LL;
+    LeaseThrottle node(port, options);
+
+    REQUIRE(node.update_() == 0);
+    REQUIRE(node.leased());
+    coordinator.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    // The lease has expired and nobody answers: the local fallback of 5/s applies,
+    // starting from the lease's unspent tokens, which have lapsed
+    int admitted = 0;
+    for (int i = 0; i < 20; ++i) {
+        admitted += node.update_() == 0;
+    }
+    REQUIRE(!node.leased());
+    REQUIRE(admitted == 0);
+    REQUIRE(node.fallbacks() == 1);
+
+    // One fallback interval later there is one token
+    std::this_thread::sleep_for(std::chrono::milliseconds(210));
+    for (int i = 0; i < 20; ++i) {
+        admitted += node.update_() == 0;
+    }
+    REQUIRE(admitted == 1);
+    REQUIRE(node.fallbacks() == 1);
+
+    // A coordinator on the same port is picked up again after the retry interval
+    coordinator.reset(new QuotaCoordinator(10000, port, 10000000LL));
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(node.update_() == 0);
+    }
+    REQUIRE(node.leased());
+}
+
+TEST_CASE("LeaseThrottle - A Timeout Adds No Burst To Held Tokens", "[lease][failover]") {
+    std::unique_ptr<QuotaCoordinator> coordinator(new QuotaCoordinator(10000, 0, 1000000000LL));
+    LeaseThrottle::Options options{5};
+    options.min_batch_ = 20;
+    LeaseThrottle node(coordinator->port(), options);
+
+    REQUIRE(node.update_() == 0);
+    REQUIRE(node.tokens() == 19);
+    coordinator.reset();
+
+    // The held lease is spent, then the fallback has nothing left to add until it refills
+    int admitted = 0;
+    for (int i = 0; i < 100; ++i) {
+        admitted += node.update_() == 0;
+    }
+    REQUIRE(admitted == 19);
+    REQUIRE(!node.leased());
+}
+
+TEST_CASE("LeaseThrottle - The Fallback Rate Can Change In Use", "[lease][failover][rate]") {
+    std::unique_ptr<QuotaCoordinator> coordinator(new QuotaCoordinator(10000, 0, 10000000LL));
+    LeaseThrottle::Options options{5};
+    options.retry_ns_ = 1000000000LL;
+    LeaseThrottle node(coordinator->port(), options);
+
+    REQUIRE(node.update_() == 0);
+    coordinator.reset();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < 20; ++i) {
+        node.update_();
+    }
+    REQUIRE(!node.leased());
+    REQUIRE(node.attempted() == 21);
+    REQUIRE(node.rejected() == 20);
+
+    // At 50/s a 210ms gap holds ten tokens instead of one
+    node.set_tps(50);
+    REQUIRE(node.tps() == 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds(210));
+    int admitted = 0;
+    for (int i = 0; i < 20; ++i) {
+        admitted += node.update_() == 0;
+    }
+    REQUIRE(admitted >= 10);
+    REQUIRE(admitted <= 12);
+    REQUIRE(node.attempted() == 41);
+    REQUIRE(node.rejected() == 40 - static_cast<uint64_t>(admitted));
+    REQUIRE_THROWS_AS(node.set_tps(0), std::invalid_argument);
+    REQUIRE(node.tps() == 50);
+}
+
+TEST_CASE("LeaseThrottle - Late Grants Are Handed Back", "[lease][failover]") {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    REQUIRE(fd >= 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    REQUIRE(::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0);
+    REQUIRE(::getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) == 0);
+
+    LeaseThrottle::Options options{100};
+    options.min_batch_ = 10;
+    options.retry_ns_ = 1000000LL;
+    LeaseThrottle node(ntohs(address.sin_port), options);
+
+    // A coordinator that answers the first request only after the node has given up on it
+    uint32_t returned = 0;
+    std::thread coordinator([&]() {
+        QuotaCoordinator::Request request;
+        sockaddr_in peer{};
+        socklen_t peer_length = sizeof(peer);
+        ::recvfrom(fd, &request, sizeof(request), 0, reinterpret_cast<sockaddr *>(&peer), &peer_length);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        QuotaCoordinator::Reply late{request.sequence_, 40, 0, 1000000000LL, 0};
+        ::sendto(fd, &late, sizeof(late), 0, reinterpret_cast<sockaddr *>(&peer), peer_length);
+
+        ::recvfrom(fd, &request, sizeof(request), 0, reinterpret_cast<sockaddr *>(&peer), &peer_length);
+        returned = request.returned_;
+        QuotaCoordinator::Reply empty{request.sequence_, 0, 0, 1000000000LL, 1000000LL};
+        ::sendto(fd, &empty, sizeof(empty), 0, reinterpret_cast<sockaddr *>(&peer), peer_length);
+    });
+
+    REQUIRE(node.update_() > 0);
+    REQUIRE(!node.leased());
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    REQUIRE(node.update_() > 0);
+    coordinator.join();
+    ::close(fd);
+
+    REQUIRE(returned == 40);
+    REQUIRE(node.leased());
+}
+
+TEST_CASE("LeaseThrottle - Exception Handling", "[lease][exception]") {
+    REQUIRE_THROWS_AS(QuotaCoordinator(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(QuotaCoordinator(10, 0, 0), std::invalid_argument);
+    REQUIRE_THROWS_AS(LeaseThrottle(1, LeaseThrottle::Options{0}), std::invalid_argument);
+    LeaseThrottle::Options options{10};
+    options.min_batch_ = 100;
+    options.max_batch_ = 10;
+    REQUIRE_THROWS_AS(LeaseThrottle(1, options), std::invalid_argument);
+}
+
+TEST_CASE("LeaseThrottle - Leasing Benchmark", "[.benchmark][lease]") {
+    const uint32_t global_tps = 50000;
+    const int num_nodes = 4;
+    QuotaCoordinator coordinator(global_tps);
+    std::vector<std::unique_ptr<LeaseThrottle>> nodes;
+    for (int i = 0; i < num_nodes; ++i) {
+        nodes.emplace_back(new LeaseThrottle(coordinator.port(), LeaseThrottle::Options{global_tps / num_nodes}));
+    }
+
+    std::atomic<uint64_t> decisions{0}, admitted{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_nodes; ++i) {
+        threads.emplace_back([&, i]() {
+            uint64_t local = 0, ok = 0;
+            while (std::chrono::steady_clock::now() - start < std::chrono::seconds(2)) {
+                ok += nodes[i]->update_() == 0;
+                ++local;
+            }
+            decisions += local;
+            admitted += ok;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::cout << "Decisions: " << decisions.load() << ", admitted: " << admitted.load() << " in 2s" << std::endl;
+    std::cout << "Coordinator round trips: " << coordinator.requests() << " ("
+              << (double)admitted.load() / coordinator.requests() << " admissions each)" << std::endl;
+    for (int i = 0; i < num_nodes; ++i) {
+        std::cout << "Node " << i << " batch: " << nodes[i]->batch() << std::endl;
+    }
+    REQUIRE(admitted.load() <= 3 * global_tps + num_nodes * 4096);
+}
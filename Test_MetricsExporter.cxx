@@ -0,0 +1,219 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <memory>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "MetricsExporter.hxx"
+
+static std::string scrape(uint16_t port, const char *path)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return "";
+    }
+    std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    std::string response;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = ::read(fd, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, static_cast<size_t>(got));
+    }
+    ::close(fd);
+    return response;
+}
+
+// The body of a chunked response, or "" if the chunks are malformed or the last one is missing.
+static std::string dechunk(const std::string &response)
+{
+    size_t at = response.find("\r\n\r\n");
+    if (at == std::string::npos) {
+        return "";
+    }
+    std::string body;
+    for (at += 4;;) {
+        size_t end = response.find("\r\n", at);
+        if (end == std::string::npos || end == at) {
+            return "";
+        }
+        size_t size = std::stoul(response.substr(at, end - at), nullptr, 16);
+        if (size == 0) {
+            return response.compare(end, 4, "\r\n\r\n") == 0 && end + 4 == response.size() ? body : "";
+        }
+        if (response.size() < end + 2 + size + 2 || response.compare(end + 2 + size, 2, "\r\n") != 0) {
+            return "";
+        }
+        body.append(response, end + 2, size);
+        at = end + 2 + size + 2;
+    }
+}
+
+TEST_CASE("MetricsExporter - Renders Single And Keyed Limiters", "[metrics][render]") {
+    ThrottleControl api(5, true);
+    ThrottleControl plain(7);
+    KeyedThrottle users(10, 64);
+    MetricsRegistry registry;
+    registry.add("api", api);
+    registry.add("plain \"quoted\"", plain);
+    registry.add("users", users, 2);
+    REQUIRE(registry.size() == 3);
+    REQUIRE_THROWS_AS(registry.add("api", plain), std::invalid_argument);
+
+    for (int i = 0; i < 8; ++i) {
+        api.update_();
+    }
+    const int64_t now = CompactThrottle::now_();
+    for (uint64_t key = 1; key <= 4; ++key) {
+        for (uint64_t i = 0; i < key; ++i) {
+            users.update_(key, now);
+        }
+    }
+
+    std::string text = registry.render();
+    INFO(text);
+    REQUIRE(text.find("# TYPE throttle_capacity gauge\n") != std::string::npos);
+    REQUIRE(text.find("throttle_capacity{limiter=\"api\"} 5\n") != std::string::npos);
+    REQUIRE(text.find("throttle_capacity{limiter=\"plain \\\"quoted\\\"\"} 7\n") != std::string::npos);
+    REQUIRE(text.find("throttle_occupancy{limiter=\"api\"} 5\n") != std::string::npos);
+    REQUIRE(text.find("throttle_admitted_total{limiter=\"api\"} 5\n") != std::string::npos);
+    REQUIRE(text.find("throttle_rejected_total{limiter=\"api\"} 3\n") != std::string::npos);
+    REQUIRE(text.find("throttle_wait_seconds_count{limiter=\"api\"} 0\n") != std::string::npos);
+    // Counters only appear for limiters with stats enabled
+    REQUIRE(text.find("throttle_admitted_total{limiter=\"plain") == std::string::npos);
+    REQUIRE(text.find("throttle_keys{limiter=\"users\"} 4\n") != std::string::npos);
+
+    // Only the two busiest keys, busiest first
+    size_t four = text.find("throttle_key_backlog_seconds{limiter=\"users\",key=\"4\"}");
+    size_t three = text.find("throttle_key_backlog_seconds{limiter=\"users\",key=\"3\"}");
+    REQUIRE(four != std::string::npos);
+    REQUIRE(three != std::string::npos);
+    REQUIRE(four < three);
+    REQUIRE(text.find("key=\"2\"") == std::string::npos);
+    REQUIRE(text.size() >= 6);
+    REQUIRE(text.compare(text.size() - 6, 6, "# EOF\n") == 0);
+
+    REQUIRE(registry.remove("users"));
+    REQUIRE(!registry.remove("users"));
+    REQUIRE(registry.render().find("limiter=\"users\"") == std::string::npos);
+}
+
+TEST_CASE("MetricsExporter - Output Is Written In Bounded Chunks", "[metrics][writer]") {
+    KeyedThrottle keys(1000000, 1 << 16);
+    const int64_t now = CompactThrottle::now_();
+    for (uint64_t key = 0; key < 50000; ++key) {
+        keys.update_(key, now);
+    }
+    MetricsRegistry registry;
+    registry.add("keys", keys, 1000);
+
+    size_t chunks = 0, largest = 0, total = 0;
+    {
+        MetricsWriter writer([&](const char *, size_t size) {
+            ++chunks;
+            largest = std::max(largest, size);
+            total += size;
+        });
+        registry.render(writer, now);
+    }
+    std::string text;
+    {
+        MetricsWriter writer([&](const char *data, size_t size) { text.append(data, size); });
+        registry.render(writer, now);
+    }
+    REQUIRE(chunks > 1);
+    REQUIRE(largest <= 16 * 1024);
+    REQUIRE(total == text.size());
+}
+
+TEST_CASE("MetricsExporter - Scrapes Over HTTP While Admissions Continue", "[metrics][server][multithread]") {
+    ThrottleControl throttle(1000, true);
+    KeyedThrottle keys(100, 1024);
+    MetricsRegistry registry;
+    registry.add("api", throttle);
+    registry.add("keys", keys);
+    MetricsServer server(registry);
+
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> decisions{0};
+    std::thread worker([&]() {
+        uint64_t key = 0;
+        while (!done.load()) {
+            throttle.update_();
+            keys.update_(key++ % 500);
+            decisions++;
+        }
+    });
+
+    for (int i = 0; i < 5; ++i) {
+        std::string response = scrape(server.port(), "/metrics");
+        REQUIRE(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+        REQUIRE(response.find("application/openmetrics-text") != std::string::npos);
+        REQUIRE(response.find("Transfer-Encoding: chunked\r\n") != std::string::npos);
+        std::string body = dechunk(response);
+        REQUIRE(body.find("throttle_admitted_total{limiter=\"api\"}") != std::string::npos);
+        REQUIRE(body.size() >= 6);
+        REQUIRE(body.compare(body.size() - 6, 6, "# EOF\n") == 0);
+    }
+    REQUIRE(scrape(server.port(), "/other").rfind("HTTP/1.1 404", 0) == 0);
+
+    // Registering and removing during traffic never blocks the worker
+    ThrottleControl extra(10);
+    registry.add("extra", extra);
+    REQUIRE(scrape(server.port(), "/metrics").find("limiter=\"extra\"") != std::string::npos);
+    REQUIRE(registry.remove("extra"));
+
+    // A scrape larger than one writer chunk arrives as several HTTP chunks
+    std::vector<std::unique_ptr<ThrottleControl>> controls;
+    for (int i = 0; i < 100; ++i) {
+        controls.emplace_back(new ThrottleControl(10, true));
+        registry.add("control-" + std::to_string(i), *controls.back());
+    }
+    std::string response = scrape(server.port(), "/metrics");
+    REQUIRE(response.find("\r\n4000\r\n") != std::string::npos);
+    std::string body = dechunk(response);
+    REQUIRE(body.size() > 16 * 1024);
+    REQUIRE(body.find("limiter=\"control-99\"") != std::string::npos);
+    REQUIRE(body.compare(body.size() - 6, 6, "# EOF\n") == 0);
+
+    done = true;
+    worker.join();
+    REQUIRE(decisions.load() > 0);
+    REQUIRE(server.scrapes() == 7);
+}
+
+TEST_CASE("MetricsExporter - Scrape Benchmark", "[.benchmark][metrics]") {
+    KeyedThrottle keys(1000, 1 << 22);
+    const int64_t now = CompactThrottle::now_();
+    for (uint64_t key = 0; key < 2000000; ++key) {
+        keys.update_(key, now);
+    }
+    std::vector<std::unique_ptr<ThrottleControl>> controls;
+    MetricsRegistry registry;
+    registry.add("keys", keys, 100);
+    for (int i = 0; i < 100; ++i) {
+        controls.emplace_back(new ThrottleControl(10000, true));
+        registry.add("control-" + std::to_string(i), *controls.back());
+    }
+
+    size_t bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        MetricsWriter writer([&](const char *, size_t size) { bytes += size; });
+        registry.render(writer, now);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    std::cout << "Rendered 100 limiters and the top 100 of 2M keys: " << bytes << " bytes in " << elapsed.count()
+              << " us" << std::endl;
+}
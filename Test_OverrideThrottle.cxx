@@ -0,0 +1,140 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "OverrideThrottle.hxx"
+
+TEST_CASE("OverrideThrottle - Exact Key Overrides Default Rate", "[override][basic]") {
+    OverrideThrottle throttle(2, 64);
+    throttle.rules().reload(CompactThrottle::Rate::per_second(2),
+                            {{~0ULL, 42, CompactThrottle::Rate::per_second(20)}});
+    const int64_t now = 1000000000000LL;
+
+    for (int i = 0; i < 20; ++i) {
+        REQUIRE(throttle.update_(42, now) == 0);
+    }
+    REQUIRE(throttle.update_(42, now) > 0);
+
+    REQUIRE(throttle.update_(43, now) == 0);
+    REQUIRE(throttle.update_(43, now) == 0);
+    REQUIRE(throttle.update_(43, now) > 0);
+    REQUIRE(throttle.rules().size() == 1);
+}
+
+TEST_CASE("OverrideThrottle - Most Specific Pattern Wins", "[override][pattern]") {
+    auto tier = CompactThrottle::Rate::per_second(100);
+    auto vip = CompactThrottle::Rate::per_second(1000);
+    RuleTable rules(CompactThrottle::Rate::per_second(1));
+    // Keys 0x1000-0x1fff are one tier, and 0x1234 is special within it
+    rules.reload(CompactThrottle::Rate::per_second(1), {{~0xfffULL, 0x1000, tier}, {~0ULL, 0x1234, vip}});
+
+    REQUIRE(rules.lookup(0x1001).interval_ == tier.interval_);
+    REQUIRE(rules.lookup(0x1234).interval_ == vip.interval_);
+    REQUIRE(rules.lookup(0x2000).interval_ == CompactThrottle::Rate::per_second(1).interval_);
+
+    REQUIRE_THROWS_AS(rules.reload(tier, {{0xff00, 0x0001, vip}}), std::invalid_argument);
+    // A rejected reload keeps the previous rules
+    REQUIRE(rules.lookup(0x1234).interval_ == vip.interval_);
+}
+
+TEST_CASE("OverrideThrottle - Reload Keeps Limiter State", "[override][reload]") {
+    OverrideThrottle throttle(2, 64);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.update_(5, now) == 0);
+    REQUIRE(throttle.update_(5, now) == 0);
+    REQUIRE(throttle.update_(5, now) > 0);
+
+    // The key's window stays full across the reload, but it now drains at the new rate:
+    // 250ms per request instead of 500ms
+    throttle.rules().reload(CompactThrottle::Rate::per_second(2),
+                            {{~0ULL, 5, CompactThrottle::Rate::per_second(4)}});
+    REQUIRE(throttle.update_(5, now) > 0);
+    REQUIRE(throttle.update_(5, now + 250000000LL) == 0);
+    REQUIRE(throttle.update_(5, now + 250000000LL) > 0);
+    REQUIRE(throttle.keys().size() == 1);
+}
+
+TEST_CASE("OverrideThrottle - Concurrent Lookups During 100k-Rule Reloads", "[override][multithread]") {
+    const size_t num_rules = 100000;
+    auto rate_a = CompactThrottle::Rate::per_second(10);
+    auto rate_b = CompactThrottle::Rate::per_second(50);
+    std::vector<RuleTable::Rule> rules_a, rules_b;
+    for (uint64_t key = 0; key < num_rules; ++key) {
+        rules_a.push_back({~0ULL, key, rate_a});
+        rules_b.push_back({~0ULL, key, rate_b});
+    }
+
+    RuleTable rules(CompactThrottle::Rate::per_second(1));
+    rules.reload(rate_a, rules_a);
+    std::atomic<bool> done{false};
+    std::atomic<size_t> bad{0};
+    std::vector<std::thread> readers;
+
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&, i]() {
+            uint64_t key = i;
+            while (!done.load()) {
+                int64_t interval = rules.lookup(key % num_rules).interval_;
+                if (interval != rate_a.interval_ && interval != rate_b.interval_) {
+                    bad++;
+                }
+                key += 7919;
+            }
+        });
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < 10; ++i) {
+        rules.reload(rate_a, i % 2 == 0 ? rules_b : rules_a);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    done.store(true);
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    INFO("10 reloads of " << num_rules << " rules in "
+                          << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms");
+    REQUIRE(bad.load() == 0);
+    REQUIRE(rules.size() == num_rules);
+}
+
+TEST_CASE("OverrideThrottle - Back-To-Back Reloads Never Free A Snapshot In Use", "[override][reload][multithread]") {
+    const int num_reloads = 20000;
+    const int64_t first = 1000000;
+    RuleTable rules(CompactThrottle::Rate{first, first});
+    std::atomic<bool> done{false};
+    std::atomic<size_t> bad{0};
+    std::atomic<uint64_t> lookups{0};
+    std::vector<std::thread> readers;
+
+    // Every snapshot answers with its own interval, so a freed one shows up as an out-of-range rate
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&, i]() {
+            uint64_t key = i, local = 0;
+            while (!done.load()) {
+                int64_t interval = rules.lookup(key++ % 8).interval_;
+                if (interval < first || interval > first + num_reloads) {
+                    bad++;
+                }
+                ++local;
+            }
+            lookups += local;
+        });
+    }
+
+    for (int i = 1; i <= num_reloads; ++i) {
+        CompactThrottle::Rate rate{first + i, first + i};
+        rules.reload(rate, {{~0ULL, static_cast<uint64_t>(i % 8), rate}});
+    }
+    done.store(true);
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    REQUIRE(bad.load() == 0);
+    REQUIRE(lookups.load() > 0);
+    REQUIRE(rules.lookup(0).interval_ == first + num_reloads);
+}
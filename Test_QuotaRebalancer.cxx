@@ -0,0 +1,202 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include "QuotaRebalancer.hxx"
+#include "SharedThrottle.hxx"
+#include "LeaseThrottle.hxx"
+
+namespace {
+
+// Offers `load` requests per second to each throttle in 1ms steps of simulated time; returns admissions.
+std::vector<uint64_t> drive(std::vector<std::unique_ptr<RebalancedThrottle>> &throttles,
+                            const std::vector<uint32_t> &load, int64_t &now, int64_t duration_ns)
+{
+    const int64_t step = 1000000LL;
+    std::vector<uint64_t> admitted(throttles.size(), 0);
+    std::vector<double> owed(throttles.size(), 0.0);
+    for (int64_t t = 0; t < duration_ns; t += step) {
+        now += step;
+        for (size_t i = 0; i < throttles.size(); ++i) {
+            owed[i] += load[i] / 1000.0;
+            for (; owed[i] >= 1.0; owed[i] -= 1.0) {
+                admitted[i] += throttles[i]->update_(now) == 0;
+            }
+        }
+    }
+    return admitted;
+}
+
+}  // namespace
+
+TEST_CASE("QuotaRebalancer - RebalancedThrottle Changes Rate In Place", "[rebalance][throttle]") {
+    RebalancedThrottle throttle(2);
+    const int64_t now = 1000000000000LL;
+
+    REQUIRE(throttle.update_(now) == 0);
+    REQUIRE(throttle.update_(now) == 0);
+    REQUIRE(throttle.update_(now) > 0);
+    REQUIRE(throttle.attempted() == 3);
+    REQUIRE(throttle.rejected() == 1);
+
+    throttle.set_tps(10);
+    REQUIRE(throttle.tps() == 10);
+    REQUIRE(throttle.rate().interval_ == 100000000LL);
+    REQUIRE(throttle.rate().window_ == 1000000000LL);
+    REQUIRE_THROWS_AS(throttle.set_tps(0), std::invalid_argument);
+    REQUIRE(throttle.tps() == 10);
+}
+
+TEST_CASE("QuotaRebalancer - Skewed Load Converges To Demand", "[rebalance][convergence]") {
+    const uint32_t total = 1000;
+    int64_t now = 1000000000000LL;
+    std::vector<std::unique_ptr<RebalancedThrottle>> throttles;
+    QuotaRebalancer rebalancer(total, 10, 500000000LL);
+    for (int i = 0; i < 4; ++i) {
+        throttles.emplace_back(new RebalancedThrottle(10));
+        rebalancer.add(*throttles.back(), now);
+    }
+    REQUIRE(rebalancer.allocation(0) == 250);
+
+    // One hot shard and three quiet ones: a static split would cap the hot one at 250/s
+    std::vector<uint32_t> load = {700, 50, 50, 50};
+    for (int round = 0; round < 20; ++round) {
+        drive(throttles, load, now, 250000000LL);
+        rebalancer.rebalance(now);
+    }
+    REQUIRE(rebalancer.allocation(0) >= 700);
+    for (size_t i = 1; i < 4; ++i) {
+        REQUIRE(rebalancer.allocation(i) >= 50);
+    }
+    std::vector<uint64_t> admitted = drive(throttles, load, now, 1000000000LL);
+    REQUIRE(admitted[0] >= 690);
+    REQUIRE(admitted[1] >= 49);
+
+    // The load moves to another shard and the quota follows it
+    load = {50, 50, 700, 50};
+    for (int round = 0; round < 20; ++round) {
+        drive(throttles, load, now, 250000000LL);
+        rebalancer.rebalance(now);
+    }
+    REQUIRE(rebalancer.allocation(2) >= 700);
+    admitted = drive(throttles, load, now, 1000000000LL);
+    REQUIRE(admitted[2] >= 690);
+    REQUIRE(admitted[0] >= 49);
+}
+
+TEST_CASE("QuotaRebalancer - Total Is Never Exceeded While Applying", "[rebalance][bound]") {
+    const uint32_t total = 600;
+    int64_t now = 1000000000000LL;
+    std::vector<uint32_t> rates(3, 0);
+    std::vector<uint64_t> attempted(3, 0), rejected(3, 0);
+    uint64_t worst = 0;
+    QuotaRebalancer rebalancer(total, 5, 1000000000LL);
+
+    // A member is just the two hooks
+    for (size_t i = 0; i < 3; ++i) {
+        rebalancer.add([&, i]() { return QuotaRebalancer::Counters{attempted[i], rejected[i]}; },
+                       [&, i](uint32_t tps) {
+                           rates[i] = tps;
+                           uint64_t sum = rates[0] + rates[1] + rates[2];
+                           worst = sum > worst ? sum : worst;
+                       },
+                       now);
+    }
+
+    for (int round = 0; round < 200; ++round) {
+        now += 100000000LL;
+        size_t hot = (round / 10) % 3;
+        for (size_t i = 0; i < 3; ++i) {
+            uint64_t offered = i == hot ? 80 : 2;
+            attempted[i] += offered;
+            uint64_t allowed = rates[i] / 10;
+            rejected[i] += offered > allowed ? offered - allowed : 0;
+        }
+        rebalancer.rebalance(now);
+        REQUIRE(rates[0] + rates[1] + rates[2] <= total);
+        for (size_t i = 0; i < 3; ++i) {
+            REQUIRE(rates[i] >= 5);
+        }
+    }
+    REQUIRE(worst <= total);
+    REQUIRE(rebalancer.demand(0) >= 0.0);
+}
+
+TEST_CASE("QuotaRebalancer - A Late Member Does Not Skew The Others' Demand", "[rebalance][demand]") {
+    int64_t now = 1000000000000LL;
+    std::vector<uint64_t> attempted(2, 0);
+    QuotaRebalancer rebalancer(1000, 1, 1);  // a 1ns half-life makes demand the last interval's rate
+    for (size_t i = 0; i < 2; ++i) {
+        if (i == 1) {
+            // Joins halfway through the first member's interval, after 100 requests
+            now += 500000000LL;
+            attempted[0] += 100;
+        }
+        rebalancer.add([&, i]() { return QuotaRebalancer::Counters{attempted[i], 0}; }, [](uint32_t) {}, now);
+    }
+    now += 500000000LL;
+    attempted[0] += 100;
+    attempted[1] += 100;
+    rebalancer.rebalance(now);
+
+    // 200 requests over the first member's second and 100 over the second member's half second
+    REQUIRE(rebalancer.demand(0) > 199.0);
+    REQUIRE(rebalancer.demand(0) < 201.0);
+    REQUIRE(rebalancer.demand(1) > 199.0);
+    REQUIRE(rebalancer.demand(1) < 201.0);
+
+    // A rebalance at the same instant leaves every demand as it was
+    rebalancer.rebalance(now);
+    REQUIRE(rebalancer.demand(0) > 199.0);
+}
+
+TEST_CASE("QuotaRebalancer - Shared And Leased Throttles Are Members Too", "[rebalance][members]") {
+    std::string name = "/throttle-test-rebalance-" + std::to_string(::getpid());
+    SharedThrottle::unlink(name);
+    SharedThrottle shared(name, 1);
+    SharedThrottle attached(name, 1);
+    // Never updated, so it never talks to a coordinator; only its fallback share is rebalanced
+    LeaseThrottle leased(1, LeaseThrottle::Options{1});
+    int64_t now = 1000000000000LL;
+
+    QuotaRebalancer rebalancer(100, 5, 500000000LL);
+    rebalancer.add(shared, now);
+    rebalancer.add(leased, now);
+    REQUIRE(attached.rate().interval_ == 20000000LL);
+    REQUIRE(leased.tps() == 50);
+
+    // About ninety a second offered through the second handle: the segment's rate follows it
+    for (int round = 0; round < 20; ++round) {
+        for (int step = 0; step < 250; ++step) {
+            now += 1000000LL;
+            if (step % 11 == 0) {
+                attached.update_(now);
+            }
+        }
+        rebalancer.rebalance(now);
+    }
+    uint32_t allocated = rebalancer.allocation(0);
+    REQUIRE(allocated >= 90);
+    REQUIRE(shared.rate().interval_ == 1000000000LL / allocated);
+    REQUIRE(leased.tps() == 100 - allocated);
+    REQUIRE(leased.tps() >= 5);
+    REQUIRE(SharedThrottle::unlink(name));
+}
+
+TEST_CASE("QuotaRebalancer - Exception Handling", "[rebalance][exception]") {
+    REQUIRE_THROWS_AS(QuotaRebalancer(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(QuotaRebalancer(10, 0), std::invalid_argument);
+    REQUIRE_THROWS_AS(QuotaRebalancer(10, 1, 0), std::invalid_argument);
+
+    QuotaRebalancer rebalancer(10, 5);
+    RebalancedThrottle first(1), second(1), third(1);
+    rebalancer.add(first);
+    rebalancer.add(second);
+    REQUIRE_THROWS_AS(rebalancer.add(third), std::length_error);
+    REQUIRE(rebalancer.size() == 2);
+    REQUIRE(first.tps() == 5);
+}
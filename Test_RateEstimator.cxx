@@ -0,0 +1,129 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cmath>
+#include "ThrottleCrontol.hxx"
+#include "KeyedThrottle.hxx"
+
+static constexpr int64_t kSecond = 1000000000LL;
+
+static bool near(double actual, double expected, double tolerance)
+{
+    return std::abs(actual - expected) <= tolerance * expected;
+}
+
+TEST_CASE("RateEstimator - Tracks Steady And Changing Rates", "[rates][basic]") {
+    RateEstimator rates(kSecond);
+    REQUIRE(rates.tick() == kSecond / RateEstimator::kTicksPerConstant);
+    REQUIRE(rates.attempted_rate(kSecond) == 0);
+
+    // 1000 attempts/s, every other one admitted, for 10 time constants
+    int64_t now = kSecond;
+    for (int i = 0; i < 10000; ++i) {
+        now += kSecond / 1000;
+        rates.add(now, i % 2);
+    }
+    REQUIRE(near(rates.attempted_rate(now), 1000, 0.02));
+    REQUIRE(near(rates.admitted_rate(now), 500, 0.02));
+
+    // A step to 4000/s is 1 - 1/e of the way there after one time constant
+    const int64_t step = now;
+    while (now < step + kSecond) {
+        now += kSecond / 4000;
+        rates.add(now, 0);
+    }
+    REQUIRE(near(rates.attempted_rate(now), 4000 - 3000 * std::exp(-1.0), 0.05));
+
+    // With no traffic the readers decay the last fold on their own
+    double before = rates.attempted_rate(now);
+    REQUIRE(near(rates.attempted_rate(now + kSecond), before * std::exp(-1.0), 0.05));
+    REQUIRE(rates.attempted_rate(now + 20 * kSecond) < 1);
+}
+
+TEST_CASE("RateEstimator - Keyed Limiter Reports Offered And Admitted Load", "[rates][keyed]") {
+    KeyedThrottle keys(1000, 64);
+    RateEstimator rates(kSecond / 2);
+    keys.set_rates(&rates);
+
+    // 4000/s offered to a 1000/s key, in cost units
+    int64_t now = CompactThrottle::now_();
+    for (int i = 0; i < 20000; ++i) {
+        now += kSecond / 2000;
+        keys.update_(7, now, 2);
+    }
+    REQUIRE(near(rates.attempted_rate(now), 4000, 0.02));
+    REQUIRE(near(rates.admitted_rate(now), 1000, 0.05));
+
+    keys.set_rates(nullptr);
+    keys.update_(7, now + kSecond / 2);
+    REQUIRE(rates.attempted_rate(now + kSecond / 2) < 4000 * 0.5);
+}
+
+TEST_CASE("RateEstimator - Concurrent Updates On A Real Clock", "[rates][multithread]") {
+    const int num_threads = 4;
+    ThrottleControl throttle(1000000);
+    RateEstimator rates(kSecond / 10);
+    throttle.set_rates(&rates);
+
+    std::atomic<uint64_t> calls{0};
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            uint64_t local = 0;
+            while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(300)) {
+                throttle.update_();
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                ++local;
+            }
+            calls += local;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double actual = calls.load() / seconds;
+    int64_t now = CompactThrottle::now_();
+    INFO("actual " << actual << "/s, estimated " << rates.attempted_rate(now) << "/s");
+    REQUIRE(near(rates.attempted_rate(now), actual, 0.3));
+    REQUIRE(rates.admitted_rate(now) == rates.attempted_rate(now));
+}
+
+TEST_CASE("RateEstimator - Exception Handling", "[rates][exception]") {
+    REQUIRE_THROWS_AS(RateEstimator(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(RateEstimator(-1), std::invalid_argument);
+    RateEstimator tiny(1);
+    REQUIRE(tiny.tick() == 1);
+}
+
+TEST_CASE("RateEstimator - Update Overhead Benchmark", "[.benchmark][rates]") {
+    const int calls = 2000000;
+    for (int num_threads : {1, 4}) {
+        for (bool with_rates : {false, true}) {
+            KeyedThrottle keys(1000000, 1 << 16);
+            RateEstimator rates;
+            if (with_rates) {
+                keys.set_rates(&rates);
+            }
+            std::vector<std::thread> threads;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < num_threads; ++i) {
+                threads.emplace_back([&, i]() {
+                    for (int j = 0; j < calls; ++j) {
+                        keys.update_(static_cast<uint64_t>(i * calls + j) % 1000);
+                    }
+                });
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            std::cout << num_threads << " threads, " << (with_rates ? "with" : "without")
+                      << " rates: " << ns / calls << " ns per call per thread" << std::endl;
+        }
+    }
+}
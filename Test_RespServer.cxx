@@ -0,0 +1,406 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "RespServer.hxx"
+
+static int connect_to(uint16_t port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t wrote = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (wrote <= 0) {
+            return;
+        }
+        sent += static_cast<size_t>(wrote);
+    }
+}
+
+// Reads until the buffer holds `lines` CRLF-terminated lines, or the peer closes.
+static std::string read_lines(int fd, size_t lines)
+{
+    std::string data;
+    char buffer[4096];
+    while (static_cast<size_t>(std::count(data.begin(), data.end(), '\n')) < lines) {
+        ssize_t got = ::read(fd, buffer, sizeof(buffer));
+        if (got <= 0) {
+            break;
+        }
+        data.append(buffer, static_cast<size_t>(got));
+    }
+    return data;
+}
+
+static std::string throttle_command(const std::string &key, const char *burst, const char *count, const char *period)
+{
+    auto bulk = [](const std::string &value) { return "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n"; };
+    return "*5\r\n" + bulk("CL.THROTTLE") + bulk(key) + bulk(burst) + bulk(count) + bulk(period);
+}
+
+TEST_CASE("RespServer - Parser Handles Arrays, Inline Commands And Partial Input", "[resp][parser]") {
+    RespParser::Command command;
+    std::string input = "*2\r\n$4\r\nECHO\r\n$5\r\nhello\r\n*1\r\n$4\r\nPING\r\n";
+
+    ptrdiff_t used = RespParser::parse(input.data(), input.size(), command);
+    REQUIRE(used == 25);
+    REQUIRE(command.count_ == 2);
+    REQUIRE(command.args_[0] == "ECHO");
+    REQUIRE(command.args_[1] == "hello");
+    REQUIRE(RespParser::parse(input.data() + used, input.size() - used, command) == 14);
+    REQUIRE(command.args_[0] == "PING");
+
+    // Every strict prefix of a command asks for more input
+    for (size_t i = 0; i < 25; ++i) {
+        REQUIRE(RespParser::parse(input.data(), i, command) == 0);
+    }
+
+    std::string inline_command = "cl.throttle  key 1 2 3\r\nPING";
+    REQUIRE(RespParser::parse(inline_command.data(), inline_command.size(), command) == 24);
+    REQUIRE(command.count_ == 5);
+    REQUIRE(command.args_[1] == "key");
+    REQUIRE(command.args_[4] == "3");
+
+    std::string bad_length = "*1\r\n$x\r\n";
+    REQUIRE(RespParser::parse(bad_length.data(), bad_length.size(), command) < 0);
+    std::string bad_terminator = "*1\r\n$2\r\nabc\r\n";
+    REQUIRE(RespParser::parse(bad_terminator.data(), bad_terminator.size(), command) < 0);
+}
+
+TEST_CASE("RespServer - CL.THROTTLE Replies Like redis-cell", "[resp][throttle]") {
+    KeyedThrottle throttle(1, 64);
+    const int64_t now = 1000000000000LL;
+    RespParser::Command command;
+    command.count_ = 5;
+    command.args_[0] = "cl.throttle";
+    command.args_[1] = "user:42";
+    command.args_[2] = "2";
+    command.args_[3] = "1";
+    command.args_[4] = "1";
+
+    // Burst of 2 on top of 1 per second: three requests pass, then one second to wait
+    std::string out;
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(RespServer::execute(throttle, command, out, now));
+    }
+    REQUIRE(out == "*5\r\n:0\r\n:3\r\n:2\r\n:-1\r\n:1\r\n"
+                   "*5\r\n:0\r\n:3\r\n:1\r\n:-1\r\n:2\r\n"
+                   "*5\r\n:0\r\n:3\r\n:0\r\n:-1\r\n:3\r\n"
+                   "*5\r\n:1\r\n:3\r\n:0\r\n:1\r\n:3\r\n");
+
+    // A quantity of 0 peeks without spending
+    command.count_ = 6;
+    command.args_[5] = "0";
+    out.clear();
+    REQUIRE(RespServer::execute(throttle, command, out, now + 2000000000LL));
+    REQUIRE(out == "*5\r\n:0\r\n:3\r\n:2\r\n:-1\r\n:1\r\n");
+    REQUIRE(throttle.tat("user:42") == now + 3000000000LL);
+
+    out.clear();
+    command.args_[3] = "0";
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out.rfind("-ERR", 0) == 0);
+    out.clear();
+    command.args_[3] = "-1";
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out.rfind("-ERR", 0) == 0);
+    out.clear();
+    command.count_ = 3;
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out.rfind("-ERR", 0) == 0);
+
+    out.clear();
+    command.count_ = 1;
+    command.args_[0] = "QUIT";
+    REQUIRE(!RespServer::execute(throttle, command, out, now));
+    REQUIRE(out == "+OK\r\n");
+}
+
+TEST_CASE("RespServer - Rates That Would Overflow Are Rejected", "[resp][throttle]") {
+    KeyedThrottle throttle(1, 64);
+    const int64_t now = 1000000000000LL;
+    RespParser::Command command;
+    command.count_ = 6;
+    command.args_[0] = "CL.THROTTLE";
+    command.args_[1] = "k";
+    command.args_[5] = "1";
+
+    // A 1000-day interval times a burst of 100001, then times a quantity of 2^31 - 1
+    const char *rates[][4] = {{"100000", "1", "86400000", "1"}, {"0", "1", "86400000", "2147483647"},
+                              {"2147483647", "1", "3153600000", "1"}};
+    for (auto &rate : rates) {
+        command.args_[2] = rate[0];
+        command.args_[3] = rate[1];
+        command.args_[4] = rate[2];
+        command.args_[5] = rate[3];
+        std::string out;
+        REQUIRE(RespServer::execute(throttle, command, out, now));
+        REQUIRE(out == "-ERR invalid rate\r\n");
+    }
+    REQUIRE(throttle.size() == 0);
+
+    // The largest span that fits is still answered
+    command.args_[2] = "0";
+    command.args_[3] = "1";
+    command.args_[4] = "3153600000";
+    command.args_[5] = "1";
+    std::string out;
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out == "*5\r\n:0\r\n:1\r\n:0\r\n:-1\r\n:3153600000\r\n");
+}
+
+TEST_CASE("RespServer - Limited Replies Report What Is Left", "[resp][throttle]") {
+    KeyedThrottle throttle(1, 64);
+    const int64_t now = 1000000000000LL;
+    RespParser::Command command;
+    command.count_ = 6;
+    command.args_[0] = "CL.THROTTLE";
+    command.args_[1] = "k";
+    command.args_[2] = "4";
+    command.args_[3] = "1";
+    command.args_[4] = "1";
+
+    // Of a burst of 5, three are spent; a request for three is refused but two are still there
+    std::string out;
+    command.args_[5] = "3";
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out == "*5\r\n:0\r\n:5\r\n:2\r\n:-1\r\n:3\r\n");
+    out.clear();
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out == "*5\r\n:1\r\n:5\r\n:2\r\n:1\r\n:3\r\n");
+
+    out.clear();
+    command.args_[5] = "2";
+    RespServer::execute(throttle, command, out, now);
+    REQUIRE(out == "*5\r\n:0\r\n:5\r\n:0\r\n:-1\r\n:5\r\n");
+}
+
+TEST_CASE("RespServer - Wrong Arity Is Reported Per Command", "[resp][command]") {
+    KeyedThrottle throttle(1, 64);
+    RespParser::Command command;
+    command.args_[0] = "echo";
+    std::string out;
+    for (size_t count : {1, 3}) {
+        command.count_ = count;
+        command.args_[1] = "a";
+        command.args_[2] = "b";
+        out.clear();
+        REQUIRE(RespServer::execute(throttle, command, out, 0));
+        REQUIRE(out == "-ERR wrong number of arguments for 'echo' command\r\n");
+    }
+    command.count_ = 2;
+    out.clear();
+    RespServer::execute(throttle, command, out, 0);
+    REQUIRE(out == "$1\r\na\r\n");
+}
+
+TEST_CASE("RespServer - Pipelined Commands Over Loopback", "[resp][server]") {
+    KeyedThrottle throttle(1, 1024);
+    RespServer server(throttle, 0, 2);
+    int fd = connect_to(server.port());
+    REQUIRE(fd >= 0);
+
+    // 100 decisions against a burst of 10 in a single write
+    std::string pipeline = "PING\r\n";
+    for (int i = 0; i < 100; ++i) {
+        pipeline += throttle_command("pipelined", "9", "1", "60");
+    }
+    send_all(fd, pipeline);
+    std::string replies = read_lines(fd, 1 + 100 * 6);
+    REQUIRE(replies.rfind("+PONG\r\n", 0) == 0);
+
+    int allowed = 0, limited = 0;
+    for (size_t at = replies.find("*5\r\n"); at != std::string::npos; at = replies.find("*5\r\n", at + 1)) {
+        allowed += replies.compare(at + 4, 4, ":0\r\n") == 0;
+        limited += replies.compare(at + 4, 4, ":1\r\n") == 0;
+    }
+    REQUIRE(allowed == 10);
+    REQUIRE(limited == 90);
+
+    // Commands split across writes are answered once complete
+    std::string command = throttle_command("split", "0", "1", "1");
+    send_all(fd, command.substr(0, 10));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    send_all(fd, command.substr(10));
+    REQUIRE(read_lines(fd, 6).rfind("*5\r\n:0\r\n:1\r\n:0\r\n", 0) == 0);
+
+    send_all(fd, "*1\r\n$4\r\nQUIT\r\n");
+    REQUIRE(read_lines(fd, 2) == "+OK\r\n");
+    ::close(fd);
+
+    // Protocol errors are reported before the connection is closed
+    fd = connect_to(server.port());
+    send_all(fd, "*1\r\n$-5\r\n");
+    REQUIRE(read_lines(fd, 2).rfind("-ERR Protocol error", 0) == 0);
+    ::close(fd);
+    REQUIRE(server.commands() >= 103);
+}
+
+TEST_CASE("RespServer - Commands Sent Before A Half-Close Are Answered", "[resp][server]") {
+    KeyedThrottle throttle(1, 1024);
+    RespServer server(throttle, 0, 1);
+    int fd = connect_to(server.port());
+    REQUIRE(fd >= 0);
+
+    // Corked, the commands and the FIN arrive together; exactly two reads' worth, so the server
+    // reaches EOF before it has answered any of them
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+    std::string pipeline;
+    for (int i = 0; i < 5459; ++i) {
+        pipeline += "PING\r\n";
+    }
+    pipeline += "*1\r\n$4\r\nPING\r\n";
+    REQUIRE(pipeline.size() == 32768);
+    send_all(fd, pipeline);
+    ::shutdown(fd, SHUT_WR);
+
+    std::string replies = read_lines(fd, 10000);
+    REQUIRE(std::count(replies.begin(), replies.end(), '\n') == 5460);
+    REQUIRE(replies.rfind("+PONG\r\n", 0) == 0);
+    char byte;
+    REQUIRE(::read(fd, &byte, 1) == 0);
+    ::close(fd);
+    REQUIRE(server.commands() == 5460);
+
+    // An incomplete command left at EOF is dropped and the connection still closes
+    fd = connect_to(server.port());
+    send_all(fd, "PING\r\n*1\r\n$4\r\nPI");
+    ::shutdown(fd, SHUT_WR);
+    REQUIRE(read_lines(fd, 10) == "+PONG\r\n");
+    ::close(fd);
+}
+
+TEST_CASE("RespServer - A Client That Does Not Read Is Paused", "[resp][server]") {
+    KeyedThrottle throttle(1, 64);
+    RespServer server(throttle, 0, 1);
+    int fd = connect_to(server.port());
+    REQUIRE(fd >= 0);
+    ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // 48 MiB of PINGs is more than the socket buffers and the server's reply cap can hold together
+    std::string pings;
+    for (int i = 0; i < 4096; ++i) {
+        pings += "PING\r\n";
+    }
+    const size_t total = 2048 * pings.size();
+    size_t sent = 0;
+    for (int idle = 0; sent < total && idle < 20;) {
+        ssize_t wrote = ::send(fd, pings.data() + sent % pings.size(), pings.size() - sent % pings.size(),
+                               MSG_NOSIGNAL);
+        if (wrote > 0) {
+            sent += static_cast<size_t>(wrote);
+            idle = 0;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ++idle;
+        }
+    }
+    REQUIRE(sent < total);
+    uint64_t paused_at = server.commands();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(server.commands() == paused_at);
+    REQUIRE(paused_at < sent / 6);
+
+    // Once the client reads, the rest is answered in order
+    size_t replies = 0;
+    char buffer[65536];
+    while (replies < total / 6) {
+        if (sent < total) {
+            ssize_t wrote = ::send(fd, pings.data() + sent % pings.size(), pings.size() - sent % pings.size(),
+                                   MSG_NOSIGNAL);
+            sent += wrote > 0 ? static_cast<size_t>(wrote) : 0;
+        }
+        ssize_t got = ::read(fd, buffer, sizeof(buffer));
+        if (got == 0 || (got < 0 && errno != EAGAIN)) {
+            break;
+        }
+        replies += got > 0 ? static_cast<size_t>(std::count(buffer, buffer + got, '\n')) : 0;
+    }
+    REQUIRE(replies == total / 6);
+    REQUIRE(server.commands() == total / 6);
+    ::close(fd);
+}
+
+TEST_CASE("RespServer - Loopback Load Benchmark", "[.benchmark][resp]") {
+    const int num_clients = 4;
+    const int depth = 32;
+    const auto duration = std::chrono::seconds(2);
+    KeyedThrottle throttle(1, 1 << 20);
+    RespServer server(throttle, 0, 2);
+
+    // Each client keeps `depth` commands in flight and times every round trip of a batch
+    std::vector<std::vector<int64_t>> latencies(num_clients);
+    std::atomic<uint64_t> commands{0}, limited{0};
+    std::vector<std::thread> clients;
+    auto start = std::chrono::steady_clock::now();
+    for (int client = 0; client < num_clients; ++client) {
+        clients.emplace_back([&, client]() {
+            int fd = connect_to(server.port());
+            uint64_t key = static_cast<uint64_t>(client) << 32;
+            uint64_t done = 0, rejected = 0;
+            while (std::chrono::steady_clock::now() - start < duration) {
+                std::string batch;
+                for (int i = 0; i < depth; ++i) {
+                    batch += throttle_command("client:" + std::to_string(key++ % 100000), "100", "1000", "1");
+                }
+                auto sent = std::chrono::steady_clock::now();
+                send_all(fd, batch);
+                std::string replies = read_lines(fd, depth * 6);
+                latencies[client].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                           std::chrono::steady_clock::now() - sent).count());
+                for (size_t at = replies.find("*5\r\n:1"); at != std::string::npos;
+                     at = replies.find("*5\r\n:1", at + 1)) {
+                    ++rejected;
+                }
+                done += depth;
+            }
+            ::close(fd);
+            commands += done;
+            limited += rejected;
+        });
+    }
+    for (auto &t : clients) {
+        t.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<int64_t> all;
+    for (auto &samples : latencies) {
+        all.insert(all.end(), samples.begin(), samples.end());
+    }
+    std::sort(all.begin(), all.end());
+    REQUIRE(!all.empty());
+    std::cout << "Clients: " << num_clients << ", pipeline depth: " << depth << std::endl;
+    std::cout << "Throughput: " << commands.load() / seconds << " commands/s (" << limited.load() << " limited)"
+              << std::endl;
+    std::cout << "Batch latency p50: " << all[all.size() / 2] / 1000
+              << " us, p99: " << all[all.size() * 99 / 100] / 1000 << " us, max: " << all.back() / 1000 << " us"
+              << std::endl;
+    REQUIRE(server.commands() == commands.load());
+}
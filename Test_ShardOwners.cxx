@@ -0,0 +1,76 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include "ShardOwners.hxx"
+
+TEST_CASE("ShardOwners - One Live Owner Per Shard", "[shard][owner]") {
+    ShardOwners<1> owners;
+    std::atomic<bool> claimed{false}, done{false};
+    size_t first = 1;
+    std::thread holder([&]() {
+        first = owners.claim();
+        REQUIRE(owners.claim() == first);
+        claimed = true;
+        while (!done) {
+            std::this_thread::yield();
+        }
+    });
+    while (!claimed) {
+        std::this_thread::yield();
+    }
+    REQUIRE(first == 0);
+    REQUIRE(owners.owner(0) != 0);
+
+    // Every thread maps to the only shard, which is held
+    size_t second = 0;
+    std::thread([&]() { second = owners.claim(); }).join();
+    REQUIRE(second == 1);
+
+    done = true;
+    holder.join();
+    REQUIRE(owners.owner(0) == 0);
+}
+
+TEST_CASE("ShardOwners - Exited Threads Leave Their Shards To Others", "[shard][owner]") {
+    ShardOwners<4> owners;
+    std::vector<uint32_t> tokens;
+    for (int i = 0; i < 100; ++i) {
+        size_t shard = 4;
+        uint32_t token = 0;
+        std::thread([&]() {
+            token = ShardOwners<4>::token();
+            shard = owners.claim();
+        }).join();
+        REQUIRE(shard == token % 4);
+        tokens.push_back(token);
+    }
+    for (size_t shard = 0; shard < 4; ++shard) {
+        REQUIRE(owners.owner(shard) == 0);
+    }
+
+    // Tokens are never reused, even though shards are
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        REQUIRE(tokens[i] > tokens[i - 1]);
+    }
+}
+
+TEST_CASE("ShardOwners - A Thread May Outlive What It Claimed", "[shard][owner]") {
+    std::atomic<int> stage{0};
+    std::thread worker([&]() {
+        for (int i = 0; i < 1000; ++i) {
+            std::unique_ptr<ShardOwners<8>> owners(new ShardOwners<8>());
+            REQUIRE(owners->claim() < 8);
+        }
+        stage = 1;
+        while (stage != 2) {
+            std::this_thread::yield();
+        }
+    });
+    while (stage != 1) {
+        std::this_thread::yield();
+    }
+    stage = 2;
+    worker.join();
+}
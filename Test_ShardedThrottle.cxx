@@ -0,0 +1,218 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include "ShardedThrottle.hxx"
+
+TEST_CASE("ShardedThrottle - SpscQueue Moves Batches In Order", "[sharded][queue]") {
+    SpscQueue<uint64_t> queue(6);
+    REQUIRE(queue.capacity() == 8);
+
+    uint64_t items[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    REQUIRE(queue.push(items, 10) == 8);
+    REQUIRE(!queue.push(items[9]));
+
+    uint64_t out[10];
+    REQUIRE(queue.pop(out, 3) == 3);
+    REQUIRE(queue.push(items + 8, 2) == 2);
+    REQUIRE(queue.pop(out + 3, 10) == 7);
+    for (uint64_t i = 0; i < 10; ++i) {
+        REQUIRE(out[i] == i);
+    }
+    REQUIRE(queue.pop(out, 1) == 0);
+
+    REQUIRE_THROWS_AS(SpscQueue<uint64_t>(0), std::invalid_argument);
+}
+
+TEST_CASE("ShardedThrottle - Ownership Is Consistent", "[sharded][owner]") {
+    ShardedThrottle four(10, 4, 16);
+    ShardedThrottle five(10, 5, 16);
+    size_t counts[4] = {};
+    size_t moved = 0;
+
+    for (uint64_t key = 0; key < 100000; ++key) {
+        size_t owner = four.owner(key);
+        REQUIRE(owner < 4);
+        REQUIRE(four.shard(owner).owns(key));
+        counts[owner]++;
+        // Adding a shard only moves keys onto the new shard
+        if (five.owner(key) != owner) {
+            REQUIRE(five.owner(key) == 4);
+            moved++;
+        }
+    }
+    for (size_t count : counts) {
+        REQUIRE(count > 20000);
+        REQUIRE(count < 30000);
+    }
+    REQUIRE(moved > 15000);
+    REQUIRE(moved < 25000);
+}
+
+TEST_CASE("ShardedThrottle - Owner Decides Locally And Answers Others", "[sharded][basic]") {
+    ShardedThrottle throttle(3, 2, 64);
+    const int64_t now = 1000000000000LL;
+    uint64_t key = 0;
+    while (throttle.owner(key) != 1) {
+        ++key;
+    }
+
+    ShardedThrottle::Shard &owner = throttle.shard(1);
+    ShardedThrottle::Shard &other = throttle.shard(0);
+    REQUIRE_THROWS_AS(other.update_(key, now), std::invalid_argument);
+    REQUIRE(owner.update_(key, now) == 0);
+
+    std::vector<int64_t> waits(4, -1);
+    auto record = [&](uint64_t cookie, int64_t wait) { waits[cookie] = wait; };
+    for (uint64_t cookie = 0; cookie < 3; ++cookie) {
+        other.submit(key, cookie);
+    }
+    REQUIRE(other.pending() == 3);
+    REQUIRE(other.poll(now, record) == 0);
+    REQUIRE(owner.poll(now, record) == 0);
+    REQUIRE(other.poll(now, record) == 3);
+    REQUIRE(other.pending() == 0);
+    REQUIRE(waits[0] == 0);
+    REQUIRE(waits[1] == 0);
+    REQUIRE(waits[2] > 0);
+
+    // Submitting a key the shard owns itself is answered on the next poll
+    owner.submit(key, 3);
+    REQUIRE(owner.poll(now + 1000000000LL, record) == 1);
+    REQUIRE(waits[3] == 0);
+    REQUIRE(owner.check_(key, now + 1000000000LL) == 0);
+    REQUIRE(owner.size() == 1);
+    REQUIRE(other.size() == 0);
+}
+
+TEST_CASE("ShardedThrottle - Full Queues Keep Requests Buffered", "[sharded][queue]") {
+    ShardedThrottle throttle(1000, 2, 64, 4);
+    const int64_t now = 1000000000000LL;
+    uint64_t key = 0;
+    while (throttle.owner(key) != 1) {
+        ++key;
+    }
+
+    size_t answered = 0;
+    auto count = [&](uint64_t, int64_t wait) { answered += wait == 0; };
+    for (uint64_t cookie = 0; cookie < 20; ++cookie) {
+        throttle.shard(0).submit(key, cookie);
+    }
+    REQUIRE(throttle.shard(0).flush() == 16);
+    for (int round = 0; round < 20 && answered < 20; ++round) {
+        throttle.shard(0).poll(now, count);
+        throttle.shard(1).poll(now, count);
+    }
+    REQUIRE(answered == 20);
+    REQUIRE(throttle.shard(0).pending() == 0);
+}
+
+TEST_CASE("ShardedThrottle - Idle Keys Make Room", "[sharded][eviction]") {
+    ShardedThrottle throttle(10, 1, 8);
+    int64_t now = 1000000000000LL;
+    ShardedThrottle::Shard &shard = throttle.shard(0);
+
+    for (uint64_t key = 0; key < 8; ++key) {
+        REQUIRE(shard.update_(key, now) == 0);
+    }
+    REQUIRE_THROWS_AS(shard.update_(8, now), std::length_error);
+    // One interval later every key has drained and the table compacts on the next insert
+    now += 100000000LL;
+    REQUIRE(shard.update_(8, now) == 0);
+    REQUIRE(shard.size() == 1);
+}
+
+TEST_CASE("ShardedThrottle - Thread Per Shard Never Over-Admits", "[sharded][multithread]") {
+    const uint32_t tps_limit = 25;
+    const size_t num_shards = 4;
+    const uint64_t num_keys = 16;
+    const int requests_per_thread = 2000;
+    ShardedThrottle throttle(tps_limit, num_shards, 64, 256);
+    const int64_t now = 1000000000000LL;
+    std::atomic<int> allowed[num_keys] = {};
+    std::atomic<size_t> finished{0};
+    std::vector<std::thread> threads;
+
+    for (size_t s = 0; s < num_shards; ++s) {
+        threads.emplace_back([&, s]() {
+            ShardedThrottle::Shard &shard = throttle.shard(s);
+            auto on_reply = [&](uint64_t cookie, int64_t wait) {
+                if (wait == 0) {
+                    allowed[cookie]++;
+                }
+            };
+            for (int j = 0; j < requests_per_thread; ++j) {
+                uint64_t key = (j * 7 + s) % num_keys;
+                shard.submit(key, key);
+                if (j % 32 == 0) {
+                    shard.poll(now, on_reply);
+                }
+            }
+            // Keep serving peers until every shard has all of its answers
+            bool done = false;
+            while (finished.load() < num_shards) {
+                shard.poll(now, on_reply);
+                if (!done && shard.pending() == 0) {
+                    done = true;
+                    finished++;
+                }
+                std::this_thread::yield();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (auto &count : allowed) {
+        REQUIRE(count.load() == static_cast<int>(tps_limit));
+    }
+}
+
+TEST_CASE("ShardedThrottle - Forwarding Benchmark", "[.benchmark][sharded]") {
+    const size_t num_shards = 2;
+    const size_t num_requests = 4000000;
+    ShardedThrottle throttle(1000000, num_shards, 1 << 16, 4096);
+    std::atomic<size_t> finished{0};
+    std::atomic<size_t> answered{0};
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t s = 0; s < num_shards; ++s) {
+        threads.emplace_back([&, s]() {
+            ShardedThrottle::Shard &shard = throttle.shard(s);
+            std::mt19937_64 gen(s);
+            size_t replies = 0;
+            auto on_reply = [&](uint64_t, int64_t) { replies++; };
+            int64_t now = CompactThrottle::now_();
+            for (size_t i = 0; i < num_requests / num_shards; ++i) {
+                shard.submit(gen() % 50000, i);
+                if (i % 256 == 255) {
+                    now = CompactThrottle::now_();
+                    shard.poll(now, on_reply);
+                }
+            }
+            bool done = false;
+            while (finished.load() < num_shards) {
+                shard.poll(CompactThrottle::now_(), on_reply);
+                if (!done && shard.pending() == 0) {
+                    done = true;
+                    finished++;
+                }
+            }
+            answered += replies;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << "Sharded decisions: " << answered.load() << " in " << ns / 1000000 << "ms ("
+              << (double)ns / num_requests << " ns each)" << std::endl;
+    REQUIRE(answered.load() == num_requests);
+}
@@ -0,0 +1,223 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <random>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "SharedThrottle.hxx"
+
+static std::string segment_name(const char *test)
+{
+    return "/throttle-test-" + std::string(test) + "-" + std::to_string(::getpid());
+}
+
+TEST_CASE("SharedThrottle - Attached Handles Share One Quota", "[shared][basic]") {
+    std::string name = segment_name("basic");
+    SharedThrottle::unlink(name);
+    const int64_t now = 1000000000000LL;
+
+    SharedThrottle first(name, 4);
+    SharedThrottle second(name, 4);
+    REQUIRE(first.created());
+    REQUIRE(!second.created());
+
+    REQUIRE(first.update_(now) == 0);
+    REQUIRE(second.update_(now) == 0);
+    REQUIRE(first.update_(now) == 0);
+    REQUIRE(second.update_(now) == 0);
+    REQUIRE(first.update_(now) > 0);
+    REQUIRE(second.check_(now) > 0);
+
+    REQUIRE(SharedThrottle::unlink(name));
+    // The mapping stays usable after the name is gone
+    REQUIRE(first.check_(now + 1000000000LL) == 0);
+}
+
+TEST_CASE("SharedThrottle - Exception Handling", "[shared][exception]") {
+    std::string name = segment_name("exception");
+    SharedThrottle::unlink(name);
+
+    REQUIRE_THROWS_AS(SharedThrottle("no-slash", 10), std::invalid_argument);
+    REQUIRE_THROWS_AS(SharedThrottle("/a/b", 10), std::invalid_argument);
+    REQUIRE_THROWS_AS(SharedThrottle(name, 0), std::invalid_argument);
+
+    SharedThrottle owner(name, 10);
+    REQUIRE_THROWS_AS(SharedThrottle(name, 20), std::invalid_argument);
+    REQUIRE(SharedThrottle::unlink(name));
+    REQUIRE(!SharedThrottle::unlink(name));
+}
+
+TEST_CASE("SharedThrottle - A Rate Change Applies To Every Handle", "[shared][rate]") {
+    std::string name = segment_name("rate");
+    SharedThrottle::unlink(name);
+    const int64_t now = 1000000000000LL;
+
+    SharedThrottle first(name, 2);
+    SharedThrottle second(name, 2);
+    REQUIRE(first.update_(now) == 0);
+    REQUIRE(second.update_(now) == 0);
+    REQUIRE(first.update_(now) > 0);
+    REQUIRE(first.attempted() == 3);
+    REQUIRE(second.rejected() == 1);
+
+    // A full second at the new rate admits its ten through either handle
+    second.set_tps(10);
+    REQUIRE(first.rate().interval_ == 100000000LL);
+    REQUIRE(first.rate().window_ == 1000000000LL);
+    int admitted = 0;
+    for (int i = 0; i < 20; ++i) {
+        admitted += (i % 2 ? first : second).update_(now + 1000000000LL) == 0;
+    }
+    REQUIRE(admitted == 10);
+    REQUIRE(first.attempted() == 23);
+    REQUIRE(first.rejected() == 11);
+
+    // The creation rate still decides who may attach
+    REQUIRE_THROWS_AS(SharedThrottle(name, 10), std::invalid_argument);
+    SharedThrottle third(name, 2);
+    REQUIRE(third.rate().interval_ == 100000000LL);
+
+    REQUIRE_THROWS_AS(first.set_tps(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(first.set_rate(CompactThrottle::Rate::per_duration(300000000, 1000000000LL)),
+                      std::invalid_argument);
+    REQUIRE(first.rate().interval_ == 100000000LL);
+    REQUIRE(SharedThrottle::unlink(name));
+}
+
+TEST_CASE("SharedThrottle - Forked Workers Never Over-Admit", "[shared][multiprocess]") {
+    const uint32_t tps_limit = 50;
+    const int num_workers = 8;
+    std::string name = segment_name("fork");
+    SharedThrottle::unlink(name);
+    const int64_t now = 1000000000000LL;
+
+    // Workers race to create the segment themselves; exactly one of them initializes it
+    std::vector<pid_t> workers;
+    for (int i = 0; i < num_workers; ++i) {
+        pid_t pid = ::fork();
+        REQUIRE(pid >= 0);
+        if (pid == 0) {
+            int admitted = 0;
+            try {
+                SharedThrottle throttle(name, tps_limit);
+                for (int j = 0; j < 100; ++j) {
+                    admitted += throttle.update_(now) == 0;
+                }
+            } catch (...) {
+                ::_exit(255);
+            }
+            ::_exit(admitted);
+        }
+        workers.push_back(pid);
+    }
+
+    int total = 0;
+    for (pid_t pid : workers) {
+        int status = 0;
+        REQUIRE(::waitpid(pid, &status, 0) == pid);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) != 255);
+        total += WEXITSTATUS(status);
+    }
+    REQUIRE(total == static_cast<int>(tps_limit));
+
+    SharedThrottle parent(name, tps_limit);
+    REQUIRE(!parent.created());
+    REQUIRE(parent.check_(now) > 0);
+    REQUIRE(SharedThrottle::unlink(name));
+}
+
+TEST_CASE("SharedThrottle - Dead Initializer Is Taken Over", "[shared][crash]") {
+    std::string name = segment_name("takeover");
+    SharedThrottle::unlink(name);
+    const int64_t now = 1000000000000LL;
+
+    // A worker that claimed initialization (its pid in the first word) and was killed before publishing
+    pid_t pid = ::fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        uint64_t self = static_cast<uint64_t>(::getpid());
+        ::write(fd, &self, sizeof(self));
+        ::raise(SIGKILL);
+    }
+    int status = 0;
+    REQUIRE(::waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFSIGNALED(status));
+
+    SharedThrottle survivor(name, 2);
+    REQUIRE(survivor.created());
+    REQUIRE(survivor.update_(now) == 0);
+    REQUIRE(survivor.update_(now) == 0);
+    REQUIRE(survivor.update_(now) > 0);
+    REQUIRE(SharedThrottle::unlink(name));
+}
+
+TEST_CASE("SharedThrottle - SIGKILLed Workers Never Lose Or Exceed Quota", "[shared][crash][multiprocess]") {
+    const uint32_t tps_limit = 1000000;
+    const int num_workers = 4;
+    const int rounds = 25;
+    std::string name = segment_name("crash");
+    SharedThrottle::unlink(name);
+    const int64_t now = 1000000000000LL;
+    const auto rate = CompactThrottle::Rate::per_second(tps_limit);
+
+    // Workers count their admissions here after each one commits; a kill can only lose the last count
+    auto *counts = static_cast<std::atomic<uint64_t> *>(
+        ::mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    REQUIRE(counts != MAP_FAILED);
+    std::mt19937 gen(11);
+    int kills = 0;
+
+    for (int round = 0; round < rounds; ++round) {
+        std::vector<pid_t> workers;
+        for (int i = 0; i < num_workers; ++i) {
+            pid_t pid = ::fork();
+            REQUIRE(pid >= 0);
+            if (pid == 0) {
+                SharedThrottle throttle(name, tps_limit);
+                for (;;) {
+                    if (throttle.update_(now) == 0) {
+                        counts[0].fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+            workers.push_back(pid);
+        }
+        // Kill in the middle of initialization on the first round, mid-decision on later ones
+        std::this_thread::sleep_for(std::chrono::microseconds(round == 0 ? 50 : gen() % 3000));
+        for (pid_t pid : workers) {
+            ::kill(pid, SIGKILL);
+            ++kills;
+        }
+        for (pid_t pid : workers) {
+            int status = 0;
+            REQUIRE(::waitpid(pid, &status, 0) == pid);
+        }
+    }
+
+    SharedThrottle survivor(name, tps_limit);
+    // All workers used the same now, so the TAT encodes exactly how many requests were admitted
+    uint64_t committed = survivor.tat() > now ? static_cast<uint64_t>((survivor.tat() - now) / rate.interval_) : 0;
+    uint64_t counted = counts[0].load();
+    INFO("committed " << committed << ", counted " << counted << ", kills " << kills);
+    REQUIRE(committed <= tps_limit);
+    REQUIRE(counted <= committed);
+    REQUIRE(committed - counted <= static_cast<uint64_t>(kills));
+
+    // Quota is only ever spent, never lost: a window later the full burst is available again
+    int64_t later = now + rate.window_;
+    uint32_t admitted = 0;
+    while (admitted <= tps_limit && survivor.update_(later) == 0) {
+        ++admitted;
+    }
+    REQUIRE(admitted == tps_limit);
+
+    ::munmap(counts, 4096);
+    REQUIRE(SharedThrottle::unlink(name));
+}
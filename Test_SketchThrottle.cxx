@@ -0,0 +1,130 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include "SketchThrottle.hxx"
+
+TEST_CASE("SketchThrottle - Single Key Basic Functionality", "[sketch][basic]") {
+    SketchThrottle throttle(5);
+    const int64_t now = 1000000000000LL;
+
+    for (int i = 0; i < 5; ++i) {
+        REQUIRE(throttle.update_(1, now) == 0);
+    }
+    REQUIRE(throttle.update_(1, now) > 0);
+    REQUIRE(throttle.check_(1, now) > 0);
+    REQUIRE(throttle.check_(2, now) == 0);
+    REQUIRE(throttle.estimate(1, now) == 5);
+
+    // A full second later the old sub-windows have rotated out
+    REQUIRE(throttle.update_(1, now + 1200000000LL) == 0);
+    REQUIRE(throttle.estimate(1, now + 1200000000LL) == 1);
+}
+
+TEST_CASE("SketchThrottle - Never Exceeds Limit In Any Second", "[sketch][timing]") {
+    const uint32_t tps_limit = 20;
+    SketchThrottle throttle(tps_limit, 64, 2);
+    const int64_t start = 1000000000000LL;
+    const int64_t step = 5000000LL;  // 5ms
+
+    std::vector<int64_t> admitted;
+    for (int64_t now = start; now < start + 5000000000LL; now += step) {
+        // Background keys collide in such a narrow sketch and can only make it stricter
+        throttle.update_(static_cast<uint64_t>(now / step) % 1000 + 100, now);
+        if (throttle.update_(1, now) == 0) {
+            admitted.push_back(now);
+        }
+    }
+
+    REQUIRE(!admitted.empty());
+    for (size_t i = 0; i + tps_limit < admitted.size(); ++i) {
+        REQUIRE(admitted[i + tps_limit] - admitted[i] >= 1000000000LL);
+    }
+}
+
+TEST_CASE("SketchThrottle - A Second From A Sub-Window's Last Nanosecond", "[sketch][timing]") {
+    const uint32_t tps_limit = 10;
+    const int64_t now = 1000000000000LL;
+
+    // A rejection waits exactly until the next sub-window starts
+    SketchThrottle probe(tps_limit);
+    for (uint32_t i = 0; i < tps_limit; ++i) {
+        REQUIRE(probe.update_(1, now) == 0);
+    }
+    int64_t wait = probe.update_(1, now);
+    REQUIRE(wait > 0);
+    const int64_t last = now + wait - 1;
+
+    SketchThrottle throttle(tps_limit);
+    for (uint32_t i = 0; i < tps_limit; ++i) {
+        REQUIRE(throttle.update_(1, last) == 0);
+    }
+    REQUIRE(throttle.update_(1, last + 1000000000LL - 1) > 0);
+    REQUIRE(throttle.update_(1, last + 1000000000LL + wait) == 0);
+}
+
+TEST_CASE("SketchThrottle - Concurrent Updates Never Over-Admit", "[sketch][multithread]") {
+    const uint32_t tps_limit = 50;
+    const int num_threads = 8;
+    SketchThrottle throttle(tps_limit, 16, 3);
+    const int64_t now = 1000000000000LL;
+    std::atomic<int> allowed_count{0};
+    std::atomic<bool> start_flag{false};
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&, i]() {
+            while (!start_flag.load()) {
+                std::this_thread::yield();
+            }
+            for (int j = 0; j < 100; ++j) {
+                if (throttle.update_(7, now) == 0) {
+                    allowed_count++;
+                }
+                throttle.update_(1000 + i * 100 + j, now);
+            }
+        });
+    }
+
+    start_flag.store(true);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    REQUIRE(allowed_count.load() <= static_cast<int>(tps_limit));
+    REQUIRE(allowed_count.load() > 0);
+}
+
+TEST_CASE("SketchThrottle - Exception Handling", "[sketch][exception]") {
+    REQUIRE_THROWS_AS(SketchThrottle(0), std::invalid_argument);
+    REQUIRE_THROWS_AS(SketchThrottle(10, 1000), std::invalid_argument);
+    REQUIRE_THROWS_AS(SketchThrottle(10, 1024, 0), std::invalid_argument);
+    REQUIRE_THROWS_AS(SketchThrottle(10, 1024, 9), std::invalid_argument);
+}
+
+TEST_CASE("SketchThrottle - Distinct Key Flood Benchmark", "[.benchmark][sketch]") {
+    const uint32_t tps_limit = 100;
+    const size_t num_requests = 10000000;
+    SketchThrottle throttle(tps_limit, 8192, 4);
+    std::mt19937_64 gen(3);
+    const int64_t now = CompactThrottle::now_();
+
+    // Every request comes from a new source, arriving at 200k/s. Each cell then sees about
+    // 25 unrelated requests per second, well below the limit, so false rejections stay rare.
+    size_t false_rejects = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < num_requests; ++i) {
+        int64_t t = now + static_cast<int64_t>(i) * 5000;
+        false_rejects += throttle.update_(gen(), t) > 0;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    std::cout << "Sketch memory: " << throttle.memory_usage() / 1024 << " KB" << std::endl;
+    std::cout << "Distinct keys: " << num_requests << ", falsely rejected: " << false_rejects << std::endl;
+    std::cout << "Throughput: " << (double)ns / num_requests << " ns per update_()" << std::endl;
+    REQUIRE(throttle.memory_usage() < 4 * 1024 * 1024);
+}
@@ -0,0 +1,95 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include "ThrottleCrontol.hxx"
+
+static uint64_t decisions(const ThrottleControl::Contention &contention)
+{
+    uint64_t total = 0;
+    for (uint64_t count : contention.retries_) {
+        total += count;
+    }
+    return total;
+}
+
+TEST_CASE("ThrottleContention - Uncontended Decisions Need No Retries", "[throttle][contention]") {
+    ThrottleControl throttle(10, false, true);
+    ThrottleControl uncounted(10);
+    for (int i = 0; i < 15; ++i) {
+        throttle.update_();
+        uncounted.update_();
+    }
+    REQUIRE(decisions(uncounted.contention()) == 0);
+
+    ThrottleControl::Contention contention = throttle.contention();
+    REQUIRE(contention.retries_[0] == 15);
+    REQUIRE(decisions(contention) == 15);
+    REQUIRE(contention.index_failures_ == 0);
+    REQUIRE(contention.timestamp_failures_ == 0);
+    REQUIRE(contention.capped_calls_ == 0);
+}
+
+TEST_CASE("ThrottleContention - Every Decision Is Accounted For", "[throttle][contention][multithread]") {
+    const int num_threads = 8;
+    const int requests_per_thread = 20000;
+    ThrottleControl throttle(1000000, false, true);
+    std::atomic<bool> start{false};
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            while (!start.load()) {
+                std::this_thread::yield();
+            }
+            for (int j = 0; j < requests_per_thread; ++j) {
+                throttle.update_();
+            }
+        });
+    }
+    start = true;
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    // Each call ends in exactly one retry bucket or at the cap, and every retry was a lost CAS
+    ThrottleControl::Contention contention = throttle.contention();
+    uint64_t retried = 0;
+    for (size_t i = 1; i < ThrottleControl::Contention::kRetryBuckets; ++i) {
+        retried += contention.retries_[i] * i;
+    }
+    INFO("index failures " << contention.index_failures_ << ", retried " << retried);
+    uint64_t calls = decisions(contention) + contention.capped_calls_;
+    REQUIRE(calls == static_cast<uint64_t>(num_threads * requests_per_thread));
+    REQUIRE(contention.index_failures_ + contention.timestamp_failures_ >= retried);
+}
+
+TEST_CASE("ThrottleContention - Contention Report Benchmark", "[.benchmark][throttle][contention]") {
+    const int tps_limit = 1000000;
+    const auto duration = std::chrono::seconds(1);
+    for (int num_threads : {1, 2, 4, 8, 16}) {
+        ThrottleControl throttle(tps_limit, false, true);
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&]() {
+                while (std::chrono::steady_clock::now() - start < duration) {
+                    throttle.update_();
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        ThrottleControl::Contention contention = throttle.contention();
+        std::cout << num_threads << " threads: " << decisions(contention) << " decisions, "
+                  << contention.index_failures_ << " index CAS failures, " << contention.timestamp_failures_
+                  << " timestamp CAS failures, " << contention.capped_calls_ << " capped; retries:";
+        for (uint64_t count : contention.retries_) {
+            std::cout << " " << count;
+        }
+        std::cout << std::endl;
+    }
+}
@@ -3,6 +3,7 @@
 #include <vector>
 #include <atomic>
 #include <chrono>
+#include <iostream>
 #include <random>
 #include "../base/hxx/throttle.hpp"
 
@@ -449,3 +450,172 @@ TEST_CASE("ThrottleControl - Mixed API Usage", "[throttle][mixed]") {
     }
 
 }
+
+TEST_CASE("ThrottleControl - Stats Count Decisions And Waits", "[throttle][stats]") {
+    ThrottleControl plain(5);
+    REQUIRE(!plain.stats_enabled());
+    plain.update_();
+    REQUIRE(plain.stats().allowed_ == 0);
+
+    ThrottleControl throttle(5, true);
+    REQUIRE(throttle.stats_enabled());
+    for (int i = 0; i < 8; ++i) {
+        throttle.update_();
+    }
+    ThrottleControl::Stats stats = throttle.stats();
+    REQUIRE(stats.allowed_ == 5);
+    REQUIRE(stats.rejected_ == 3);
+    REQUIRE(stats.blocking_calls_ == 0);
+
+    // A blocking call waits out the rest of the window and is counted once
+    throttle.update();
+    stats = throttle.stats();
+    REQUIRE(stats.allowed_ == 6);
+    REQUIRE(stats.rejected_ == 3);
+    REQUIRE(stats.blocking_calls_ == 1);
+    REQUIRE(stats.max_wait_ns_ > 500000000ULL);
+    REQUIRE(stats.total_wait_ns_ == stats.max_wait_ns_);
+}
+
+TEST_CASE("ThrottleControl - Stats Aggregate Across Threads", "[throttle][stats][multithread]") {
+    const int tps_limit = 100;
+    const int num_threads = 8;
+    const int requests_per_thread = 1000;
+    ThrottleControl throttle(tps_limit, true);
+    std::atomic<int> allowed_count{0};
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&throttle, &allowed_count]() {
+            for (int j = 0; j < requests_per_thread; ++j) {
+                if (throttle.update_() == 0) {
+                    allowed_count++;
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    ThrottleControl::Stats stats = throttle.stats();
+    REQUIRE(stats.allowed_ == static_cast<uint64_t>(allowed_count.load()));
+    REQUIRE(stats.allowed_ + stats.rejected_ == static_cast<uint64_t>(num_threads * requests_per_thread));
+}
+
+TEST_CASE("ThrottleControl - Stats Overhead Benchmark", "[.benchmark][throttle][stats]") {
+    const int num_threads = 4;
+    const int num_operations = 1000000;
+    for (bool enabled : {false, true}) {
+        ThrottleControl throttle(1000000, enabled);
+        std::vector<std::thread> threads;
+        auto start_time = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < num_threads; ++i) {
+            threads.emplace_back([&throttle]() {
+                for (int j = 0; j < num_operations; ++j) {
+                    throttle.update_();
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::high_resolution_clock::now() - start_time);
+        std::cout << (enabled ? "With stats: " : "Without stats: ")
+                  << (double)duration.count() / (num_threads * num_operations) << " ns per update_()" << std::endl;
+    }
+}
+
+TEST_CASE("ThrottleControl - Wait Histograms", "[throttle][stats][histogram]") {
+    ThrottleControl throttle(2, true);
+    REQUIRE(ThrottleControl(2).wait_histogram().count() == 0);
+
+    throttle.update_();
+    throttle.update_();
+    REQUIRE(throttle.wait_histogram().count() == 0);
+    throttle.update_();
+    throttle.check_();
+    WaitHistogram::Snapshot waits = throttle.wait_histogram(true);
+    REQUIRE(waits.count() == 2);
+    REQUIRE(waits.percentile(0.5) > 900000000ULL);
+    REQUIRE(throttle.wait_histogram().count() == 0);
+
+    // Blocking calls record how long they actually blocked
+    throttle.check_and_wait();
+    WaitHistogram::Snapshot blocked = throttle.blocked_histogram();
+    REQUIRE(blocked.count() == 1);
+    REQUIRE(blocked.max() > 900000000ULL);
+    REQUIRE(throttle.stats().max_wait_ns_ <= blocked.max());
+}
+
+TEST_CASE("ThrottleControl - State Summarizes The Ring", "[throttle][state]") {
+    ThrottleControl throttle(4);
+    ThrottleControl::State state = throttle.state();
+    REQUIRE(state.consistent_);
+    REQUIRE(state.capacity_ == 4);
+    REQUIRE(state.occupancy_ == 0);
+    REQUIRE(state.next_free_ == state.now_);
+
+    throttle.update_();
+    throttle.update_();
+    throttle.update_();
+    state = throttle.state();
+    REQUIRE(state.index_ == 3);
+    REQUIRE(state.occupancy_ == 3);
+    REQUIRE(state.oldest_ == 0);
+    REQUIRE(state.newest_ > 0);
+    REQUIRE(state.next_free_ == state.now_);
+
+    throttle.update_();
+    state = throttle.state();
+    REQUIRE(state.occupancy_ == 4);
+    REQUIRE(state.oldest_ > 0);
+    REQUIRE(state.oldest_ <= state.newest_);
+    REQUIRE(state.next_free_ == state.oldest_ + 1000000000LL);
+
+    // A second later the same ring is empty again
+    state = throttle.state(state.newest_ + 1000000001LL);
+    REQUIRE(state.occupancy_ == 0);
+    REQUIRE(state.next_free_ == state.now_);
+
+    int visited = 0;
+    int64_t previous = 0;
+    throttle.visit_timestamps([&](int64_t timestamp) {
+        REQUIRE(timestamp >= previous);
+        previous = timestamp;
+        ++visited;
+    });
+    REQUIRE(visited == 4);
+
+    char buffer[256];
+    size_t length = throttle.format(buffer, sizeof(buffer));
+    REQUIRE(std::string(buffer, length).rfind("capacity=4 index=0 occupancy=4", 0) == 0);
+    REQUIRE(throttle.toString() == std::string(buffer, length));
+    // Like snprintf, a null buffer only measures
+    REQUIRE(throttle.format(nullptr, 0) == length);
+}
+
+TEST_CASE("ThrottleControl - State Benchmark", "[.benchmark][throttle][state]") {
+    ThrottleControl throttle(100000);
+    for (int i = 0; i < 60000; ++i) {
+        throttle.update_();
+    }
+
+    const int num_operations = 100000;
+    auto start_time = std::chrono::high_resolution_clock::now();
+    uint64_t occupancy = 0;
+    for (int i = 0; i < num_operations; ++i) {
+        occupancy += throttle.state().occupancy_;
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "state() at tps=100000: " << (double)duration.count() / num_operations << " ns (occupancy "
+              << occupancy / num_operations << ")" << std::endl;
+
+    start_time = std::chrono::high_resolution_clock::now();
+    std::string text = throttle.toString();
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "toString(): " << duration.count() << " ns, " << text.size() << " bytes" << std::endl;
+}
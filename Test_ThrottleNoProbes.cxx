@@ -0,0 +1,28 @@
+#define THROTTLE_NO_PROBES
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include "ThrottleCrontol.hxx"
+#include "KeyedThrottle.hxx"
+
+TEST_CASE("ThrottleNoProbes - Probes Compile Away", "[probes]") {
+#ifdef THROTTLE_HAS_PROBES
+    FAIL("THROTTLE_NO_PROBES still built probes");
+#endif
+
+    // Arguments of a disabled probe are not evaluated
+    int evaluated = 0;
+    THROTTLE_PROBE(admit, &evaluated, ++evaluated, ++evaluated);
+    THROTTLE_PROBE_DECISION(&evaluated, ++evaluated, ++evaluated);
+    REQUIRE(evaluated == 0);
+
+    const int64_t now = 1000000000000LL;
+    ThrottleControl control(2);
+    REQUIRE(control.update_() == 0);
+    control.update();
+    REQUIRE(control.update_() > 0);
+
+    KeyedThrottle keys(1, 64);
+    REQUIRE(keys.update_(7, now) == 0);
+    REQUIRE(keys.update_(7, now) > 0);
+    keys.update(8);
+}
@@ -0,0 +1,29 @@
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include "ThrottleCrontol.hxx"
+#include "KeyedThrottle.hxx"
+
+TEST_CASE("ThrottleProbes - Real Probes Whenever <sys/sdt.h> Exists", "[probes]") {
+#if defined(__has_include) && !defined(THROTTLE_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+    REQUIRE(THROTTLE_HAS_PROBES == 1);
+#else
+#ifdef THROTTLE_HAS_PROBES
+    FAIL("THROTTLE_HAS_PROBES without <sys/sdt.h>");
+#endif
+#endif
+#endif
+
+    // Every probe site compiles and runs, whichever way the probes were built
+    const int64_t now = 1000000000000LL;
+    ThrottleControl control(2);
+    REQUIRE(control.update_() == 0);
+    control.update();
+    REQUIRE(control.update_() > 0);
+
+    KeyedThrottle keys(1, 64);
+    REQUIRE(keys.update_(7, now) == 0);
+    REQUIRE(keys.update_(7, now) > 0);
+    REQUIRE(keys.update_("user", now) == 0);
+    keys.update(8);
+}
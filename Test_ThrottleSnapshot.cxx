@@ -0,0 +1,147 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include "ThrottleSnapshot.hxx"
+
+static std::string snapshot_path(const char *test)
+{
+    return "/tmp/throttle-snapshot-" + std::string(test) + "-" + std::to_string(::getpid());
+}
+
+TEST_CASE("ThrottleSnapshot - Sliding Log Survives Restart", "[snapshot][control]") {
+    std::string path = snapshot_path("control");
+    {
+        ThrottleControl before(3);
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(before.update_() == 0);
+        }
+        REQUIRE(before.update_() > 0);
+        ThrottleSnapshot::save(path, before);
+    }
+
+    // A fresh ring would admit a full burst; the restored one is still full
+    ThrottleControl after(3);
+    ThrottleSnapshot::load(path, after);
+    REQUIRE(after.update_() > 0);
+    REQUIRE(!after.check());
+
+    ThrottleControl wrong_size(4);
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, wrong_size), std::invalid_argument);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("ThrottleSnapshot - Compact And Keyed State Round Trip", "[snapshot][keyed]") {
+    std::string path = snapshot_path("keyed");
+    const int64_t now = 1000000000000LL;
+
+    CompactThrottle single;
+    auto rate = CompactThrottle::Rate::per_second(2);
+    single.update_(rate, now);
+    single.update_(rate, now);
+    ThrottleSnapshot::save(path, single);
+    CompactThrottle restored_single;
+    ThrottleSnapshot::load(path, restored_single);
+    REQUIRE(restored_single.tat() == single.tat());
+    REQUIRE(restored_single.check_(rate, now) > 0);
+
+    KeyedThrottle keys(2, 1024);
+    for (uint64_t key = 0; key < 100; ++key) {
+        keys.update_(key, now, key % 2 == 0 ? 2 : 1);
+    }
+    // String keys are saved with their bytes, including ones that do not fill a whole word
+    keys.update_(std::string_view("token"), now, 2);
+    keys.update_(std::string_view("/api/v1/orders"), now);
+    keys.update_(std::string_view(""), now, 2);
+    REQUIRE(ThrottleSnapshot::save(path, keys, now) == 103);
+
+    KeyedThrottle restored(2, 1024);
+    REQUIRE(restored.update_(0, now) == 0);
+    REQUIRE(ThrottleSnapshot::load(path, restored, now) == 103);
+    REQUIRE(restored.update_(std::string_view("token"), now) > 0);
+    REQUIRE(restored.update_(std::string_view(""), now) > 0);
+    REQUIRE(restored.update_(std::string_view("/api/v1/orders"), now) == 0);
+    REQUIRE(restored.update_(std::string_view("/api/v1/orders"), now) > 0);
+    REQUIRE(restored.update_(std::string_view("/api/v1/other"), now) == 0);
+    for (uint64_t key = 0; key < 100; ++key) {
+        if (key % 2 == 0) {
+            REQUIRE(restored.update_(key, now) > 0);
+        } else {
+            REQUIRE(restored.update_(key, now) == 0);
+            REQUIRE(restored.update_(key, now) > 0);
+        }
+    }
+    REQUIRE(restored.size() == 104);
+
+    // TATs earned under one rate are meaningless under another
+    KeyedThrottle faster(4, 1024);
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, faster, now), std::invalid_argument);
+    REQUIRE(faster.size() == 0);
+
+    // Keys that went idle since the save are not restored
+    KeyedThrottle later(2, 1024);
+    REQUIRE(ThrottleSnapshot::load(path, later, now + 2000000000LL) == 0);
+    REQUIRE(later.size() == 0);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("ThrottleSnapshot - Damaged Files Are Rejected", "[snapshot][validation]") {
+    std::string path = snapshot_path("damaged");
+    const int64_t now = 1000000000000LL;
+    KeyedThrottle keys(10, 64);
+    for (uint64_t key = 0; key < 10; ++key) {
+        keys.update_(key, now);
+    }
+    ThrottleSnapshot::save(path, keys, now);
+
+    KeyedThrottle target(10, 64);
+    CompactThrottle single;
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, single), std::runtime_error);
+
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(64 + 8 * 5);
+        file.put('\x7f');
+    }
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, target, now), std::runtime_error);
+
+    REQUIRE(::truncate(path.c_str(), 64 + 8 * 3) == 0);
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, target, now), std::runtime_error);
+    REQUIRE(::truncate(path.c_str(), 10) == 0);
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, target, now), std::runtime_error);
+    REQUIRE(target.size() == 0);
+
+    std::remove(path.c_str());
+    REQUIRE_THROWS_AS(ThrottleSnapshot::load(path, target, now), std::system_error);
+}
+
+TEST_CASE("ThrottleSnapshot - Million Key Benchmark", "[.benchmark][snapshot]") {
+    const size_t num_keys = 4000000;
+    std::string path = snapshot_path("benchmark");
+    KeyedThrottle keys(1000, num_keys * 2);
+    const int64_t now = CompactThrottle::now_();
+    for (uint64_t key = 0; key < num_keys; ++key) {
+        keys.update_(key, now);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    size_t saved = ThrottleSnapshot::save(path, keys, now);
+    auto middle = std::chrono::high_resolution_clock::now();
+    KeyedThrottle restored(1000, num_keys * 2);
+    size_t loaded = ThrottleSnapshot::load(path, restored, now);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cout << "Saved " << saved << " keys in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(middle - start).count() << "ms" << std::endl;
+    std::cout << "Loaded " << loaded << " keys in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - middle).count() << "ms" << std::endl;
+    REQUIRE(saved == num_keys);
+    REQUIRE(loaded == num_keys);
+    std::remove(path.c_str());
+}
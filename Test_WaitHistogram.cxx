@@ -0,0 +1,111 @@
+#include <catch2/catch_test_macros.hpp>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include "WaitHistogram.hxx"
+
+TEST_CASE("WaitHistogram - Buckets Keep Values Within 1/32", "[histogram][buckets]") {
+    REQUIRE(WaitHistogram::index_(0) == 0);
+    REQUIRE(WaitHistogram::index_(31) == 31);
+    REQUIRE(WaitHistogram::index_(UINT64_MAX) == WaitHistogram::kBuckets - 1);
+    REQUIRE(WaitHistogram::highest_(WaitHistogram::kBuckets - 1) == UINT64_MAX);
+
+    std::mt19937_64 gen(3);
+    for (int i = 0; i < 100000; ++i) {
+        uint64_t value = gen() >> (gen() % 64);
+        size_t index = WaitHistogram::index_(value);
+        INFO("value " << value);
+        REQUIRE(WaitHistogram::lowest_(index) <= value);
+        REQUIRE(value <= WaitHistogram::highest_(index));
+        REQUIRE(WaitHistogram::highest_(index) - WaitHistogram::lowest_(index) <= value / 32);
+    }
+    // Buckets tile the range with no gaps
+    for (size_t index = 1; index < WaitHistogram::kBuckets; ++index) {
+        REQUIRE(WaitHistogram::lowest_(index) == WaitHistogram::highest_(index - 1) + 1);
+    }
+}
+
+TEST_CASE("WaitHistogram - Percentiles", "[histogram][percentile]") {
+    WaitHistogram histogram;
+    REQUIRE(histogram.snapshot().percentile(0.5) == 0);
+
+    for (uint64_t ns = 1; ns <= 1000; ++ns) {
+        histogram.record(ns * 1000);
+    }
+    WaitHistogram::Snapshot snapshot = histogram.snapshot();
+    REQUIRE(snapshot.count() == 1000);
+    uint64_t p50 = snapshot.percentile(0.5);
+    uint64_t p99 = snapshot.percentile(0.99);
+    REQUIRE(p50 >= 500000);
+    REQUIRE(p50 <= 500000 + 500000 / 32);
+    REQUIRE(p99 >= 990000);
+    REQUIRE(p99 <= 990000 + 990000 / 32);
+    REQUIRE(snapshot.max() >= 1000000);
+    REQUIRE(snapshot.mean() > 500500 * 0.97);
+    REQUIRE(snapshot.mean() < 500500 * 1.03);
+
+    WaitHistogram::Snapshot merged = snapshot;
+    merged.merge(snapshot);
+    REQUIRE(merged.count() == 2000);
+    REQUIRE(merged.percentile(0.5) == p50);
+}
+
+TEST_CASE("WaitHistogram - Reset Does Not Lose Concurrent Recordings", "[histogram][multithread]") {
+    const int num_threads = 4;
+    const int records = 200000;
+    WaitHistogram histogram;
+    std::atomic<bool> done{false};
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&histogram, i]() {
+            for (int j = 0; j < records; ++j) {
+                histogram.record(static_cast<uint64_t>(i * 1000 + j % 1000));
+            }
+        });
+    }
+    uint64_t drained = 0;
+    std::thread reader([&]() {
+        while (!done.load()) {
+            drained += histogram.snapshot(true).count();
+        }
+    });
+    for (auto &t : threads) {
+        t.join();
+    }
+    done = true;
+    reader.join();
+    drained += histogram.snapshot(true).count();
+
+    REQUIRE(drained == static_cast<uint64_t>(num_threads * records));
+    REQUIRE(histogram.snapshot().count() == 0);
+}
+
+TEST_CASE("WaitHistogram - Recording Benchmark", "[.benchmark][histogram]") {
+    const int num_operations = 10000000;
+    WaitHistogram histogram;
+    std::vector<uint64_t> values(4096);
+    std::mt19937_64 gen(5);
+    for (auto &value : values) {
+        value = gen() % 1000000000ULL;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < num_operations; ++i) {
+        histogram.record(values[i & 4095]);
+    }
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "record(): " << (double)duration.count() / num_operations << " ns" << std::endl;
+
+    start_time = std::chrono::high_resolution_clock::now();
+    WaitHistogram::Snapshot snapshot = histogram.snapshot();
+    uint64_t p99 = snapshot.percentile(0.99);
+    duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start_time);
+    std::cout << "snapshot() + percentile(): " << duration.count() << " ns (p99 " << p99 << ")" << std::endl;
+    REQUIRE(snapshot.count() == static_cast<uint64_t>(num_operations));
+}
@@ -1,14 +1,69 @@
+#pragma once
+
 #include <atomic>
+#include <cassert>
 #include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
+#include "DecisionTrace.hxx"
+#include "RateEstimator.hxx"
+#include "ThrottleProbes.hxx"
+#include "WaitHistogram.hxx"
+
 class ThrottleControl
 {
 public:
-    ThrottleControl(uint32_t tps) : buffer_size_(tps), duration_(1000000000LL), timestamps_(tps)
+    // Totals since construction; see stats().
+    struct Stats
+    {
+        uint64_t allowed_ = 0;         // update_() calls that admitted, plus blocking calls
+        uint64_t rejected_ = 0;        // update_() calls that returned a wait
+        uint64_t blocking_calls_ = 0;  // update() and check_and_wait() calls
+        uint64_t total_wait_ns_ = 0;   // time spent waiting inside blocking calls
+        uint64_t max_wait_ns_ = 0;
+    };
+
+    // How update_() decisions contended; all zero unless constructed with contention counting.
+    struct Contention
+    {
+        static constexpr size_t kRetryBuckets = 8;
+
+        uint64_t index_failures_ = 0;           // lost compare_exchange on index_
+        uint64_t timestamp_failures_ = 0;       // lost compare_exchange on a timestamp after winning index_
+        uint64_t capped_calls_ = 0;             // gave up after buffer_size_ attempts
+        uint64_t retries_[kRetryBuckets] = {};  // decisions by retries needed; the last bucket is "7 or more"
+    };
+
+    // Summary of the ring at one instant; see state().
+    struct State
+    {
+        int64_t now_ = 0;
+        uint32_t capacity_ = 0;    // tps, the number of slots
+        uint32_t index_ = 0;       // next slot to be taken; it holds the oldest timestamp
+        uint32_t occupancy_ = 0;   // admissions within the last second
+        int64_t oldest_ = 0;       // 0 while the ring has not wrapped
+        int64_t newest_ = 0;
+        int64_t next_free_ = 0;    // when update_() will next succeed; now_ if it would already
+        bool consistent_ = false;  // false if updates kept moving the ring while it was read
+    };
+
+    // With stats enabled every decision also bumps a counter in a per-thread
+    // stripe, so threads do not contend on one cache line, and every wait
+    // goes into a histogram; without them the hot path pays a single
+    // predictable branch. Counting contention (see contention()) works the
+    // same way, with its own stripes.
+    ThrottleControl(uint32_t tps, bool stats = false, bool contention = false)
+        : buffer_size_(tps), duration_(1000000000LL), timestamps_(tps),
+          stripes_(stats ? new Stripe[kStripes] : nullptr), histograms_(stats ? new Histograms : nullptr),
+          contention_(contention ? new ContentionStripe[kStripes] : nullptr)
     {
         if (tps == 0) {
             throw std::invalid_argument("TPS must be positive");
@@ -24,74 +79,342 @@ public:
                           std::chrono::high_resolution_clock::now().time_since_epoch())
                           .count();
 
-        int current_index = index_.load(std::memory_order_acq_rel) % buffer_size_;
+        int current_index = index_.load(std::memory_order_acquire) % buffer_size_;
         int64_t expected = timestamps_[current_index].load(std::memory_order_acquire);
 
-        return now - expected > duration_ ? 0 : duration_ - (now - expected);
+        int64_t wait = now - expected > duration_ ? 0 : duration_ - (now - expected);
+        if (histograms_ && wait > 0) {
+            histograms_->waits_.record(static_cast<uint64_t>(wait));
+        }
+        return wait;
     }
 
     int64_t update_()
     {
-        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
-                          std::chrono::high_resolution_clock::now().time_since_epoch())
-                          .count();
-
-        for (int attempt = 0; attempt < buffer_size_; ++attempt) {
-            int current_index = index_.load(std::memory_order_acq_rel) % buffer_size_;
-
-            int64_t expected = timestamps_[current_index].load(std::memory_order_acquire);
-
-            if (now - expected > duration_) {
-                int32_t next_index = (current_index + 1) % buffer_size_;
-                if (index_.compare_exchange_weak(current_index, next_index, std::memory_order_acq_rel,
-                                                 std::memory_order_acquire)) {
-                    if (timestamps_[current_index].compare_exchange_weak(expected, now, std::memory_order_acq_rel,
-                                                                         std::memory_order_acquire)) {
-                        return 0;
-                    } else {
-                        assert(false && "Failed to update timestamp");
-                    }
-                }
-            } else {
-                return duration_ - (now - expected);
+        int64_t now;
+        int64_t wait = decide_(now);
+        THROTTLE_PROBE_DECISION(this, 0, wait);
+        trace_decision_(now, wait);
+        if (RateEstimator *rates = rates_.load(std::memory_order_relaxed)) {
+            rates->add(now, wait);
+        }
+        if (stripes_) {
+            Stripe &stripe = stripe_();
+            (wait == 0 ? stripe.allowed_ : stripe.rejected_).fetch_add(1, std::memory_order_relaxed);
+            if (wait > 0) {
+                histograms_->waits_.record(static_cast<uint64_t>(wait));
             }
         }
-
-        return duration_;
+        return wait;
     }
 
     bool check() { return check_() == 0; }
 
     void update()
     {
-        while (update_() > 0) {
-            std::this_thread::yield();
+        int64_t start = stripes_ ? now_() : 0;
+        int64_t now;
+        int64_t wait = decide_(now);
+        trace_decision_(now, wait);
+        if (wait > 0) {
+            THROTTLE_PROBE(block_begin, this, 0, wait);
+            // The retries get their own timestamp; the trace and the rates both date the call by its first decision
+            int64_t retried;
+            while (decide_(retried) > 0) {
+                std::this_thread::yield();
+            }
+            THROTTLE_PROBE(block_end, this, 0, wait);
+        }
+        if (RateEstimator *rates = rates_.load(std::memory_order_relaxed)) {
+            rates->add(now, 1, 1);
+        }
+        THROTTLE_PROBE(admit, this, 0, 0);
+        if (stripes_) {
+            record_wait_(now_() - start);
+            stripe_().allowed_.fetch_add(1, std::memory_order_relaxed);
         }
     }
 
     void check_and_wait()
     {
+        int64_t start = stripes_ ? now_() : 0;
         int64_t remain = check_();
         if (remain > 0) {
+            THROTTLE_PROBE(block_begin, this, 0, remain);
             std::this_thread::sleep_for(std::chrono::nanoseconds(remain));
+            THROTTLE_PROBE(block_end, this, 0, remain);
+        }
+        if (stripes_) {
+            record_wait_(remain > 0 ? now_() - start : 0);
         }
     }
 
-    std::string toString() const
+    bool stats_enabled() const { return stripes_ != nullptr; }
+
+    // Samples update_() decisions, and the first decision of each update(),
+    // into trace with key 0, dated by the now each decision was made against.
+    // trace must outlive this or be detached with nullptr first.
+    void set_trace(DecisionTrace *trace) { trace_.store(trace, std::memory_order_relaxed); }
+
+    // Feeds every update_() decision, and each update() as one admitted
+    // attempt, into rates. rates must outlive this or be detached first.
+    void set_rates(RateEstimator *rates) { rates_.store(rates, std::memory_order_relaxed); }
+
+    // Sums the stripes. Counters are read one by one while other threads
+    // keep deciding, so the result is a close estimate rather than an atomic
+    // cut. All zero when stats are disabled.
+    Stats stats() const
+    {
+        Stats stats;
+        if (!stripes_) {
+            return stats;
+        }
+        for (size_t i = 0; i < kStripes; ++i) {
+            const Stripe &stripe = stripes_[i];
+            stats.allowed_ += stripe.allowed_.load(std::memory_order_relaxed);
+            stats.rejected_ += stripe.rejected_.load(std::memory_order_relaxed);
+            stats.blocking_calls_ += stripe.blocking_calls_.load(std::memory_order_relaxed);
+            stats.total_wait_ns_ += stripe.total_wait_ns_.load(std::memory_order_relaxed);
+            uint64_t max = stripe.max_wait_ns_.load(std::memory_order_relaxed);
+            stats.max_wait_ns_ = max > stats.max_wait_ns_ ? max : stats.max_wait_ns_;
+        }
+        return stats;
+    }
+
+    // Non-zero waits returned by check_() and update_().
+    WaitHistogram::Snapshot wait_histogram(bool reset = false)
+    {
+        return histograms_ ? histograms_->waits_.snapshot(reset) : WaitHistogram::Snapshot();
+    }
+
+    // Time actually spent in update() and check_and_wait(), including calls that did not wait.
+    WaitHistogram::Snapshot blocked_histogram(bool reset = false)
+    {
+        return histograms_ ? histograms_->blocked_.snapshot(reset) : WaitHistogram::Snapshot();
+    }
+
+    Contention contention() const
     {
-        std::string result;
-        // current thread id
-        result += "Thread:" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
-        result += ",Index: " + std::to_string(index_.load(std::memory_order_acquire)) + ",data:";
-        for (const auto &ts : timestamps_) {
-            result += std::to_string(ts.load(std::memory_order_acquire)) + " ";
+        Contention contention;
+        for (size_t i = 0; contention_ && i < kStripes; ++i) {
+            const std::atomic<uint64_t> *counts = contention_[i].counts_;
+            contention.index_failures_ += counts[kIndexFailure].load(std::memory_order_relaxed);
+            contention.timestamp_failures_ += counts[kTimestampFailure].load(std::memory_order_relaxed);
+            contention.capped_calls_ += counts[kCapped].load(std::memory_order_relaxed);
+            for (size_t j = 0; j < Contention::kRetryBuckets; ++j) {
+                contention.retries_[j] += counts[kRetries + j].load(std::memory_order_relaxed);
+            }
         }
-        return result;
+        return contention;
+    }
+
+    State state() const { return state(now_()); }
+
+    // Slots are taken in ring order, so timestamps ascend from index_ and
+    // occupancy is a binary search: O(log tps), no allocation. The ring is
+    // read between two loads of index_ and retried if it moved.
+    State state(int64_t now) const
+    {
+        State state;
+        state.now_ = now;
+        state.capacity_ = buffer_size_;
+        for (int attempt = 0; attempt < kStateAttempts && !state.consistent_; ++attempt) {
+            int index = index_.load(std::memory_order_acquire);
+            uint32_t first = static_cast<uint32_t>(index) % buffer_size_;
+            int64_t oldest = timestamps_[first].load(std::memory_order_acquire);
+
+            // First position, counting from the oldest slot, whose timestamp is within the window
+            uint32_t low = 0, high = buffer_size_;
+            while (low < high) {
+                uint32_t middle = low + (high - low) / 2;
+                if (now - slot_(first, middle) > duration_) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            state.index_ = first;
+            state.oldest_ = oldest;
+            state.newest_ = slot_(first, buffer_size_ - 1);
+            state.occupancy_ = buffer_size_ - low;
+            state.next_free_ = now - oldest > duration_ ? now : oldest + duration_;
+            state.consistent_ = index_.load(std::memory_order_acquire) == index &&
+                                timestamps_[first].load(std::memory_order_acquire) == oldest;
+        }
+        return state;
+    }
+
+    // Writes state() as one line of text, snprintf-style: returns the length the full line needs.
+    size_t format(char *buffer, size_t size) const
+    {
+        State state = this->state();
+        int length = std::snprintf(buffer, size,
+                                   "capacity=%u index=%u occupancy=%u oldest=%lld newest=%lld next_free=%lld"
+                                   " consistent=%d",
+                                   state.capacity_, state.index_, state.occupancy_,
+                                   static_cast<long long>(state.oldest_), static_cast<long long>(state.newest_),
+                                   static_cast<long long>(state.next_free_), state.consistent_ ? 1 : 0);
+        return length < 0 ? 0 : static_cast<size_t>(length);
+    }
+
+    // Calls visitor(timestamp) for every slot from oldest to newest, as the ring is being updated.
+    template <typename Visitor>
+    void visit_timestamps(Visitor &&visitor) const
+    {
+        uint32_t first = static_cast<uint32_t>(index_.load(std::memory_order_acquire)) % buffer_size_;
+        for (uint32_t i = 0; i < buffer_size_; ++i) {
+            visitor(slot_(first, i));
+        }
+    }
+
+    // The same line format() writes; it used to list every timestamp.
+    std::string toString() const
+    {
+        char buffer[kFormatSize];
+        size_t length = format(buffer, sizeof(buffer));
+        return std::string(buffer, length < sizeof(buffer) ? length : sizeof(buffer) - 1);
     }
 
 private:
+    friend class ThrottleSnapshot;
+
+    static constexpr size_t kStripes = 64;
+    static constexpr int kStateAttempts = 4;
+    static constexpr size_t kFormatSize = 192;
+
+    struct alignas(64) Stripe
+    {
+        std::atomic<uint64_t> allowed_{0};
+        std::atomic<uint64_t> rejected_{0};
+        std::atomic<uint64_t> blocking_calls_{0};
+        std::atomic<uint64_t> total_wait_ns_{0};
+        std::atomic<uint64_t> max_wait_ns_{0};
+    };
+
+    enum ContentionCounter : size_t
+    {
+        kIndexFailure,
+        kTimestampFailure,
+        kCapped,
+        kRetries,
+    };
+
+    struct alignas(64) ContentionStripe
+    {
+        std::atomic<uint64_t> counts_[kRetries + Contention::kRetryBuckets] = {};
+    };
+
+    struct Histograms
+    {
+        WaitHistogram waits_;
+        WaitHistogram blocked_;
+    };
+
+    static int64_t now_()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::high_resolution_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // Threads take stripes round-robin on first use, so up to kStripes
+    // threads each own one and further threads share.
+    static size_t stripe_index_()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return index;
+    }
+
+    Stripe &stripe_() const { return stripes_[stripe_index_()]; }
+
+    int64_t slot_(uint32_t first, uint32_t offset) const
+    {
+        uint32_t slot = first + offset;
+        slot = slot >= buffer_size_ ? slot - buffer_size_ : slot;
+        return timestamps_[slot].load(std::memory_order_acquire);
+    }
+
+    void contended_(size_t counter)
+    {
+        if (contention_) {
+            contention_[stripe_index_()].counts_[counter].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void retried_(int attempt)
+    {
+        size_t bucket = static_cast<size_t>(attempt);
+        contended_(kRetries + (bucket < Contention::kRetryBuckets ? bucket : Contention::kRetryBuckets - 1));
+    }
+
+    void trace_decision_(int64_t now, int64_t wait)
+    {
+        DecisionTrace *trace = trace_.load(std::memory_order_relaxed);
+        if (trace == nullptr) {
+            return;
+        }
+        if (DecisionTrace::Ring *ring = trace->sample_()) {
+            trace->push_(*ring, now, 0, 1, wait);
+        }
+    }
+
+    void record_wait_(int64_t waited)
+    {
+        Stripe &stripe = stripe_();
+        uint64_t wait = waited > 0 ? static_cast<uint64_t>(waited) : 0;
+        stripe.blocking_calls_.fetch_add(1, std::memory_order_relaxed);
+        stripe.total_wait_ns_.fetch_add(wait, std::memory_order_relaxed);
+        histograms_->blocked_.record(wait);
+        uint64_t max = stripe.max_wait_ns_.load(std::memory_order_relaxed);
+        while (wait > max && !stripe.max_wait_ns_.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+        }
+    }
+
+    int64_t decide_(int64_t &now)
+    {
+        now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::high_resolution_clock::now().time_since_epoch())
+                  .count();
+
+        for (int attempt = 0; attempt < buffer_size_; ++attempt) {
+            int current_index = index_.load(std::memory_order_acquire) % buffer_size_;
+
+            int64_t expected = timestamps_[current_index].load(std::memory_order_acquire);
+
+            if (now - expected > duration_) {
+                int32_t next_index = (current_index + 1) % buffer_size_;
+                if (index_.compare_exchange_weak(current_index, next_index, std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+                    if (timestamps_[current_index].compare_exchange_weak(expected, now, std::memory_order_acq_rel,
+                                                                         std::memory_order_acquire)) {
+                        retried_(attempt);
+                        return 0;
+                    } else {
+                        contended_(kTimestampFailure);
+                        assert(false && "Failed to update timestamp");
+                    }
+                } else {
+                    contended_(kIndexFailure);
+                }
+            } else {
+                retried_(attempt);
+                return duration_ - (now - expected);
+            }
+        }
+
+        contended_(kCapped);
+        return duration_;
+    }
+
     uint32_t buffer_size_;
     int64_t duration_;
     std::vector<std::atomic<int64_t>> timestamps_;
     std::atomic<int> index_{0};
+    std::unique_ptr<Stripe[]> stripes_;
+    std::unique_ptr<Histograms> histograms_;
+    std::atomic<DecisionTrace *> trace_{nullptr};
+    std::atomic<RateEstimator *> rates_{nullptr};
+    std::unique_ptr<ContentionStripe[]> contention_;
 };
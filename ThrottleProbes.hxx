@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+// USDT (SystemTap/DTrace-style) static probes under the "throttle" provider.
+// Each probe compiles to a single NOP plus an ELF note describing where its
+// arguments live, so it can stay in release builds; bpftrace or perf patch
+// the NOP only while something is attached, e.g.
+//
+//   bpftrace -e 'usdt:./app:throttle:reject { @wait = hist(arg2); }'
+//
+// Every probe takes (limiter, key hash, wait ns). limiter is the address of
+// the limiter object; the key hash is 0 for limiters without keys.
+//
+//   admit        a decision admitted the request; wait is 0
+//   reject       a decision was refused; wait is how long until it would pass
+//   block_begin  a blocking call is about to wait; wait is the first decision's wait
+//   block_end    the blocking call returned; wait is the same value as block_begin,
+//                so the time actually spent is the gap between the two probes
+//
+// Without <sys/sdt.h>, or with THROTTLE_NO_PROBES defined, the probes expand
+// to nothing and their arguments are not evaluated.
+#if defined(__has_include) && !defined(THROTTLE_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define THROTTLE_HAS_PROBES 1
+#endif
+#endif
+
+#ifdef THROTTLE_HAS_PROBES
+#define THROTTLE_PROBE(name, limiter, key, wait)                                                                      \
+    DTRACE_PROBE3(throttle, name, reinterpret_cast<uintptr_t>(limiter), static_cast<uint64_t>(key),                   \
+                  static_cast<int64_t>(wait))
+#else
+#define THROTTLE_PROBE(name, limiter, key, wait)                                                                      \
+    do {                                                                                                              \
+    } while (0)
+#endif
+
+// Fires admit or reject for a decision that returned wait. Without probes the
+// test on wait goes too.
+#ifdef THROTTLE_HAS_PROBES
+#define THROTTLE_PROBE_DECISION(limiter, key, wait)                                                                   \
+    do {                                                                                                              \
+        if ((wait) == 0) {                                                                                            \
+            THROTTLE_PROBE(admit, limiter, key, wait);                                                                \
+        } else {                                                                                                      \
+            THROTTLE_PROBE(reject, limiter, key, wait);                                                               \
+        }                                                                                                             \
+    } while (0)
+#else
+#define THROTTLE_PROBE_DECISION(limiter, key, wait)                                                                   \
+    do {                                                                                                              \
+    } while (0)
+#endif
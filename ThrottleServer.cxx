@@ -0,0 +1,43 @@
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+#include "RespServer.hxx"
+
+// Usage: ThrottleServer [port] [threads] [capacity]
+//
+// Serves CL.THROTTLE over RESP on 127.0.0.1 until SIGINT or SIGTERM, e.g.
+//   redis-cli -p 6380 CL.THROTTLE user:42 15 30 60 1
+
+static volatile std::sig_atomic_t g_stop = 0;
+
+static void on_signal(int) { g_stop = 1; }
+
+int main(int argc, char **argv)
+{
+    uint16_t port = argc > 1 ? static_cast<uint16_t>(std::atoi(argv[1])) : 6380;
+    size_t threads = argc > 2 ? static_cast<size_t>(std::atoi(argv[2])) : 1;
+    size_t capacity = argc > 3 ? static_cast<size_t>(std::atoll(argv[3])) : 1 << 20;
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    try {
+        // The default rate is unused: every CL.THROTTLE call carries its own.
+        KeyedThrottle throttle(1, capacity);
+        RespServer server(throttle, port, threads);
+        std::cout << "Listening on 127.0.0.1:" << server.port() << " with " << threads << " thread(s)" << std::endl;
+        while (!g_stop) {
+            ::usleep(100000);
+            throttle.sweep(capacity / 64 + 1);
+        }
+        server.stop();
+        std::cout << "Served " << server.commands() << " commands" << std::endl;
+    } catch (const std::exception &e) {
+        std::cerr << "ThrottleServer: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
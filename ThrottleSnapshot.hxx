@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CompactThrottle.hxx"
+#include "KeyedThrottle.hxx"
+#include "ThrottleCrontol.hxx"
+
+// Saves limiter state to a file before a restart and loads it back, so a
+// restarted process keeps its history instead of letting a fresh burst of
+// tps through. All limiters keep wall-clock nanoseconds, so saved state
+// stays meaningful in the next process.
+//
+// A snapshot is a fixed header followed by 64-bit words, written through a
+// shared mapping into <path>.tmp and renamed over path, so readers see
+// either the old file or the complete new one. load() maps the file and
+// rejects it (std::runtime_error) unless the magic, kind, size and checksum
+// all match; callers can then start fresh. Keyed snapshots only hold keys
+// that are not idle, so saving and loading are linear in live keys: first a
+// (key, tat) pair per numeric key, then per string key its tat, its length
+// and its bytes packed into words.
+class ThrottleSnapshot
+{
+public:
+    // Saves the exact sliding log: every timestamp plus the ring position.
+    static void save(const std::string &path, const ThrottleControl &throttle, bool durable = false)
+    {
+        Writer writer(path, kControl, 1 + throttle.buffer_size_, durable);
+        writer.header_->count_ = throttle.buffer_size_;
+        writer.words_[0] = static_cast<uint64_t>(throttle.index_.load(std::memory_order_acquire));
+        for (uint32_t i = 0; i < throttle.buffer_size_; ++i) {
+            writer.words_[1 + i] = static_cast<uint64_t>(throttle.timestamps_[i].load(std::memory_order_acquire));
+        }
+        writer.commit(1 + throttle.buffer_size_);
+    }
+
+    static void save(const std::string &path, const CompactThrottle &throttle, bool durable = false)
+    {
+        Writer writer(path, kCompact, 1, durable);
+        writer.header_->count_ = 1;
+        writer.words_[0] = static_cast<uint64_t>(throttle.tat());
+        writer.commit(1);
+    }
+
+    // Keys inserted while saving may or may not be included. Returns the number of keys saved.
+    static size_t save(const std::string &path, const KeyedThrottle &throttle, int64_t now, bool durable = false)
+    {
+        // String keys are gathered first so the mapping can be sized for their bytes.
+        std::vector<uint64_t> strings;
+        size_t string_count = 0;
+        throttle.visit_strings([&](std::string_view key, int64_t tat) {
+            if (tat > now && string_count < throttle.capacity()) {
+                strings.push_back(static_cast<uint64_t>(tat));
+                strings.push_back(key.size());
+                for (size_t offset = 0; offset < key.size(); offset += sizeof(uint64_t)) {
+                    uint64_t word = 0;
+                    std::memcpy(&word, key.data() + offset, std::min(key.size() - offset, sizeof(word)));
+                    strings.push_back(word);
+                }
+                ++string_count;
+            }
+        });
+
+        size_t limit = throttle.capacity() - string_count;
+        Writer writer(path, kKeyed, 2 * limit + strings.size(), durable);
+        writer.header_->interval_ = throttle.rate().interval_;
+        writer.header_->window_ = throttle.rate().window_;
+        size_t count = 0;
+        throttle.visit_ids([&](uint64_t key, int64_t tat) {
+            if (tat > now && count < limit) {
+                writer.words_[2 * count] = key;
+                writer.words_[2 * count + 1] = static_cast<uint64_t>(tat);
+                ++count;
+            }
+        });
+        if (!strings.empty()) {
+            std::memcpy(writer.words_ + 2 * count, strings.data(), strings.size() * sizeof(uint64_t));
+        }
+        writer.header_->count_ = count;
+        writer.header_->strings_ = static_cast<uint32_t>(string_count);
+        writer.commit(2 * count + strings.size());
+        return count + string_count;
+    }
+
+    static size_t save(const std::string &path, const KeyedThrottle &throttle, bool durable = false)
+    {
+        return save(path, throttle, CompactThrottle::now_(), durable);
+    }
+
+    // The ring size is part of the state, so throttle must have the saved tps.
+    static void load(const std::string &path, ThrottleControl &throttle)
+    {
+        Reader reader(path, kControl);
+        if (reader.header_->count_ != throttle.buffer_size_ || reader.size_ != 1 + throttle.buffer_size_) {
+            throw std::invalid_argument("Snapshot " + path + " was saved with a different tps");
+        }
+        for (uint32_t i = 0; i < throttle.buffer_size_; ++i) {
+            throttle.timestamps_[i].store(static_cast<int64_t>(reader.words_[1 + i]), std::memory_order_relaxed);
+        }
+        throttle.index_.store(static_cast<int>(reader.words_[0] % throttle.buffer_size_), std::memory_order_release);
+    }
+
+    static void load(const std::string &path, CompactThrottle &throttle)
+    {
+        Reader reader(path, kCompact);
+        if (reader.size_ != 1) {
+            throw std::runtime_error("Snapshot " + path + " is corrupt");
+        }
+        throttle.restore(static_cast<int64_t>(reader.words_[0]));
+    }
+
+    // TATs only mean something under the rate they were earned at, so
+    // throttle must have the saved rate. Keys that went idle since the save
+    // are skipped. Returns the number of keys restored.
+    static size_t load(const std::string &path, KeyedThrottle &throttle, int64_t now)
+    {
+        Reader reader(path, kKeyed);
+        const CompactThrottle::Rate &rate = throttle.rate();
+        if (reader.header_->interval_ != rate.interval_ || reader.header_->window_ != rate.window_) {
+            throw std::invalid_argument("Snapshot " + path + " was saved with a different rate");
+        }
+        uint64_t count = reader.header_->count_;
+        if (count > reader.size_ / 2) {
+            throw std::runtime_error("Snapshot " + path + " is corrupt");
+        }
+        // Validate the string section before restoring anything.
+        size_t position = 2 * count;
+        for (uint32_t i = 0; i < reader.header_->strings_; ++i) {
+            if (reader.size_ - position < 2 || reader.words_[position + 1] > std::numeric_limits<uint32_t>::max() ||
+                reader.size_ - position - 2 < (reader.words_[position + 1] + 7) / 8) {
+                throw std::runtime_error("Snapshot " + path + " is corrupt");
+            }
+            position += 2 + (reader.words_[position + 1] + 7) / 8;
+        }
+        if (position != reader.size_) {
+            throw std::runtime_error("Snapshot " + path + " is corrupt");
+        }
+
+        size_t restored = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            restored += throttle.restore_(reader.words_[2 * i], static_cast<int64_t>(reader.words_[2 * i + 1]), now);
+        }
+        position = 2 * count;
+        for (uint32_t i = 0; i < reader.header_->strings_; ++i) {
+            int64_t tat = static_cast<int64_t>(reader.words_[position]);
+            size_t length = static_cast<size_t>(reader.words_[position + 1]);
+            std::string_view key(reinterpret_cast<const char *>(reader.words_ + position + 2), length);
+            restored += throttle.restore_(key, tat, now);
+            position += 2 + (length + 7) / 8;
+        }
+        return restored;
+    }
+
+    static size_t load(const std::string &path, KeyedThrottle &throttle)
+    {
+        return load(path, throttle, CompactThrottle::now_());
+    }
+
+private:
+    static constexpr char kMagic[8] = {'T', 'H', 'R', 'S', 'N', 'A', 'P', '1'};
+    static constexpr uint32_t kControl = 1;
+    static constexpr uint32_t kCompact = 2;
+    static constexpr uint32_t kKeyed = 3;
+
+    struct Header
+    {
+        char magic_[8];
+        uint32_t kind_;
+        uint32_t strings_;  // string keys following the numeric ones in a keyed snapshot
+        uint64_t count_;
+        uint64_t words_;
+        int64_t interval_;
+        int64_t window_;
+        int64_t saved_at_;
+        uint64_t checksum_;
+    };
+
+    static_assert(sizeof(Header) == 64, "Snapshot header must stay one cache line");
+
+    static uint64_t checksum_(const Header &header, const uint64_t *words, size_t size)
+    {
+        uint64_t sum = 0x9e3779b97f4a7c15ULL ^ header.kind_ ^ (header.count_ << 8) ^ (header.words_ << 32);
+        sum ^= static_cast<uint64_t>(header.strings_) << 48;
+        sum ^= static_cast<uint64_t>(header.interval_) * 0xff51afd7ed558ccdULL;
+        sum ^= static_cast<uint64_t>(header.window_) * 0xc4ceb9fe1a85ec53ULL;
+        for (size_t i = 0; i < size; ++i) {
+            sum = (sum ^ words[i]) * 0x100000001b3ULL;
+            sum ^= sum >> 31;
+        }
+        return sum;
+    }
+
+    [[noreturn]] static void fail_(const char *call, const std::string &path)
+    {
+        throw std::system_error(errno, std::generic_category(), std::string(call) + " " + path);
+    }
+
+    // Maps a temporary file large enough for capacity words; commit() trims it and renames it into place.
+    class Writer
+    {
+    public:
+        Writer(const std::string &path, uint32_t kind, size_t capacity, bool durable)
+            : path_(path), temp_(path + ".tmp"), durable_(durable)
+        {
+            fd_ = ::open(temp_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd_ < 0) {
+                fail_("open", temp_);
+            }
+            length_ = sizeof(Header) + capacity * sizeof(uint64_t);
+            if (::ftruncate(fd_, static_cast<off_t>(length_)) != 0) {
+                cleanup_();
+                fail_("ftruncate", temp_);
+            }
+            void *address = ::mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (address == MAP_FAILED) {
+                cleanup_();
+                fail_("mmap", temp_);
+            }
+            base_ = static_cast<char *>(address);
+            header_ = reinterpret_cast<Header *>(base_);
+            words_ = reinterpret_cast<uint64_t *>(base_ + sizeof(Header));
+            std::memset(header_, 0, sizeof(Header));
+            header_->kind_ = kind;
+        }
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        ~Writer() { cleanup_(); }
+
+        void commit(size_t size)
+        {
+            header_->words_ = size;
+            header_->saved_at_ = CompactThrottle::now_();
+            header_->checksum_ = checksum_(*header_, words_, size);
+            // The magic goes in last, so a torn file can never validate.
+            std::memcpy(header_->magic_, kMagic, sizeof(kMagic));
+            size_t used = sizeof(Header) + size * sizeof(uint64_t);
+            if (durable_ && ::msync(base_, used, MS_SYNC) != 0) {
+                cleanup_();
+                fail_("msync", temp_);
+            }
+            ::munmap(base_, length_);
+            base_ = nullptr;
+            if (::ftruncate(fd_, static_cast<off_t>(used)) != 0 || (durable_ && ::fsync(fd_) != 0)) {
+                cleanup_();
+                fail_("ftruncate", temp_);
+            }
+            if (::rename(temp_.c_str(), path_.c_str()) != 0) {
+                cleanup_();
+                fail_("rename", path_);
+            }
+            ::close(fd_);
+            fd_ = -1;
+        }
+
+        Header *header_ = nullptr;
+        uint64_t *words_ = nullptr;
+
+    private:
+        void cleanup_()
+        {
+            if (base_ != nullptr) {
+                ::munmap(base_, length_);
+                base_ = nullptr;
+            }
+            if (fd_ >= 0) {
+                int error = errno;
+                ::close(fd_);
+                ::unlink(temp_.c_str());
+                fd_ = -1;
+                errno = error;
+            }
+        }
+
+        std::string path_;
+        std::string temp_;
+        bool durable_;
+        int fd_ = -1;
+        size_t length_ = 0;
+        char *base_ = nullptr;
+    };
+
+    class Reader
+    {
+    public:
+        Reader(const std::string &path, uint32_t kind)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                fail_("open", path);
+            }
+            struct stat info;
+            if (::fstat(fd, &info) != 0) {
+                ::close(fd);
+                fail_("fstat", path);
+            }
+            length_ = static_cast<size_t>(info.st_size);
+            if (length_ < sizeof(Header) || (length_ - sizeof(Header)) % sizeof(uint64_t) != 0) {
+                ::close(fd);
+                throw std::runtime_error("Snapshot " + path + " is truncated");
+            }
+            void *address = ::mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                fail_("mmap", path);
+            }
+            base_ = static_cast<const char *>(address);
+            header_ = reinterpret_cast<const Header *>(base_);
+            words_ = reinterpret_cast<const uint64_t *>(base_ + sizeof(Header));
+            size_ = (length_ - sizeof(Header)) / sizeof(uint64_t);
+
+            if (const char *problem = validate_(kind)) {
+                ::munmap(const_cast<char *>(base_), length_);
+                throw std::runtime_error("Snapshot " + path + problem);
+            }
+        }
+
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        ~Reader() { ::munmap(const_cast<char *>(base_), length_); }
+
+        const Header *header_ = nullptr;
+        const uint64_t *words_ = nullptr;
+        size_t size_ = 0;
+
+    private:
+        const char *validate_(uint32_t kind) const
+        {
+            if (std::memcmp(header_->magic_, kMagic, sizeof(kMagic)) != 0) {
+                return " has no valid header";
+            }
+            if (header_->kind_ != kind) {
+                return " holds a different kind of limiter";
+            }
+            if (header_->words_ != size_ || header_->checksum_ != checksum_(*header_, words_, size_)) {
+                return " is corrupt";
+            }
+            return nullptr;
+        }
+
+        size_t length_ = 0;
+        const char *base_ = nullptr;
+    };
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "ShardOwners.hxx"
+
+// Log-linear (HDR-style) histogram of nanosecond durations. Values below
+// 2^kSubBits get a bucket each; above that every power of two is split
+// into 2^kSubBits linear buckets, so any value is reported within 1/32
+// (about 3%) of what was recorded, from 1 ns up to 2^63 ns, in 15 KB of
+// counters per shard.
+//
+// A thread records into the shard it owns through ShardOwners and counts
+// with a plain load and store. Threads whose shard is owned by another
+// share one extra shard through fetch_add, so the first few threads pay no
+// atomic RMW. snapshot() only ever reads counters,
+// so writers never wait. snapshot(true) also makes the counts seen so far
+// the baseline that later snapshots subtract, so every recording lands in
+// exactly one of two consecutive resetting snapshots.
+class WaitHistogram
+{
+public:
+    static constexpr unsigned kSubBits = 5;
+    static constexpr size_t kSubBuckets = size_t(1) << kSubBits;
+    static constexpr size_t kBuckets = kSubBuckets + (63 - kSubBits + 1) * kSubBuckets;
+
+    class Snapshot
+    {
+    public:
+        uint64_t count() const { return count_; }
+
+        uint64_t bucket(size_t index) const { return counts_[index]; }
+
+        // Upper bound of the bucket holding the value at or below which
+        // fraction p (0 to 1) of the recordings fall; 0 when empty.
+        uint64_t percentile(double p) const
+        {
+            if (count_ == 0) {
+                return 0;
+            }
+            uint64_t rank = p <= 0 ? 1 : static_cast<uint64_t>(p * static_cast<double>(count_) + 0.999999);
+            rank = rank < 1 ? 1 : (rank > count_ ? count_ : rank);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += counts_[i];
+                if (seen >= rank) {
+                    return highest_(i);
+                }
+            }
+            return highest_(kBuckets - 1);
+        }
+
+        uint64_t max() const { return percentile(1.0); }
+
+        // Mean of the bucket midpoints.
+        double mean() const
+        {
+            if (count_ == 0) {
+                return 0;
+            }
+            double sum = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                if (counts_[i] != 0) {
+                    sum += counts_[i] * (static_cast<double>(lowest_(i)) + static_cast<double>(highest_(i))) / 2;
+                }
+            }
+            return sum / static_cast<double>(count_);
+        }
+
+        void merge(const Snapshot &other)
+        {
+            for (size_t i = 0; i < kBuckets; ++i) {
+                counts_[i] += other.counts_[i];
+            }
+            count_ += other.count_;
+        }
+
+    private:
+        friend class WaitHistogram;
+
+        uint64_t counts_[kBuckets] = {};
+        uint64_t count_ = 0;
+    };
+
+    static constexpr size_t kShards = 8;
+
+    WaitHistogram()
+    {
+        for (auto &shard : shards_) {
+            for (auto &count : shard.counts_) {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    WaitHistogram(const WaitHistogram &) = delete;
+    WaitHistogram &operator=(const WaitHistogram &) = delete;
+
+    void record(uint64_t ns)
+    {
+        size_t shard = owners_.claim();
+        size_t index = index_(ns);
+        if (shard < kShards) {
+            std::atomic<uint64_t> &count = shards_[shard].counts_[index];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        } else {
+            shards_[kShards].counts_[index].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Snapshot snapshot(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Snapshot snapshot;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            uint64_t count = 0;
+            for (const auto &shard : shards_) {
+                count += shard.counts_[i].load(std::memory_order_relaxed);
+            }
+            snapshot.counts_[i] = count - baseline_[i];
+            snapshot.count_ += snapshot.counts_[i];
+            if (reset) {
+                baseline_[i] = count;
+            }
+        }
+        return snapshot;
+    }
+
+    static size_t index_(uint64_t ns)
+    {
+        if (ns < kSubBuckets) {
+            return static_cast<size_t>(ns);
+        }
+        unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+        unsigned shift = exponent - kSubBits;
+        return kSubBuckets + shift * kSubBuckets + static_cast<size_t>((ns >> shift) - kSubBuckets);
+    }
+
+    static uint64_t lowest_(size_t index)
+    {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        unsigned shift = static_cast<unsigned>((index - kSubBuckets) / kSubBuckets);
+        return (kSubBuckets + (index - kSubBuckets) % kSubBuckets) << shift;
+    }
+
+    static uint64_t highest_(size_t index)
+    {
+        if (index < kSubBuckets) {
+            return index;
+        }
+        unsigned shift = static_cast<unsigned>((index - kSubBuckets) / kSubBuckets);
+        return lowest_(index) + ((uint64_t(1) << shift) - 1);
+    }
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> counts_[kBuckets];
+    };
+
+    ShardOwners<kShards> owners_;
+    Shard shards_[kShards + 1];  // the last one is shared
+    uint64_t baseline_[kBuckets] = {};
+    std::mutex mutex_;
+};